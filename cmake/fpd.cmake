@@ -8,6 +8,10 @@ add_library(fpd
     fpd/fpd_flash.cc
     fpd/sjtagUtil.c
     fpd/commonUtil.c
+    fpd/mmioUtil.c
+    fpd/sjtagSim.c
+    fpd/fpdJournal.c
+    fpd/mtdUtil.c
     fpd/fpd_utils.cc
     fpd/fpd_cpucpld.cc
     fpd/fpd_powercpld.cc
@@ -23,3 +27,9 @@ target_include_directories( fpd
       ${json_SOURCE_DIR}/include
       ${date_SOURCE_DIR}/include
 )
+target_link_libraries(fpd
+    crypto
+    z
+    zstd
+    pthread
+)
@@ -0,0 +1,8 @@
+# fpd_catalog_bench
+
+add_executable(fpd_catalog_bench
+    src/fpd_catalog_bench/fpd_catalog_bench.cc
+)
+target_link_libraries(fpd_catalog_bench
+    fpd
+)
@@ -0,0 +1,8 @@
+# fpd_flash_bench
+
+add_executable(fpd_flash_bench
+    src/fpd_flash_bench/fpd_flash_bench.cc
+)
+target_link_libraries(fpd_flash_bench
+    fpd
+)
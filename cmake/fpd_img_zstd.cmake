@@ -0,0 +1,8 @@
+# fpd_img_zstd
+
+add_executable(fpd_img_zstd
+    src/fpd_img_zstd/fpd_img_zstd.cc
+)
+target_link_libraries(fpd_img_zstd
+    fpd
+)
@@ -3,6 +3,7 @@
 add_library(fw_util
     src/fw_util/FirmwareExport.cc
     fboss/platform/fw_util/FirmwareUpgrade.cc
+    fboss/platform/fw_util/FirmwareManifest.cc
     fboss/platform/fw_util/FirmwareSandia.cc
     fboss/platform/fw_util/FirmwareLassen.cc
     fboss/platform/fw_util/SandiaFw_utilConfig.cpp
@@ -3,6 +3,7 @@
 add_library(bsp-v2
     src/libbsp-v2/fpd/fpd.cc
     src/libbsp-v2/fpd/fpd_static.cc
+    src/libbsp-v2/fpd/fpd_timing.cc
     src/libbsp-v2/idprom/idprom.cc
     src/libbsp-v2/idprom/idprom_factory.cc
     src/libbsp-v2/object/object.cc
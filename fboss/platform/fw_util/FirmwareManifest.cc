@@ -0,0 +1,292 @@
+/**
+ * @file FirmwareManifest.cc
+ *
+ * @brief fw_util manifest mode, many components in one run
+ *
+ * @copyright Copyright (c) 2022 by Cisco Systems, Inc.
+ *            All rights reserved.
+ *
+ * A manifest is a JSON list of components and the image for each:
+ *
+ *     [
+ *         { "name": "PIM1_IOFPGA", "path": "/tmp/pim_iofpga.img" },
+ *         { "name": "TAM", "path": "/tmp/tam.img",
+ *           "expected_version": "1.4", "pid": "8111-32EH-O" }
+ *     ]
+ *
+ * Every entry is validated before anything is touched: the image must
+ * parse as an FPD image (unless "raw" is true), carry a matching fw_md5,
+ * hold an image for "pid" if one is given and package the expected
+ * version ("expected_version" of the entry, else of the platform). Then
+ * components sharing a flash or controller run one after the other in
+ * manifest order, while the independent ones run at the same time.
+ *
+ */
+
+#include <errno.h>
+
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "fw_util.h"
+#include "FirmwareUpgrade.h"
+#include "commonUtil.h"
+
+struct manifest_entry_t {
+    std::string name;
+    std::string path;
+    std::string expected_version;
+    std::string pid;
+    bool raw = false;
+
+    std::shared_ptr<bsp2::fpd_t> fpd;
+    std::string group;                  // flash / controller it runs on
+    std::string packaged_version;
+    uint32_t mdata_version = 0;
+
+    std::string status = "skipped";
+    std::string message;
+    double elapsed_s = 0;
+};
+
+//
+// Components with the same key must not run at the same time: the uio
+// block of the flash when there is one, else the library driving it
+//
+static std::string
+manifest_group(const bsp2::fpd_t &fpd)
+{
+    try {
+        return "block:" + fpd.get_fpga_offset("uio_block_name");
+    } catch (const std::system_error &) {
+    }
+    if (!fpd.libpath().empty()) {
+        return "lib:" + fpd.libpath();
+    }
+    return "fpd:" + fpd.name();
+}
+
+//
+// Metadata, PID and digest checks of the image; empty if it passes
+//
+static std::string
+manifest_check_image(manifest_entry_t &e)
+{
+    char err_msg[ERRBUF_SIZE] = {0};
+    fpd_imgs_t *imgs = NULL;
+    std::string error;
+
+    int rc = get_imgs_info(e.path.c_str(), &imgs, err_msg, sizeof(err_msg));
+    if (rc) {
+        return std::string("not an FPD image: ") + err_msg;
+    }
+    e.mdata_version = imgs->meta[0].mver;
+    if (!e.pid.empty() && !fpd_find_img(imgs, e.pid.c_str(), NULL, NULL)) {
+        error = "no image for PID " + e.pid;
+    }
+    for (uint32_t i = 0; error.empty() && i < imgs->num_imgs; i++) {
+        rc = fpd_img_verify_digest(&imgs->meta[i], err_msg, sizeof(err_msg));
+        if (rc && rc != ENODATA) {
+            error = std::string("image ") + std::to_string(i) + ": " + err_msg;
+        }
+    }
+    fpd_free_imgs_info(imgs);
+    return error;
+}
+
+static std::string
+manifest_validate(manifest_entry_t &e)
+{
+    std::vector<std::shared_ptr<bsp2::fpd_t>> objs;
+
+    try {
+        objs = bsp2::fpd_t::factory(e.name);
+    } catch (const std::exception &ex) {
+        return ex.what();
+    }
+    if (objs.size() != 1) {
+        return "matches " + std::to_string(objs.size()) + " fpds";
+    }
+    e.fpd = objs[0];
+    e.group = manifest_group(*e.fpd);
+    if (!e.fpd->is_present()) {
+        return "not present";
+    }
+    if (!e.fpd->set_file_path(e.path)) {
+        return "invalid path " + e.path;
+    }
+    if (!e.raw) {
+        std::string error = manifest_check_image(e);
+        if (!error.empty()) {
+            return error;
+        }
+    }
+
+    std::string expected = e.expected_version.empty()
+                               ? e.fpd->get_expected_version()
+                               : e.expected_version;
+    try {
+        e.packaged_version = e.fpd->packaged_version();
+    } catch (const std::system_error &ex) {
+        if (ex.code().value() != ENOTSUP) {
+            return ex.what();
+        }
+    }
+    // compare_version() throws on a version that is not <major>.<minor>
+    try {
+        if (!expected.empty() && !e.packaged_version.empty() &&
+            !(e.fpd->compare_version(e.packaged_version, expected) &&
+              e.fpd->compare_version(expected, e.packaged_version))) {
+            return "packaged version " + e.packaged_version + " is not the expected " +
+                   expected;
+        }
+    } catch (const std::exception &ex) {
+        return "cannot compare packaged version " + e.packaged_version +
+               " with " + expected + ": " + ex.what();
+    }
+    return "";
+}
+
+void
+FirmwareUpgradeCisco8000::manifest_run(manifest_entry_t &e,
+                                       const std::string &action) const
+{
+    auto start = std::chrono::steady_clock::now();
+
+    e.fpd->set_progress_handler(print_progress);
+    try {
+        if (action == "program") {
+            e.fpd->program(true);
+            e.message = "Program successful. Reboot or activate is required to complete the firmware upgrade";
+        } else if (action == "stage") {
+            e.fpd->stage(FW_UTIL_STAGE_RATE_KBS);
+            e.message = "Stage successful. Commit is required to complete the firmware upgrade";
+        } else {
+            e.message = e.fpd->verify();
+        }
+        e.status = "ok";
+    } catch (const std::exception &ex) {
+        e.status = "failed";
+        e.message = ex.what();
+    }
+    std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+    e.elapsed_s = secs.count();
+}
+
+void
+FirmwareUpgradeCisco8000::manifest_fw(std::string action, std::string path) const
+{
+    if (action != "program" && action != "stage" && action != "verify") {
+        std::cout << "manifest: " << action
+                  << " not supported, use program, stage or verify" << std::endl;
+        return;
+    }
+
+    std::ifstream file(path);
+    if (!file.good()) {
+        std::cout << "manifest: cannot open " << path << std::endl;
+        return;
+    }
+    json manifest = json::parse(file, nullptr, false);
+    if (manifest.is_discarded()) {
+        std::cout << "manifest: " << path << " is not valid JSON" << std::endl;
+        return;
+    }
+    if (!manifest.is_array()) {
+        std::cout << "manifest: " << path << " is not a list of components" << std::endl;
+        return;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<manifest_entry_t> entries;
+    std::vector<std::string> parse_errors;
+    for (const auto &it : manifest) {
+        manifest_entry_t e;
+        std::string error;
+        try {
+            e.name = it.at("name").get<std::string>();
+            e.path = it.at("path").get<std::string>();
+            e.expected_version = it.value("expected_version", "");
+            e.pid = it.value("pid", "");
+            e.raw = it.value("raw", false);
+        } catch (const json::exception &ex) {
+            error = std::string("malformed entry: ") + ex.what();
+        }
+        entries.push_back(e);
+        parse_errors.push_back(error);
+    }
+
+    //
+    // Nothing is written unless every entry passes, and no component
+    // may appear twice
+    //
+    bool valid = true;
+    std::map<std::string, std::vector<manifest_entry_t *>> groups;
+    for (size_t i = 0; i < entries.size(); i++) {
+        manifest_entry_t &e = entries[i];
+        std::string error = parse_errors[i];
+        if (error.empty()) {
+            try {
+                error = manifest_validate(e);
+            } catch (const std::exception &ex) {
+                error = ex.what();
+            }
+        }
+        for (const auto &other : entries) {
+            if (error.empty() && &other != &e && other.fpd && other.fpd == e.fpd) {
+                error = "listed more than once";
+            }
+        }
+        if (!error.empty()) {
+            e.status = "invalid";
+            e.message = error;
+            valid = false;
+        }
+        groups[e.group].push_back(&e);
+    }
+
+    if (valid) {
+        std::vector<std::thread> threads;
+        for (auto &group : groups) {
+            threads.emplace_back([this, &group, &action]() {
+                for (auto *e : group.second) {
+                    manifest_run(*e, action);
+                }
+            });
+        }
+        for (auto &t : threads) {
+            t.join();
+        }
+    }
+
+    std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+    json summary = {
+        {"manifest", path},
+        {"action", action},
+        {"status", "ok"},
+        {"elapsed_s", secs.count()},
+        {"components", json::array()},
+    };
+    for (const auto &e : entries) {
+        if (!valid) {
+            summary["status"] = "invalid";
+        } else if (e.status != "ok") {
+            summary["status"] = "failed";
+        }
+        summary["components"].push_back({
+            {"name", e.name},
+            {"path", e.path},
+            {"group", e.group},
+            {"mdata_version", e.mdata_version},
+            {"packaged_version", e.packaged_version},
+            {"status", e.status},
+            {"message", e.message},
+            {"elapsed_s", e.elapsed_s},
+        });
+    }
+    std::cout << summary.dump(4) << std::endl;
+}
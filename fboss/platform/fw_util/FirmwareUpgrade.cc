@@ -16,8 +16,11 @@
 
 #include <fstream>
 #include <filesystem>
+#include <iomanip>
+#include <sstream>
 #include <errno.h>
 #include <sysexits.h>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -33,12 +36,25 @@ FirmwareUpgradeCisco8000::print_usage(std::string &upgradable_components)
     std::cout << "usage:" << std::endl;
     std::cout << "fw_util <all|binary_name> <action> <binary_file>" << std::endl;
     std::cout << "<binary_name> : " << upgradable_components << std::endl;
-    std::cout << "<action> : program, verify, read, version" << std::endl;
+    std::cout << "<action> : program, stage, commit, verify, read, estimate, version" << std::endl;
+    std::cout
+        << "stage: write and verify the image in the background, commit: make a staged image bootable"
+        << std::endl;
+    std::cout
+        << "verify: compare the flash with <binary_file>, read: save the flash into <binary_file>"
+        << std::endl;
+    std::cout
+        << "estimate: predict how long programming <binary_file> takes from the timing history"
+        << std::endl;
     std::cout
         << "<binary_file> : path to binary file which is NOT supported when pulling fw version"
         << std::endl;
     std::cout
-        << "all: only supported when pulling fw version. Ex:fw_util all version"
+        << "all: only supported when pulling fw version or estimating. Ex:fw_util all version"
+        << std::endl;
+    std::cout
+        << "fw_util manifest <program|stage|verify> <manifest.json> : validate all components"
+        << " of a JSON manifest, then run them, independent ones in parallel"
         << std::endl;
 }
 
@@ -79,6 +95,28 @@ FirmwareUpgradeCisco8000::print_version(std::string fw_name) const
     }
 }
 
+/*
+ * Program / erase progress, one JSON object per line for orchestration.
+ * It goes to stderr, as stdout carries the text output of the flash
+ * routines. Components of a manifest report from several threads at once.
+ */
+void
+FirmwareUpgradeCisco8000::print_progress(const bsp2::fpd_t &fpd,
+                                         const bsp2::fpd_t::progress_t &progress)
+{
+    static std::mutex lock;
+    json j = {
+        {"fpd", fpd.name()},
+        {"phase", progress.phase},
+        {"bytes_done", progress.bytes_done},
+        {"bytes_total", progress.bytes_total},
+        {"mbps", progress.mbps},
+        {"eta_s", progress.eta_sec < 0 ? json(nullptr) : json(progress.eta_sec)},
+    };
+    std::lock_guard<std::mutex> l(lock);
+    std::cerr << j.dump() << std::endl;
+}
+
 void
 FirmwareUpgradeCisco8000::program_fw(std::string name, std::string path) const
 {
@@ -92,6 +130,7 @@ FirmwareUpgradeCisco8000::program_fw(std::string name, std::string path) const
         if (!fpd->set_file_path(path)) {
             std::cerr << fpd->name() << ": invalid path " << path << std::endl;
         }
+        fpd->set_progress_handler(print_progress);
         try {
             if (fpd->is_present()) {
                 fpd->program(true);
@@ -104,6 +143,166 @@ FirmwareUpgradeCisco8000::program_fw(std::string name, std::string path) const
     }
 }
 
+void
+FirmwareUpgradeCisco8000::stage_fw(std::string name, std::string path) const
+{
+    std::vector<std::shared_ptr<bsp2::fpd_t>> objs = bsp2::fpd_t::factory(name);
+    if (!objs.size()) {
+        std::cout << name << ": not present" << std::endl;
+        return;
+    }
+    for (auto fpd : objs) {
+        std::string stage_msg("not present");
+        if (!fpd->set_file_path(path)) {
+            std::cerr << fpd->name() << ": invalid path " << path << std::endl;
+        }
+        fpd->set_progress_handler(print_progress);
+        try {
+            if (fpd->is_present()) {
+                fpd->stage(FW_UTIL_STAGE_RATE_KBS);
+                stage_msg = "Stage successful. Commit is required to complete the firmware upgrade";
+            }
+        } catch (const std::exception &ex) {
+            stage_msg = std::string("[ERROR: ") + ex.what() + "]";
+        }
+        std::cout << fpd->name() << ": " << stage_msg << std::endl;
+    }
+}
+
+void
+FirmwareUpgradeCisco8000::commit_fw(std::string name, std::string path) const
+{
+    std::vector<std::shared_ptr<bsp2::fpd_t>> objs = bsp2::fpd_t::factory(name);
+    if (!objs.size()) {
+        std::cout << name << ": not present" << std::endl;
+        return;
+    }
+    for (auto fpd : objs) {
+        std::string commit_msg("not present");
+        if (!fpd->set_file_path(path)) {
+            std::cerr << fpd->name() << ": invalid path " << path << std::endl;
+        }
+        try {
+            if (fpd->is_present()) {
+                fpd->commit();
+                try {
+                    fpd->activate();
+                    commit_msg = "Commit and activate successful";
+                } catch (const std::system_error &ex) {
+                    if (ex.code().value() != ENOTSUP) {
+                        throw;
+                    }
+                    commit_msg = "Commit successful. Reboot is required to complete the firmware upgrade";
+                }
+            }
+        } catch (const std::exception &ex) {
+            commit_msg = std::string("[ERROR: ") + ex.what() + "]";
+        }
+        std::cout << fpd->name() << ": " << commit_msg << std::endl;
+    }
+}
+
+void
+FirmwareUpgradeCisco8000::verify_fw(std::string name, std::string path) const
+{
+    std::vector<std::shared_ptr<bsp2::fpd_t>> objs = bsp2::fpd_t::factory(name);
+    if (!objs.size()) {
+        std::cout << name << ": not present" << std::endl;
+        return;
+    }
+    for (auto fpd : objs) {
+        std::string verify_msg("not present");
+        if (!fpd->set_file_path(path)) {
+            std::cerr << fpd->name() << ": invalid path " << path << std::endl;
+        }
+        fpd->set_progress_handler(print_progress);
+        try {
+            if (fpd->is_present()) {
+                verify_msg = fpd->verify();
+            }
+        } catch (const std::exception &ex) {
+            verify_msg = std::string("[ERROR: ") + ex.what() + "]";
+        }
+        std::cout << fpd->name() << ": " << verify_msg << std::endl;
+    }
+}
+
+/*
+ * With more than one FPD matched, each is read into <path>.<fpd name>
+ */
+void
+FirmwareUpgradeCisco8000::read_fw(std::string name, std::string path) const
+{
+    std::vector<std::shared_ptr<bsp2::fpd_t>> objs = bsp2::fpd_t::factory(name);
+    if (!objs.size()) {
+        std::cout << name << ": not present" << std::endl;
+        return;
+    }
+    for (auto fpd : objs) {
+        std::string read_msg("not present");
+        std::string out_path = objs.size() > 1 ? path + "." + fpd->name() : path;
+        fpd->set_progress_handler(print_progress);
+        try {
+            if (fpd->is_present()) {
+                read_msg = fpd->read(out_path);
+            }
+        } catch (const std::exception &ex) {
+            read_msg = std::string("[ERROR: ") + ex.what() + "]";
+        }
+        std::cout << fpd->name() << ": " << read_msg << std::endl;
+    }
+}
+
+/*
+ * The estimate scales the per byte rates of the latest programs of each
+ * FPD to the size of the image; nothing is written. For all of them the
+ * estimates are also added up for the whole chassis.
+ */
+void
+FirmwareUpgradeCisco8000::estimate_fw(std::string name, std::string path) const
+{
+    std::vector<std::shared_ptr<bsp2::fpd_t>> objs;
+    if (name == "all") {
+        objs = bsp2::fpd_t::factory("");
+    } else {
+        objs = bsp2::fpd_t::factory(name);
+    }
+    if (!objs.size()) {
+        std::cout << name << ": not present" << std::endl;
+        return;
+    }
+    std::error_code ec;
+    uint64_t bytes = std::filesystem::file_size(path, ec);
+    if (ec) {
+        std::cout << path << ": " << ec.message() << std::endl;
+        return;
+    }
+    double total = 0;
+    int estimated = 0;
+    for (auto fpd : objs) {
+        std::ostringstream msg;
+        msg << std::fixed << std::setprecision(1);
+        try {
+            bsp2::fpd_t::estimate_t e = fpd->estimate(bytes);
+            total += e.secs;
+            estimated++;
+            msg << "about " << e.secs << " s for " << bytes << " bytes (";
+            for (const auto &it : e.phases) {
+                msg << it.first << " " << it.second << " s, ";
+            }
+            msg << "from " << e.runs << (e.runs == 1 ? " run)" : " runs)");
+        } catch (const std::exception &ex) {
+            msg << "[ERROR: " << ex.what() << "]";
+        }
+        std::cout << fpd->name() << ": " << msg.str() << std::endl;
+    }
+    if (name == "all") {
+        std::cout << std::fixed << std::setprecision(1) << "all: about " << total
+                  << " s for the " << estimated << " of " << objs.size()
+                  << " fpds with a timing history" << std::endl;
+    }
+}
+
 void
 FirmwareUpgradeCisco8000::upgradeFirmware(int argc, char **argv,
                                           std::string upgradable_components)
@@ -121,12 +320,24 @@ FirmwareUpgradeCisco8000::upgradeFirmware(int argc, char **argv,
                           << std::endl;
             }
             print_version(std::string(argv[1]));
+        } else if (argc == 4 && std::string(argv[1]) == std::string("manifest")) {
+            manifest_fw(std::string(argv[2]), std::string(argv[3]));
         } else if (argc != 4) {
             std::cout << "missing argument" << std::endl
                       << "please follow the usage below" << std::endl;
             print_usage(upgradable_components);
         } else if (std::string(argv[2]) == std::string("program")) {
             program_fw(std::string(argv[1]), std::string(argv[3]));
+        } else if (std::string(argv[2]) == std::string("stage")) {
+            stage_fw(std::string(argv[1]), std::string(argv[3]));
+        } else if (std::string(argv[2]) == std::string("commit")) {
+            commit_fw(std::string(argv[1]), std::string(argv[3]));
+        } else if (std::string(argv[2]) == std::string("verify")) {
+            verify_fw(std::string(argv[1]), std::string(argv[3]));
+        } else if (std::string(argv[2]) == std::string("read")) {
+            read_fw(std::string(argv[1]), std::string(argv[3]));
+        } else if (std::string(argv[2]) == std::string("estimate")) {
+            estimate_fw(std::string(argv[1]), std::string(argv[3]));
         } else {
             std::cout << "wrong usage. Please follow the usage" << std::endl;
             print_usage(upgradable_components);
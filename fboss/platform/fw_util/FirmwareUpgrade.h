@@ -19,6 +19,10 @@
 
 #include "bsp/fpd.h"
 
+// Image KB/s a background stage stays under, leaving SPI time to monitoring
+#define FW_UTIL_STAGE_RATE_KBS  512
+
+struct manifest_entry_t;
 
 class FirmwareUpgradeCisco8000 : public facebook::fboss::platform::fw_util::FirmwareUpgradeInterface
 {
@@ -38,8 +42,24 @@ public:
 
     void program_fw(std::string, std::string) const;
 
+    void stage_fw(std::string, std::string) const;
+
+    void commit_fw(std::string, std::string) const;
+
+    void verify_fw(std::string, std::string) const;
+
+    void read_fw(std::string, std::string) const;
+
+    void estimate_fw(std::string, std::string) const;
+
+    void manifest_fw(std::string, std::string) const;
+
 private:
     void print_usage(std::string &upgradable_components);
+
+    void manifest_run(manifest_entry_t &, const std::string &) const;
+
+    static void print_progress(const bsp2::fpd_t &, const bsp2::fpd_t::progress_t &);
 };
 
 #endif // FW_UPGRADE_CISCO8000_H_
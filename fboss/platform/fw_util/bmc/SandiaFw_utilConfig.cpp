@@ -14,11 +14,6 @@ std::string getSandiaFpdsData() {
   return R"json({
     "fpds": [
         {
-            "cmdline": [
-                "/opt/cisco/bin/bios_mtd_upgrade.sh",
-                "{PATH}",
-                "{PATH}"
-            ],
             "description": "BIOS - Basic Input Output System",
             "dllpath": "/opt/cisco/lib/libfpd_bmc_bios.so.1.0.1",
             "dllsymbol": "get_fpd_obj_bmc_bios",
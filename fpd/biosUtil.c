@@ -19,6 +19,7 @@
 #include <dlfcn.h>
 #include <errno.h>
 #include "biosUtil.h"
+#include "mtdUtil.h"
 
 
 void * 
@@ -151,3 +152,34 @@ int fpd_bios_get_active_flash(const char *block_name) {
     return data;
 }
 
+int bios_mtd_get_version(const char *mtd_name, uint64_t offset,
+                         char version[BIOS_VER_LEN],
+                         char *err_msg, uint32_t msg_size) {
+    /* Signature through version string, in one read */
+    char bvdt[BIOS_VERSION_OFFSET - BIOS_SIGNATURE_OFFSET + BIOS_VER_LEN - 1];
+    char signature[BIOS_VER_BVDT_LEN + 1];
+    char dev[MTD_DEV_NAME_LEN + 8];
+    int rc;
+
+    rc = mtd_find_device(mtd_name, dev, sizeof(dev), err_msg, msg_size);
+    if (rc) {
+        return rc;
+    }
+    rc = mtd_read(dev, offset + BIOS_SIGNATURE_OFFSET, bvdt, sizeof(bvdt),
+                  err_msg, msg_size);
+    if (rc) {
+        return rc;
+    }
+
+    memcpy(signature, bvdt, BIOS_VER_BVDT_LEN);
+    signature[BIOS_VER_BVDT_LEN] = '\0';
+    if (strcmp(signature, BIOS_VER_SIGNATURE)) {
+        snprintf(err_msg, msg_size, "Signature mismatch. Found: %s Expected: %s",
+                 signature, BIOS_VER_SIGNATURE);
+        return EBADMSG;
+    }
+    memcpy(version, bvdt + BIOS_VERSION_OFFSET - BIOS_SIGNATURE_OFFSET,
+           BIOS_VER_LEN - 1);
+    version[BIOS_VER_LEN - 1] = '\0';
+    return 0;
+}
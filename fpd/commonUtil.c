@@ -26,7 +26,11 @@
 #include <dlfcn.h>
 #include <fcntl.h>
 #include <zlib.h>
+#include <zstd.h>
+#include <pthread.h>
+#include <openssl/evp.h>
 #include "commonUtil.h"
+#include "mmioUtil.h"
 
 #define FPRINTF(out, ...) //fprintf(out, __VA_ARGS__)
 
@@ -188,6 +192,247 @@ get_img_metadata(const char *path, uint32_t *img_size, void **img,
   return 0;
 }
 
+static uint32_t
+fpd_mdata_hdr_size(const fpd_mdata_hdr_t *hdr)
+{
+    switch (hdr->u.v1.metadata_version) {
+    case FPD_META_DATA_VER_2:
+        return hdr->u.v2.metadata_size;
+    case FPD_META_DATA_VER_3:
+        return hdr->u.v3.metadata_size;
+    case FPD_META_DATA_VER_1:
+    default:
+        return hdr->u.v1.metadata_size;
+    }
+}
+
+typedef struct fpd_mdata_cache_ent_ {
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    fpd_mdata_probe_t probe;
+    void *mdata;
+} fpd_mdata_cache_ent_t;
+
+static pthread_mutex_t fpd_mdata_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static fpd_mdata_cache_ent_t fpd_mdata_cache[FPD_MDATA_CACHE_SIZE];
+static uint32_t fpd_mdata_cache_next;
+
+static fpd_mdata_cache_ent_t *
+fpd_mdata_cache_lookup(const char *path, const struct stat *st)
+{
+    int i;
+
+    for (i = 0; i < FPD_MDATA_CACHE_SIZE; i++) {
+        fpd_mdata_cache_ent_t *ent = &fpd_mdata_cache[i];
+
+        if (ent->path && !strcmp(ent->path, path) &&
+            ent->dev == st->st_dev && ent->ino == st->st_ino &&
+            ent->size == st->st_size &&
+            ent->mtime.tv_sec == st->st_mtim.tv_sec &&
+            ent->mtime.tv_nsec == st->st_mtim.tv_nsec) {
+            return ent;
+        }
+    }
+    return NULL;
+}
+
+static fpd_mdata_cache_ent_t *
+fpd_mdata_cache_insert(const char *path, const struct stat *st,
+                       const fpd_mdata_probe_t *probe, void *mdata)
+{
+    fpd_mdata_cache_ent_t *ent = NULL;
+    int i;
+
+    /* Replace a stale entry of the same path before evicting another one */
+    for (i = 0; i < FPD_MDATA_CACHE_SIZE; i++) {
+        if (fpd_mdata_cache[i].path && !strcmp(fpd_mdata_cache[i].path, path)) {
+            ent = &fpd_mdata_cache[i];
+            break;
+        }
+    }
+    if (!ent) {
+        ent = &fpd_mdata_cache[fpd_mdata_cache_next];
+        fpd_mdata_cache_next = (fpd_mdata_cache_next + 1) % FPD_MDATA_CACHE_SIZE;
+    }
+    free(ent->path);
+    free(ent->mdata);
+
+    ent->path = strdup(path);
+    ent->dev = st->st_dev;
+    ent->ino = st->st_ino;
+    ent->size = st->st_size;
+    ent->mtime = st->st_mtim;
+    ent->probe = *probe;
+    ent->mdata = mdata;
+    return ent;
+}
+
+int
+fpd_mdata_probe(const char *path, fpd_mdata_probe_t *probe, void **mdata,
+                char *err_msg, uint32_t msg_size)
+{
+    fpd_mdata_cache_ent_t *ent;
+    fpd_meta_data_t hdr;
+    fpd_mdata_probe_t result;
+    struct stat st;
+    void *metadata = NULL;
+    ssize_t n;
+    int fd;
+    int rc = 0;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        snprintf(err_msg, msg_size, "Failed to open file path %s", path);
+        return EINVAL;
+    }
+    if (fstat(fd, &st)) {
+        snprintf(err_msg, msg_size, "stat failed");
+        close(fd);
+        return EINVAL;
+    }
+
+    pthread_mutex_lock(&fpd_mdata_cache_lock);
+    ent = fpd_mdata_cache_lookup(path, &st);
+    if (ent) {
+        goto found;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    n = pread(fd, &hdr, sizeof(hdr), 0);
+    if (n < (ssize_t)sizeof(fpd_mdata_hdr_v1_t)) {
+        snprintf(err_msg, msg_size, "failed to read mdata");
+        rc = n < 0 ? errno : EINVAL;
+        goto clean_exit;
+    }
+
+    memset(&result, 0, sizeof(result));
+    result.mdata_size = fpd_mdata_hdr_size(&hdr.hdr);
+    FPRINTF(stderr, "mdata size is  %d\n", result.mdata_size);
+
+    if (!result.mdata_size || st.st_size < result.mdata_size) {
+        snprintf(err_msg, msg_size, "Size of file < mdata size");
+        rc = EINVAL;
+        goto clean_exit;
+    }
+    result.img_size = st.st_size - result.mdata_size;
+
+    /*
+     * Fetch the variable part of the metadata, never the image itself.
+     * The buffer is at least a full fpd_meta_data_t so that the version
+     * fields of short (v1) metadata can be decoded against zero padding.
+     */
+    metadata = calloc(1, result.mdata_size > sizeof(fpd_meta_data_t) ?
+                         result.mdata_size : sizeof(fpd_meta_data_t));
+    if (metadata == NULL) {
+        snprintf(err_msg, msg_size, "failed to allocate memory for metadata");
+        rc = ENOMEM;
+        goto clean_exit;
+    }
+    n = pread(fd, metadata, result.mdata_size, 0);
+    if (n != (ssize_t)result.mdata_size) {
+        snprintf(err_msg, msg_size, "failed to read mdata");
+        rc = n < 0 ? errno : EIO;
+        free(metadata);
+        goto clean_exit;
+    }
+    close(fd);
+    fd = -1;
+
+    if (fpd_mdata_get_fpd_version(metadata, &result.version) == 0) {
+        result.version_valid = 1;
+    }
+    ent = fpd_mdata_cache_insert(path, &st, &result, metadata);
+
+found:
+    *probe = ent->probe;
+    if (mdata) {
+        *mdata = malloc(ent->probe.mdata_size);
+        if (*mdata == NULL) {
+            snprintf(err_msg, msg_size, "failed to allocate memory for metadata");
+            rc = ENOMEM;
+        } else {
+            memcpy(*mdata, ent->mdata, ent->probe.mdata_size);
+        }
+    }
+
+clean_exit:
+    pthread_mutex_unlock(&fpd_mdata_cache_lock);
+    if (fd >= 0) {
+        close(fd);
+    }
+    return rc;
+}
+
+int
+fpd_img_map(const char *path, fpd_img_map_t *map,
+            char *err_msg, uint32_t msg_size)
+{
+    struct stat st;
+    void *base;
+    int fd;
+    int rc;
+
+    memset(map, 0, sizeof(*map));
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        snprintf(err_msg, msg_size, "Failed to open file path %s", path);
+        return EINVAL;
+    }
+    if (fstat(fd, &st)) {
+        snprintf(err_msg, msg_size, "stat failed");
+        close(fd);
+        return EINVAL;
+    }
+    if (st.st_size < (off_t)sizeof(fpd_mdata_hdr_v1_t) || st.st_size > UINT32_MAX) {
+        snprintf(err_msg, msg_size, "Invalid image size %lld", (long long)st.st_size);
+        close(fd);
+        return EINVAL;
+    }
+
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    rc = errno;
+    close(fd);
+    if (base == MAP_FAILED) {
+        snprintf(err_msg, msg_size, "failed to map %s: %s", path, strerror(rc));
+        return rc;
+    }
+    /* Images are consumed front to back exactly once */
+    (void)madvise(base, st.st_size, MADV_SEQUENTIAL);
+
+    map->base = base;
+    map->size = st.st_size;
+
+    if (*(uint32_t *)base == FPD_FILE_LIST_MAGIC) {
+        map->img = base;
+        map->img_size = map->size;
+        return 0;
+    }
+
+    map->mdata_size = fpd_mdata_hdr_size(base);
+    if (!map->mdata_size || map->size < map->mdata_size) {
+        snprintf(err_msg, msg_size, "Size of file < mdata size");
+        fpd_img_unmap(map);
+        return EINVAL;
+    }
+    map->mdata = base;
+    map->img = (uint8_t *)base + map->mdata_size;
+    map->img_size = map->size - map->mdata_size;
+    return 0;
+}
+
+void
+fpd_img_unmap(fpd_img_map_t *map)
+{
+    if (map->base) {
+        munmap(map->base, map->size);
+    }
+    memset(map, 0, sizeof(*map));
+}
+
 int
 get_data_info(void *data, fpd_meta_info_t *fpd_meta,
               char *err_msg, uint32_t msg_size)
@@ -224,10 +469,11 @@ get_data_info(void *data, fpd_meta_info_t *fpd_meta,
         fpd_meta->version_string = data_v2->fpd_ver_str;
         fpd_meta->md5 = data_v2->fw_md5;
 
-        if (data_v2->fw_type == FPD_FW_TYPE_GZIP) {
-            fpd_meta->compressed = 1;
+        if (data_v2->fw_type == FPD_FW_TYPE_GZIP ||
+            data_v2->fw_type == FPD_FW_TYPE_ZSTD) {
+            fpd_meta->compressed = data_v2->fw_type;
         } else {
-            fpd_meta->compressed = 0;
+            fpd_meta->compressed = FPD_FW_TYPE_PLAIN;
         }
         break;
     case FPD_META_DATA_VER_3:
@@ -246,10 +492,11 @@ get_data_info(void *data, fpd_meta_info_t *fpd_meta,
         fpd_meta->version_string = data_v3->fpd_ver_str;
         fpd_meta->md5 = data_v3->fw_md5;
 
-        if (data_v3->fw_type == FPD_FW_TYPE_GZIP) {
-            fpd_meta->compressed = 1;
+        if (data_v3->fw_type == FPD_FW_TYPE_GZIP ||
+            data_v3->fw_type == FPD_FW_TYPE_ZSTD) {
+            fpd_meta->compressed = data_v3->fw_type;
         } else {
-            fpd_meta->compressed = 0;
+            fpd_meta->compressed = FPD_FW_TYPE_PLAIN;
         }
         break;
     default:
@@ -270,6 +517,189 @@ get_data_info(void *data, fpd_meta_info_t *fpd_meta,
 
 }
 
+typedef struct fpd_zstd_frame_ {
+    uint32_t src_off;
+    uint32_t src_len;
+    uint32_t dst_off;
+    uint32_t dst_len;
+} fpd_zstd_frame_t;
+
+/*
+ * Locate the frames of a zstd payload and where each one decodes to
+ */
+static int
+fpd_zstd_index(const fpd_meta_info_t *meta, fpd_zstd_frame_t **frames,
+               uint32_t *count, char *err_msg, uint32_t msg_size)
+{
+    const uint8_t *src = meta->img;
+    fpd_zstd_frame_t *f = NULL, *grown;
+    uint32_t n = 0, max = 0, src_off = 0, dst_off = 0;
+    unsigned long long dst_len;
+    size_t src_len;
+
+    while (src_off < meta->img_size) {
+        src_len = ZSTD_findFrameCompressedSize(src + src_off,
+                                               meta->img_size - src_off);
+        dst_len = ZSTD_isError(src_len) ? ZSTD_CONTENTSIZE_ERROR :
+                  ZSTD_getFrameContentSize(src + src_off, src_len);
+        if (dst_len == ZSTD_CONTENTSIZE_ERROR ||
+            dst_len == ZSTD_CONTENTSIZE_UNKNOWN ||
+            dst_len > meta->img_msize - dst_off) {
+            snprintf(err_msg, msg_size,
+                     "bad or unsized zstd frame at offset 0x%x", src_off);
+            free(f);
+            return EBADMSG;
+        }
+        if (n == max) {
+            max = max ? max * 2 : 64;
+            grown = realloc(f, max * sizeof(*f));
+            if (!grown) {
+                snprintf(err_msg, msg_size, "failed to allocate zstd index");
+                free(f);
+                return ENOMEM;
+            }
+            f = grown;
+        }
+        f[n].src_off = src_off;
+        f[n].src_len = src_len;
+        f[n].dst_off = dst_off;
+        f[n].dst_len = dst_len;
+        src_off += src_len;
+        dst_off += dst_len;
+        n++;
+    }
+    if (dst_off != meta->img_msize) {
+        snprintf(err_msg, msg_size, "zstd payload decodes to 0x%x bytes, "
+                 "expected 0x%x", dst_off, meta->img_msize);
+        free(f);
+        return EBADMSG;
+    }
+    *frames = f;
+    *count = n;
+    return 0;
+}
+
+typedef struct fpd_zstd_job_ {
+    const uint8_t *src;
+    const fpd_zstd_frame_t *frames;
+    uint32_t count;
+    uint8_t *dst;                   /* where frames[0] decodes to */
+    uint32_t next;                  /* next frame to take, atomic */
+    int rc;
+} fpd_zstd_job_t;
+
+static void *
+fpd_zstd_decode_worker(void *arg)
+{
+    fpd_zstd_job_t *job = arg;
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+    const fpd_zstd_frame_t *f;
+    size_t len;
+    uint32_t i;
+
+    if (!dctx) {
+        __atomic_store_n(&job->rc, ENOMEM, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) <
+           job->count) {
+        f = &job->frames[i];
+        len = ZSTD_decompressDCtx(dctx,
+                                  job->dst + (f->dst_off - job->frames[0].dst_off),
+                                  f->dst_len, job->src + f->src_off, f->src_len);
+        if (ZSTD_isError(len) || len != f->dst_len) {
+            FPRINTF(stderr, "zstd frame %u: %s\n", i,
+                    ZSTD_isError(len) ? ZSTD_getErrorName(len) : "short");
+            __atomic_store_n(&job->rc, EIO, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+    ZSTD_freeDCtx(dctx);
+    return NULL;
+}
+
+static uint32_t
+fpd_zstd_threads(void)
+{
+    const char *env = getenv(FPD_ZSTD_THREADS_ENV);
+    long cpus = env ? atol(env) : sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (cpus < 1) {
+        return 1;
+    }
+    return cpus < FPD_ZSTD_THREADS_MAX ? cpus : FPD_ZSTD_THREADS_MAX;
+}
+
+/*
+ * Decode count frames into dst, spread over up to one thread per core
+ */
+static int
+fpd_zstd_decode(const uint8_t *src, const fpd_zstd_frame_t *frames,
+                uint32_t count, uint8_t *dst)
+{
+    fpd_zstd_job_t job = { src, frames, count, dst, 0, 0 };
+    pthread_t threads[FPD_ZSTD_THREADS_MAX];
+    uint32_t i, nthreads = fpd_zstd_threads();
+
+    if (nthreads > count) {
+        nthreads = count;
+    }
+    /* The calling thread is one of the decoders */
+    for (i = 1; i < nthreads; i++) {
+        if (pthread_create(&threads[i], NULL, fpd_zstd_decode_worker, &job)) {
+            break;
+        }
+    }
+    nthreads = i;
+    fpd_zstd_decode_worker(&job);
+    for (i = 1; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    return job.rc;
+}
+
+int
+fpd_zstd_encode(const void *data, uint32_t size, int level,
+                void **out, uint32_t *out_size,
+                char *err_msg, uint32_t msg_size)
+{
+    const uint8_t *src = data;
+    ZSTD_CCtx *cctx;
+    uint8_t *dst;
+    size_t cap, len;
+    uint32_t off, n, used = 0;
+
+    cap = (size / FPD_ZSTD_FRAME_SIZE + 1) *
+          ZSTD_compressBound(FPD_ZSTD_FRAME_SIZE);
+    dst = malloc(cap);
+    cctx = ZSTD_createCCtx();
+    if (!dst || !cctx) {
+        snprintf(err_msg, msg_size, "failed to set up zstd encoder");
+        free(dst);
+        ZSTD_freeCCtx(cctx);
+        return ENOMEM;
+    }
+    /* Every frame records its size so the decoder can place it */
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_contentSizeFlag, 1);
+    for (off = 0; off < size; off += n) {
+        n = size - off < FPD_ZSTD_FRAME_SIZE ? size - off : FPD_ZSTD_FRAME_SIZE;
+        len = ZSTD_compress2(cctx, dst + used, cap - used, src + off, n);
+        if (ZSTD_isError(len)) {
+            snprintf(err_msg, msg_size, "zstd encode failed: %s",
+                     ZSTD_getErrorName(len));
+            free(dst);
+            ZSTD_freeCCtx(cctx);
+            return EIO;
+        }
+        used += len;
+    }
+    ZSTD_freeCCtx(cctx);
+    *out = dst;
+    *out_size = used;
+    return 0;
+}
+
 int
 img_inflate(fpd_meta_info_t *fpd_meta, void **data,
               char *err_msg, uint32_t msg_size)
@@ -277,11 +707,31 @@ img_inflate(fpd_meta_info_t *fpd_meta, void **data,
     int rc;
     z_stream d_stream;
     uint32_t size = fpd_meta->img_msize;
+    fpd_zstd_frame_t *frames;
+    uint32_t count;
 
     if (!fpd_meta->compressed) {
         *data = fpd_meta->img;
         return 0;
     }
+    if (fpd_meta->compressed == FPD_FW_TYPE_ZSTD) {
+        rc = fpd_zstd_index(fpd_meta, &frames, &count, err_msg, msg_size);
+        if (rc) {
+            return rc;
+        }
+        *data = malloc(size ? size : 1);
+        if (!*data) {
+            free(frames);
+            return ENOMEM;
+        }
+        rc = fpd_zstd_decode(fpd_meta->img, frames, count, *data);
+        free(frames);
+        if (rc) {
+            snprintf(err_msg, msg_size, "failed to decode zstd image");
+            free(*data);
+        }
+        return rc;
+    }
     *data = calloc(size, 1);
 
     memset(&d_stream, 0, sizeof(z_stream));
@@ -317,21 +767,417 @@ img_inflate(fpd_meta_info_t *fpd_meta, void **data,
     return rc;
 }
 
+struct fpd_img_stream_ {
+    fpd_meta_info_t *meta;
+    uint32_t chunk_size;
+    uint32_t produced;              /* bytes handed to the caller */
+    uint32_t total;                 /* payload size when not compressed */
+
+    /* Compressed payload only */
+    z_stream zs;
+    fpd_zstd_frame_t *frames;       /* zstd frame index */
+    uint32_t frame_count;
+    uint32_t frame_next;            /* first frame of the next window */
+    pthread_t worker;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint8_t *window[2];
+    uint32_t window_len[2];
+    uint8_t window_ready[2];
+    int next;                       /* window the caller gets next */
+    int held;                       /* window the caller holds, or -1 */
+    int rc;
+    uint8_t eof;
+    uint8_t stop;
+
+    /* MD5 of everything produced so far, fed as the payload streams */
+    EVP_MD_CTX *md;
+};
+
+/*
+ * Fill window w from the payload. Returns 0 if more follows, ENODATA once
+ * the payload is complete, otherwise an errno.
+ */
+static int
+fpd_img_stream_inflate(fpd_img_stream_t *stream, int w, uint32_t *len)
+{
+    int rc = Z_OK;
+
+    stream->zs.next_out = stream->window[w];
+    stream->zs.avail_out = stream->chunk_size;
+    while (stream->zs.avail_out) {
+        rc = inflate(&stream->zs, Z_NO_FLUSH);
+        if (rc != Z_OK) {
+            break;
+        }
+    }
+    *len = stream->chunk_size - stream->zs.avail_out;
+    if (rc == Z_STREAM_END) {
+        return ENODATA;
+    }
+    if (rc != Z_OK) {
+        FPRINTF(stderr, "inflate failed %d\n", rc);
+        return EIO;
+    }
+    return 0;
+}
+
+/*
+ * A zstd window holds as many whole frames as fit, decoded side by side
+ */
+static int
+fpd_img_stream_unzstd(fpd_img_stream_t *stream, int w, uint32_t *len)
+{
+    const fpd_zstd_frame_t *f = &stream->frames[stream->frame_next];
+    uint32_t n = 0;
+    int rc;
+
+    *len = 0;
+    while (stream->frame_next + n < stream->frame_count &&
+           *len + f[n].dst_len <= stream->chunk_size) {
+        *len += f[n].dst_len;
+        n++;
+    }
+    rc = fpd_zstd_decode(stream->meta->img, f, n, stream->window[w]);
+    if (rc) {
+        return rc;
+    }
+    stream->frame_next += n;
+    return stream->frame_next == stream->frame_count ? ENODATA : 0;
+}
+
+static void *
+fpd_img_stream_worker(void *arg)
+{
+    fpd_img_stream_t *stream = arg;
+    int w = 0;
+    int rc = 0;
+    uint32_t len;
+
+    while (!rc) {
+        uint8_t stop;
+
+        pthread_mutex_lock(&stream->lock);
+        while (stream->window_ready[w] && !stream->stop) {
+            pthread_cond_wait(&stream->cond, &stream->lock);
+        }
+        stop = stream->stop;
+        pthread_mutex_unlock(&stream->lock);
+        if (stop) {
+            break;
+        }
+
+        if (stream->meta->compressed == FPD_FW_TYPE_ZSTD) {
+            rc = fpd_img_stream_unzstd(stream, w, &len);
+        } else {
+            rc = fpd_img_stream_inflate(stream, w, &len);
+        }
+
+        /* Digest the window while the caller is still writing the other */
+        EVP_DigestUpdate(stream->md, stream->window[w], len);
+
+        pthread_mutex_lock(&stream->lock);
+        stream->window_len[w] = len;
+        stream->window_ready[w] = 1;
+        if (rc == ENODATA) {
+            stream->eof = 1;
+        } else if (rc) {
+            stream->rc = rc;
+        }
+        pthread_cond_broadcast(&stream->cond);
+        pthread_mutex_unlock(&stream->lock);
+        w ^= 1;
+    }
+    return NULL;
+}
+
+/*
+ * Hint the kernel about the pages of an image; addresses are rounded out
+ * to page boundaries as madvise() requires
+ */
+static void
+fpd_img_advise(void *addr, size_t len, int advice)
+{
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)addr & ~(page - 1);
+    uintptr_t end = ((uintptr_t)addr + len + page - 1) & ~(page - 1);
+
+    if (len) {
+        (void)madvise((void *)start, end - start, advice);
+    }
+}
+
+int
+fpd_img_stream_open(fpd_meta_info_t *fpd_meta, uint32_t chunk_size,
+                    fpd_img_stream_t **stream,
+                    char *err_msg, uint32_t msg_size)
+{
+    fpd_img_stream_t *s;
+    int rc;
+
+    if (chunk_size < FPD_STREAM_CHUNK_MIN) {
+        chunk_size = FPD_STREAM_CHUNK_MIN;
+    } else if (chunk_size > FPD_STREAM_CHUNK_MAX) {
+        chunk_size = FPD_STREAM_CHUNK_MAX;
+    }
+
+    s = calloc(1, sizeof(*s));
+    if (!s) {
+        snprintf(err_msg, msg_size, "failed to allocate image stream");
+        return ENOMEM;
+    }
+    s->meta = fpd_meta;
+    s->chunk_size = chunk_size;
+    s->held = -1;
+
+    /* The payload is read once front to back */
+    fpd_img_advise(fpd_meta->img, fpd_meta->img_size, MADV_SEQUENTIAL);
+
+    s->md = EVP_MD_CTX_new();
+    if (!s->md || !EVP_DigestInit_ex(s->md, EVP_md5(), NULL)) {
+        snprintf(err_msg, msg_size, "failed to set up image digest");
+        EVP_MD_CTX_free(s->md);
+        free(s);
+        return ENOMEM;
+    }
+
+    if (!fpd_meta->compressed) {
+        s->total = fpd_meta->img_size;
+        if (fpd_meta->img_msize && fpd_meta->img_msize < s->total) {
+            s->total = fpd_meta->img_msize;
+        }
+        *stream = s;
+        return 0;
+    }
+
+    if (fpd_meta->compressed == FPD_FW_TYPE_ZSTD) {
+        rc = fpd_zstd_index(fpd_meta, &s->frames, &s->frame_count,
+                            err_msg, msg_size);
+        if (rc) {
+            EVP_MD_CTX_free(s->md);
+            free(s);
+            return rc;
+        }
+        /* A window holds a whole frame for every decode thread */
+        for (uint32_t i = 0; i < s->frame_count; i++) {
+            if (s->frames[i].dst_len * fpd_zstd_threads() > s->chunk_size) {
+                s->chunk_size = s->frames[i].dst_len * fpd_zstd_threads();
+            }
+        }
+        chunk_size = s->chunk_size;
+    }
+    s->window[0] = malloc(chunk_size);
+    s->window[1] = malloc(chunk_size);
+    if (!s->window[0] || !s->window[1]) {
+        snprintf(err_msg, msg_size, "failed to allocate inflate window");
+        free(s->window[0]);
+        free(s->window[1]);
+        free(s->frames);
+        EVP_MD_CTX_free(s->md);
+        free(s);
+        return ENOMEM;
+    }
+    if (fpd_meta->compressed == FPD_FW_TYPE_GZIP) {
+        s->zs.next_in = fpd_meta->img;
+        s->zs.avail_in = fpd_meta->img_size;
+        rc = inflateInit(&s->zs);
+        if (rc != Z_OK) {
+            snprintf(err_msg, msg_size, "inflateInit failed %d", rc);
+            free(s->window[0]);
+            free(s->window[1]);
+            EVP_MD_CTX_free(s->md);
+            free(s);
+            return EIO;
+        }
+    }
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+
+    rc = pthread_create(&s->worker, NULL, fpd_img_stream_worker, s);
+    if (rc) {
+        snprintf(err_msg, msg_size, "failed to start inflate worker");
+        if (fpd_meta->compressed == FPD_FW_TYPE_GZIP) {
+            inflateEnd(&s->zs);
+        }
+        free(s->frames);
+        pthread_cond_destroy(&s->cond);
+        pthread_mutex_destroy(&s->lock);
+        free(s->window[0]);
+        free(s->window[1]);
+        EVP_MD_CTX_free(s->md);
+        free(s);
+        return rc;
+    }
+    *stream = s;
+    return 0;
+}
+
+int
+fpd_img_stream_next(fpd_img_stream_t *stream, const void **chunk,
+                    uint32_t *len, char *err_msg, uint32_t msg_size)
+{
+    fpd_meta_info_t *meta = stream->meta;
+    uint32_t remain;
+    int w;
+
+    *chunk = NULL;
+    *len = 0;
+
+    if (!meta->compressed) {
+        remain = stream->total - stream->produced;
+        *len = remain < stream->chunk_size ? remain : stream->chunk_size;
+        *chunk = (uint8_t *)meta->img + stream->produced;
+        stream->produced += *len;
+        EVP_DigestUpdate(stream->md, *chunk, *len);
+        return 0;
+    }
+
+    pthread_mutex_lock(&stream->lock);
+    /* Hand the previous window back to the worker */
+    if (stream->held >= 0) {
+        stream->window_ready[stream->held] = 0;
+        stream->held = -1;
+        pthread_cond_broadcast(&stream->cond);
+    }
+    w = stream->next;
+    while (!stream->window_ready[w] && !stream->rc && !stream->eof) {
+        pthread_cond_wait(&stream->cond, &stream->lock);
+    }
+    if (!stream->window_ready[w]) {
+        pthread_mutex_unlock(&stream->lock);
+        if (stream->rc) {
+            snprintf(err_msg, msg_size, "failed to inflate image at offset 0x%x",
+                     stream->produced);
+            return stream->rc;
+        }
+        return 0;
+    }
+    stream->held = w;
+    stream->next = w ^ 1;
+    pthread_mutex_unlock(&stream->lock);
+
+    *chunk = stream->window[w];
+    *len = stream->window_len[w];
+    stream->produced += *len;
+    if (stream->produced > meta->img_msize) {
+        snprintf(err_msg, msg_size, "inflated image exceeds 0x%x bytes",
+                 meta->img_msize);
+        return EFBIG;
+    }
+    return 0;
+}
+
+void
+fpd_img_stream_close(fpd_img_stream_t *stream)
+{
+    if (!stream) {
+        return;
+    }
+    if (stream->meta->compressed) {
+        pthread_mutex_lock(&stream->lock);
+        stream->stop = 1;
+        pthread_cond_broadcast(&stream->cond);
+        pthread_mutex_unlock(&stream->lock);
+        pthread_join(stream->worker, NULL);
+
+        if (stream->meta->compressed == FPD_FW_TYPE_GZIP) {
+            inflateEnd(&stream->zs);
+        }
+        free(stream->frames);
+        pthread_cond_destroy(&stream->cond);
+        pthread_mutex_destroy(&stream->lock);
+        free(stream->window[0]);
+        free(stream->window[1]);
+    }
+    EVP_MD_CTX_free(stream->md);
+    free(stream);
+}
+
+static int
+fpd_md5_present(const fpd_meta_info_t *meta)
+{
+    int i;
+
+    if (!meta->md5) {
+        return 0;
+    }
+    for (i = 0; i < MAX_MD5_DIGEST; i++) {
+        if (meta->md5[i]) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int
+fpd_img_stream_check_digest(fpd_img_stream_t *stream,
+                            char *err_msg, uint32_t msg_size)
+{
+    uint8_t md5[EVP_MAX_MD_SIZE];
+    unsigned int len = 0;
+
+    if (!fpd_md5_present(stream->meta)) {
+        snprintf(err_msg, msg_size, "image metadata carries no md5");
+        return ENODATA;
+    }
+    if (!EVP_DigestFinal_ex(stream->md, md5, &len) || len != MAX_MD5_DIGEST) {
+        snprintf(err_msg, msg_size, "failed to compute image md5");
+        return EIO;
+    }
+    if (memcmp(md5, stream->meta->md5, MAX_MD5_DIGEST)) {
+        snprintf(err_msg, msg_size, "image md5 mismatch");
+        return EBADMSG;
+    }
+    return 0;
+}
+
+int
+fpd_img_verify_digest(fpd_meta_info_t *fpd_meta, char *err_msg,
+                      uint32_t msg_size)
+{
+    fpd_img_stream_t *stream;
+    const void *chunk;
+    uint32_t len;
+    int rc;
+
+    if (!fpd_md5_present(fpd_meta)) {
+        snprintf(err_msg, msg_size, "image metadata carries no md5");
+        return ENODATA;
+    }
+    rc = fpd_img_stream_open(fpd_meta, FPD_STREAM_CHUNK_MAX, &stream,
+                             err_msg, msg_size);
+    if (rc) {
+        return rc;
+    }
+    while (!(rc = fpd_img_stream_next(stream, &chunk, &len, err_msg, msg_size)) &&
+           len) {
+        ;
+    }
+    if (!rc) {
+        rc = fpd_img_stream_check_digest(stream, err_msg, msg_size);
+    }
+    fpd_img_stream_close(stream);
+    return rc;
+}
+
 int
 get_imgs_info(const char *name, fpd_imgs_t **imgs,
               char *err_msg, uint32_t msg_size)
 {
     uint32_t *magic;
     fpd_imgs_t *fpd_imgs;
+    fpd_img_map_t map;
     void *data;
     uint32_t data_size;
     int rc;
 
-    rc = get_img_data(name, &data, &data_size, err_msg, msg_size);
+    rc = fpd_img_map(name, &map, err_msg, msg_size);
     if (rc) {
-        FPRINTF(stderr, "get_data_info failed %d\n", rc);
+        FPRINTF(stderr, "fpd_img_map failed %d\n", rc);
         return rc;
     }
+    data = map.base;
+    data_size = map.size;
     magic = data;
     if (*magic == FPD_FILE_LIST_MAGIC) {
         fpd_images_hdr_v1_t *fip = data;
@@ -342,7 +1188,14 @@ get_imgs_info(const char *name, fpd_imgs_t **imgs,
         fpd_imgs = *imgs;
         fpd_imgs->magic = *magic;
         fpd_imgs->num_imgs = fip->num_images;
+        fpd_imgs->map = map;
         for (i = 0; i < fip->num_images; i++) {
+            if (offset > data_size || fip->image_sizes[i] > data_size - offset) {
+                snprintf(err_msg, msg_size, "image %d exceeds file size", i);
+                fpd_free_imgs_info(*imgs);
+                *imgs = NULL;
+                return EINVAL;
+            }
             fpd_imgs->meta[i].img_size = fip->image_sizes[i];
             fpd_imgs->meta[i].img = data + offset;
             offset += fip->image_sizes[i];
@@ -350,22 +1203,25 @@ get_imgs_info(const char *name, fpd_imgs_t **imgs,
                                err_msg, msg_size);
             if (rc) {
                 FPRINTF(stderr, "get_data_info failed %d\n", rc);
-                free(*imgs);
+                fpd_free_imgs_info(*imgs);
+                *imgs = NULL;
                 return rc;
             }
-            fpd_imgs->meta[0].img_size = fip->image_sizes[i] -
-                fpd_imgs->meta[0].mdata_size;
+            fpd_imgs->meta[i].img_size = fip->image_sizes[i] -
+                fpd_imgs->meta[i].mdata_size;
         }
     } else {
         *imgs = calloc(sizeof(fpd_imgs_t) + sizeof(fpd_meta_info_t), 1);
         fpd_imgs = *imgs;
         fpd_imgs->num_imgs = 1;
+        fpd_imgs->map = map;
         fpd_imgs->meta[0].img = data;
         rc = get_data_info(fpd_imgs->meta[0].img, &fpd_imgs->meta[0],
                            err_msg, msg_size);
         if (rc) {
             FPRINTF(stderr, "get_data_info failed %d\n", rc);
-            free(*imgs);
+            fpd_free_imgs_info(*imgs);
+            *imgs = NULL;
             return rc;
         }
         fpd_imgs->meta[0].img_size = data_size - fpd_imgs->meta[0].mdata_size;
@@ -376,6 +1232,23 @@ get_imgs_info(const char *name, fpd_imgs_t **imgs,
     return rc;
 }
 
+void
+fpd_free_imgs_info(fpd_imgs_t *fpd_imgs)
+{
+    uint32_t i;
+
+    if (!fpd_imgs) {
+        return;
+    }
+    for (i = 0; i < fpd_imgs->num_imgs; i++) {
+        free(fpd_imgs->meta[i].pid_list);
+        free(fpd_imgs->meta[i].name_list);
+    }
+    free(fpd_imgs->match_list);
+    fpd_img_unmap(&fpd_imgs->map);
+    free(fpd_imgs);
+}
+
 int
 fpd_find_img(fpd_imgs_t *fpd_imgs, const char *pid, char *name, char *name2)
 {
@@ -422,6 +1295,211 @@ fpd_find_img(fpd_imgs_t *fpd_imgs, const char *pid, char *name, char *name2)
     return match_count;
 }
 
+#define FPD_CATALOG_KEY_PID     0
+#define FPD_CATALOG_KEY_NAME    1
+
+typedef struct fpd_catalog_slot_ {
+    const char *key;
+    uint32_t hash;
+    uint16_t kind;
+    uint16_t img;
+} fpd_catalog_slot_t;
+
+struct fpd_catalog_ {
+    fpd_imgs_t *imgs;
+    uint32_t mask;
+    fpd_catalog_slot_t slots[0];
+};
+
+static uint32_t
+fpd_catalog_key_len(uint16_t kind)
+{
+    return kind == FPD_CATALOG_KEY_PID ? S_IDPROM_PRODUCT_ID_MAX + 1 :
+                                         MAX_FPD_NAME_LEN;
+}
+
+/*
+ * FNV-1a over the key as the metadata stores it: NUL terminated or filling
+ * its whole field
+ */
+static uint32_t
+fpd_catalog_hash(uint16_t kind, const char *key)
+{
+    uint32_t len = fpd_catalog_key_len(kind);
+    uint32_t hash = 2166136261u ^ kind;
+    uint32_t i;
+
+    for (i = 0; i < len && key[i]; i++) {
+        hash = (hash ^ (uint8_t)key[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static int
+fpd_catalog_key_eq(const fpd_catalog_slot_t *slot, uint16_t kind,
+                   const char *key, uint32_t hash)
+{
+    return slot->hash == hash && slot->kind == kind &&
+           !strncmp(slot->key, key, fpd_catalog_key_len(kind));
+}
+
+static void
+fpd_catalog_insert(fpd_catalog_t *catalog, uint16_t kind, const char *key,
+                   uint16_t img)
+{
+    uint32_t hash = fpd_catalog_hash(kind, key);
+    uint32_t idx = hash & catalog->mask;
+
+    while (catalog->slots[idx].key) {
+        idx = (idx + 1) & catalog->mask;
+    }
+    catalog->slots[idx].key = key;
+    catalog->slots[idx].hash = hash;
+    catalog->slots[idx].kind = kind;
+    catalog->slots[idx].img = img;
+}
+
+static int
+fpd_catalog_has(fpd_catalog_t *catalog, uint16_t kind, const char *key,
+                uint16_t img)
+{
+    uint32_t hash = fpd_catalog_hash(kind, key);
+    uint32_t idx = hash & catalog->mask;
+
+    for (; catalog->slots[idx].key; idx = (idx + 1) & catalog->mask) {
+        if (catalog->slots[idx].img == img &&
+            fpd_catalog_key_eq(&catalog->slots[idx], kind, key, hash)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int
+fpd_catalog_open(const char *path, fpd_catalog_t **catalog,
+                 char *err_msg, uint32_t msg_size)
+{
+    fpd_catalog_t *cat;
+    fpd_imgs_t *imgs;
+    uint32_t keys = 0;
+    uint32_t slots = 16;
+    uint32_t i, j;
+    int rc;
+
+    rc = get_imgs_info(path, &imgs, err_msg, msg_size);
+    if (rc) {
+        return rc;
+    }
+    /* Lookups jump straight to one image, don't read ahead the others */
+    fpd_img_advise(imgs->map.base, imgs->map.size, MADV_RANDOM);
+
+    for (i = 0; i < imgs->num_imgs; i++) {
+        keys += imgs->meta[i].pid_size + imgs->meta[i].name_size;
+    }
+    /* Keep the open addressed table at most half full */
+    while (slots < 2 * keys) {
+        slots <<= 1;
+    }
+    cat = calloc(1, sizeof(*cat) + slots * sizeof(fpd_catalog_slot_t));
+    if (!cat) {
+        snprintf(err_msg, msg_size, "failed to allocate catalog");
+        fpd_free_imgs_info(imgs);
+        return ENOMEM;
+    }
+    cat->imgs = imgs;
+    cat->mask = slots - 1;
+    for (i = 0; i < imgs->num_imgs; i++) {
+        fpd_meta_info_t *info = &imgs->meta[i];
+        for (j = 0; j < info->pid_size; j++) {
+            fpd_catalog_insert(cat, FPD_CATALOG_KEY_PID, info->pid_list[j], i);
+        }
+        for (j = 0; j < info->name_size; j++) {
+            fpd_catalog_insert(cat, FPD_CATALOG_KEY_NAME, info->name_list[j], i);
+        }
+    }
+    *catalog = cat;
+    return 0;
+}
+
+static int
+fpd_catalog_match(fpd_catalog_t *catalog, uint16_t img, const char *pid,
+                  const char *name, const char *name2)
+{
+    return (!pid || fpd_catalog_has(catalog, FPD_CATALOG_KEY_PID, pid, img)) &&
+           (!name || fpd_catalog_has(catalog, FPD_CATALOG_KEY_NAME, name, img)) &&
+           (!name2 || fpd_catalog_has(catalog, FPD_CATALOG_KEY_NAME, name2, img));
+}
+
+int
+fpd_catalog_lookup(fpd_catalog_t *catalog, const char *pid,
+                   const char *name, const char *name2,
+                   fpd_meta_info_t **matches, uint32_t max_matches)
+{
+    fpd_imgs_t *imgs = catalog->imgs;
+    fpd_meta_info_t *info;
+    const char *key;
+    uint16_t kind;
+    uint32_t hash, idx;
+    uint32_t count = 0;
+    int last = -1;
+
+    /* Drive the search off the most specific key given */
+    if (name2) {
+        kind = FPD_CATALOG_KEY_NAME;
+        key = name2;
+    } else if (name) {
+        kind = FPD_CATALOG_KEY_NAME;
+        key = name;
+    } else if (pid) {
+        kind = FPD_CATALOG_KEY_PID;
+        key = pid;
+    } else {
+        for (idx = 0; idx < imgs->num_imgs && count < max_matches; idx++) {
+            matches[count++] = &imgs->meta[idx];
+        }
+        return count;
+    }
+
+    /*
+     * Equal keys hash alike and were inserted in bundle order, so linear
+     * probing returns their images in ascending order. That also skips a
+     * key listed twice in one image.
+     */
+    hash = fpd_catalog_hash(kind, key);
+    for (idx = hash & catalog->mask; catalog->slots[idx].key && count < max_matches;
+         idx = (idx + 1) & catalog->mask) {
+        fpd_catalog_slot_t *slot = &catalog->slots[idx];
+
+        if (!fpd_catalog_key_eq(slot, kind, key, hash) || (int)slot->img <= last) {
+            continue;
+        }
+        last = slot->img;
+        if (!fpd_catalog_match(catalog, slot->img, pid, name, name2)) {
+            continue;
+        }
+        info = &imgs->meta[slot->img];
+        info->match_flags |= FULL_MATCH;
+        matches[count++] = info;
+    }
+    return count;
+}
+
+fpd_imgs_t *
+fpd_catalog_imgs(fpd_catalog_t *catalog)
+{
+    return catalog->imgs;
+}
+
+void
+fpd_catalog_close(fpd_catalog_t *catalog)
+{
+    if (!catalog) {
+        return;
+    }
+    fpd_free_imgs_info(catalog->imgs);
+    free(catalog);
+}
+
 uint8_t
 fpd_mdata_get_fpd_version(void *mdata, fpd_version_t *fpd_version)
 {
@@ -495,50 +1573,39 @@ fpd_mdata_get_fpd_version(void *mdata, fpd_version_t *fpd_version)
 uint32_t
 get_metadata_size(const char *file_name)
 {
-  
-    uint8_t *image, *mdata;
-    uint32_t image_size, mdata_size;
+    fpd_mdata_probe_t probe = {0};
     char err_msg[ERRBUF_SIZE] = {0};
     uint32_t msg_size = sizeof(err_msg);
 
-    /* Extract and validate FPGA image and meta data */
-    int rc =
-      get_img_metadata(file_name, &image_size, (void **)&image, &mdata_size,
-                       (void **)&mdata, err_msg, msg_size);
+    /* Only the metadata header is read; the image is not touched */
+    int rc = fpd_mdata_probe(file_name, &probe, NULL, err_msg, msg_size);
     if (rc) {
-        FPRINTF(stderr, "get_img_metadata failed : [%s]\n", err_msg);
-        printf("get_img_metadata failed : [%s]\n", err_msg);
+        FPRINTF(stderr, "fpd_mdata_probe failed : [%s]\n", err_msg);
+        printf("fpd_mdata_probe failed : [%s]\n", err_msg);
     }
     
-    return mdata_size;
+    return probe.mdata_size;
 }
 
 uint32_t get_image_version(const char *file_name) {
 
-  uint8_t *image, *mdata;
-  uint32_t image_size, mdata_size;
-  // print fpd Version
-  fpd_version_t fpd_version = {0};
-    uint32_t fpd_image_version;
+  fpd_mdata_probe_t probe = {0};
+  uint32_t fpd_image_version;
   char err_msg[ERRBUF_SIZE] = {0};
   uint32_t msg_size = sizeof(err_msg);
 
-  /* Extract and validate FPGA image and meta data */
-  int rc =
-      get_img_metadata(file_name, &image_size, (void **)&image, &mdata_size,
-                       (void **)&mdata, err_msg, msg_size);
-  if (rc || !mdata) {
-    FPRINTF(stderr, "get_img_metadata %p failed : [%s]\n", mdata, err_msg);
-    printf("get_img_metadata %p failed : [%s]\n", mdata, err_msg);
+  /* Only the metadata header is read; the image is not touched */
+  int rc = fpd_mdata_probe(file_name, &probe, NULL, err_msg, msg_size);
+  if (rc) {
+    FPRINTF(stderr, "fpd_mdata_probe failed : [%s]\n", err_msg);
+    printf("fpd_mdata_probe failed : [%s]\n", err_msg);
   }
 
-  // print the fpd version
-  rc = fpd_mdata_get_fpd_version((void *)mdata, &fpd_version);
-  if (rc == 0) {
-    FPRINTF(stderr, "major_ver:%x  minor_ver:%x\n", fpd_version.major,
-            fpd_version.minor);
+  if (probe.version_valid) {
+    FPRINTF(stderr, "major_ver:%x  minor_ver:%x\n", probe.version.major,
+            probe.version.minor);
   }
-  fpd_image_version = (fpd_version.major << 16) | fpd_version.minor;
+  fpd_image_version = (probe.version.major << 16) | probe.version.minor;
   return fpd_image_version;
 }
 
@@ -628,7 +1695,8 @@ fpd_print_meta_info(fpd_meta_info_t *fpd)
         fpd->version.major, fpd->version.minor, fpd->version.debug,
         fpd->img_size, fpd->img_msize);
     printf(" -- flags: 0x%08x compressed: %s\n",
-        fpd->flags, fpd->compressed ? "Yes" : "No");
+        fpd->flags, fpd->compressed == FPD_FW_TYPE_ZSTD ? "zstd" :
+                    fpd->compressed ? "gzip" : "No");
 
     printf(" MD5: ");
     for (i = 0; i < MAX_MD5_DIGEST; i++) {
@@ -779,118 +1847,49 @@ cpa_get_shell_cmd_output (char      *buff,
     return (-1);
 }
 
-static uint64_t
-get_silverbolt_phy_address()
-{
-    /* Get the base address of SILVERBOLT */
-    char  result[128];
-    const char *cmd = "lspci -vd :017a | grep 64M | awk '{print \"0x\"$3}'";
-
-    FILE *fp = popen(cmd, "r");
-    if (!fp) {
-        fprintf(stderr, "popen failed");
-        return -1;
-    }
-    if (!fgets(result, sizeof(result), fp)) {
-        fprintf(stderr, "failed to read from the file");
-        return -1;
-    }
-    result[strcspn(result, "\n")] = 0;
-    pclose(fp);
-    return strtoull(result, NULL, 0);
-}
-
-static uint64_t
-get_cyclonus_phy_address()
+void *
+get_pinpointer_block_virtual_addr(int pim, uint64_t block_offset,
+                                  size_t block_size)
 {
-    /* Get the base address of cyclonus */
-    char  result[128];
-    const char *cmd = "lspci -vd :0177 | grep 4M | awk '{print \"0x\"$3}'";
+    volatile uint32_t *regs = mmio_pim_regs(pim, block_offset, block_size);
 
-    FILE *fp = popen(cmd, "r");
-    if (!fp) {
-        fprintf(stderr, "popen failed");
-        return -1;
-    }
-    if (!fgets(result, sizeof(result), fp)) {
-        fprintf(stderr, "failed to read from the file");
-        return -1;
-    }
-    result[strcspn(result, "\n")] = 0;
-    pclose(fp);
-    return strtoull(result, NULL, 0);
-}
-
-void *
-get_pinpointer_block_virtual_addr(int pim, uint64_t block_offset)
-{
-    void *map_addr = NULL;
-    uint64_t phy_base;
-    uint64_t spi_base;
-    phy_base = get_silverbolt_phy_address();
-    if (phy_base == -1 || phy_base == EINVAL) {
-        fprintf(stderr, "Failed to get silverbolt base address. (%s)\n", strerror(errno));
+    if (!regs) {
+        fprintf(stderr, "Failed to map PIM%d block 0x%llx. (%s)\n", pim,
+                (unsigned long long)block_offset, strerror(errno));
         return NULL;
     }
-    spi_base = phy_base + (pim - 1) * SLPC_MEMORY_BASE + SLPC_MEMORY_OFFSET + block_offset;
-
-    int fd = open("/dev/mem", O_RDWR|O_SYNC);
-    map_addr = mmap(NULL, getpagesize(),
-                    PROT_READ|PROT_WRITE, MAP_SHARED, fd,
-                    spi_base & ~(getpagesize() - 1));
-    if (!map_addr) {
-        fprintf(stderr, "mmap failed. errno %d (%s)\n", errno, strerror(errno));
-        return MAP_FAILED;
-    }
-    uint64_t offset = spi_base & (getpagesize() - 1);
-    map_addr = map_addr + offset;
-
-    return map_addr;
+    return (void *)regs;
 }
 
 void *
 get_cyclonus_block_virtual_addr(uint64_t block_offset)
 {
-    void *map_addr = NULL;
-    uint64_t phy_base;
-    uint64_t spi_base;
-    phy_base = get_cyclonus_phy_address();
-    if (phy_base == -1 || phy_base == EINVAL) {
-        fprintf(stderr, "Failed to get cyclonus base address. (%s)\n", strerror(errno));
-        return NULL;
-    }
-    spi_base = phy_base + block_offset;
+    volatile uint32_t *regs = mmio_cyclonus_regs(block_offset);
 
-    int fd = open("/dev/mem", O_RDWR|O_SYNC);
-    map_addr = mmap(NULL, getpagesize(),
-                    PROT_READ|PROT_WRITE, MAP_SHARED, fd,
-                    spi_base & ~(getpagesize() - 1));
-    if (!map_addr) {
-        fprintf(stderr, "mmap failed. errno %d (%s)\n", errno, strerror(errno));
-        return MAP_FAILED;
+    if (!regs) {
+        fprintf(stderr, "Failed to map cyclonus block 0x%llx. (%s)\n",
+                (unsigned long long)block_offset, strerror(errno));
+        return NULL;
     }
-    uint64_t offset = spi_base & (getpagesize() - 1);
-    map_addr = map_addr + offset;
-    return map_addr;
+    return (void *)regs;
 }
 
 uint16_t
 get_cpld_version(uint64_t offset, uint64_t mask,
                  uint32_t target, uint16_t rshift)
 {
-    uint32_t *virt_addr;
+    volatile uint32_t *regs;
     uint32_t data;
 
-    void *map_base = get_cyclonus_block_virtual_addr(offset);
-    if (!map_base) {
+    regs = mmio_region_regs(MMIO_REGION_CYCLONUS, offset + target,
+                            sizeof(uint32_t));
+    if (!regs) {
         fprintf(stderr, "failed to get base virtual address at offset %llx\n", (long long)offset);
         return -1;
     }
 
-    virt_addr = map_base + target;
-    data = *virt_addr;
+    data = mmio_read32(regs, 0);
 
     uint16_t version = (data & mask) >> rshift;
     return version & 0x3F;
 }
-
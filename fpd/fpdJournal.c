@@ -0,0 +1,174 @@
+/*------------------------------------------------------------------
+ * fpdJournal.c
+ *
+ * Persistent record of how far a flash image program got.
+ *
+ * Copyright (c) 2022 by Cisco Systems, Inc.
+ * All rights reserved.
+ *-----------------------------------------------------------------
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <openssl/evp.h>
+#include "fpdJournal.h"
+
+static const char *
+fpd_journal_dir(void)
+{
+    static const char *dirs[] = FPD_JOURNAL_DIRS;
+    const char *env = getenv(FPD_JOURNAL_ENV);
+    struct stat st;
+    size_t i;
+
+    if (env && *env) {
+        return env;
+    }
+    for (i = 0; i < sizeof(dirs) / sizeof(dirs[0]); i++) {
+        if (!stat(dirs[i], &st) && S_ISDIR(st.st_mode)) {
+            return dirs[i];
+        }
+    }
+    return NULL;
+}
+
+static void
+fpd_journal_off(fpd_journal_t *journal, const char *what, int err)
+{
+    fprintf(stderr, "Journal %s: %s failed (%s), continuing without it\n",
+            journal->path, what, strerror(err));
+    if (journal->fd >= 0) {
+        close(journal->fd);
+        unlink(journal->path);
+    }
+    journal->fd = -1;
+}
+
+void
+fpd_journal_digest(const void *data, size_t len,
+                   uint8_t digest[FPD_JOURNAL_DIGEST_LEN])
+{
+    uint8_t md[EVP_MAX_MD_SIZE];
+    unsigned int md_len = 0;
+
+    memset(digest, 0, FPD_JOURNAL_DIGEST_LEN);
+    if (EVP_Digest(data, len, md, &md_len, EVP_md5(), NULL) &&
+        md_len == FPD_JOURNAL_DIGEST_LEN) {
+        memcpy(digest, md, FPD_JOURNAL_DIGEST_LEN);
+    }
+}
+
+/*
+ * Path of the journal of block_name, false when there is nowhere to keep it
+ */
+static bool
+fpd_journal_path(const char *block_name, char *path, size_t path_size)
+{
+    const char *dir = fpd_journal_dir();
+    char *p;
+
+    if (!dir) {
+        return false;
+    }
+    snprintf(path, path_size, "%s/fpd_%s.journal", dir, block_name);
+    for (p = path + strlen(dir) + 1; *p; p++) {
+        if (*p == '/') {
+            *p = '_';
+        }
+    }
+    return true;
+}
+
+uint32_t
+fpd_journal_open(fpd_journal_t *journal, const char *block_name,
+                 const fpd_journal_rec_t *rec)
+{
+    fpd_journal_rec_t old;
+
+    journal->fd = -1;
+    journal->rec = *rec;
+    journal->rec.magic = FPD_JOURNAL_MAGIC;
+    journal->rec.version = FPD_JOURNAL_VERSION;
+    journal->rec.sectors_done = 0;
+    if (!fpd_journal_path(block_name, journal->path, sizeof(journal->path))) {
+        return 0;
+    }
+
+    journal->fd = open(journal->path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (journal->fd < 0) {
+        fpd_journal_off(journal, "open", errno);
+        return 0;
+    }
+    if (pread(journal->fd, &old, sizeof(old), 0) == sizeof(old) &&
+        old.magic == FPD_JOURNAL_MAGIC &&
+        old.version == FPD_JOURNAL_VERSION &&
+        !memcmp(old.digest, rec->digest, sizeof(old.digest)) &&
+        old.image_offset == rec->image_offset &&
+        old.image_size == rec->image_size &&
+        old.mdata_offset == rec->mdata_offset &&
+        old.sector_size == rec->sector_size) {
+        journal->rec.sectors_done = old.sectors_done;
+        return old.sectors_done;
+    }
+
+    /* No usable record, start this image over */
+    fpd_journal_update(journal, 0);
+    return 0;
+}
+
+int
+fpd_journal_update(fpd_journal_t *journal, uint32_t sectors_done)
+{
+    ssize_t len;
+    int err;
+
+    if (journal->fd < 0) {
+        return 0;
+    }
+    journal->rec.sectors_done = sectors_done;
+    len = pwrite(journal->fd, &journal->rec, sizeof(journal->rec), 0);
+    if (len != sizeof(journal->rec)) {
+        err = len < 0 ? errno : EIO;
+        fpd_journal_off(journal, "write", err);
+        return err;
+    }
+    if (fdatasync(journal->fd)) {
+        err = errno;
+        fpd_journal_off(journal, "sync", err);
+        return err;
+    }
+    return 0;
+}
+
+void
+fpd_journal_close(fpd_journal_t *journal, bool finished)
+{
+    if (journal->fd < 0) {
+        return;
+    }
+    close(journal->fd);
+    journal->fd = -1;
+    if (finished) {
+        unlink(journal->path);
+    }
+}
+
+int
+fpd_journal_remove(const char *block_name)
+{
+    char path[sizeof(((fpd_journal_t *)0)->path)];
+
+    if (!fpd_journal_path(block_name, path, sizeof(path)) ||
+        !unlink(path) || errno == ENOENT) {
+        return 0;
+    }
+    fprintf(stderr, "Journal %s: remove failed (%s)\n", path, strerror(errno));
+    return errno;
+}
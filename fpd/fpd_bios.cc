@@ -15,6 +15,7 @@
 
 #include "commonUtil.h"
 #include "fpd/bios.h"
+#include "fpd_utils.h"
 #include "biosUtil.h"
 
 // BIOS version string is in format of x-x-abc-abc
@@ -70,16 +71,19 @@ switch_bios_flash_region(std::string block_name)
 std::string
 Fpd_bios::get_bios_version_from_spiflash() const
 {
-    struct stat         img_statbuf;
-    char                sys_cmd[256] = {0};
-    char                flash_data[BIOS_VER_LEN] = { 0 };
-    char                mtd_dev[16] = { 0 };
-    int32_t             c;
-    int                 i, rc;
-    FILE                *img_fd;
+    char                err_msg[ERRBUF_SIZE] = {0};
+    char                version[BIOS_VER_LEN] = {0};
     bool                switch_bios_flag = false;
+    int                 rc;
 
     std::string block_name = fpd_t::get_fpga_offset("uio_block_name");
+    auto version_offset = std::stoul(fpd_t::get_fpga_offset("flash_version_offset"), nullptr, 0);
+    golden_version_t entry;
+    entry.source = block_name + "@" + std::to_string(version_offset);
+    if (golden_cache_get(name(), entry.source, entry)) {
+        return entry.version;
+    }
+
     int active_flash = fpd_bios_get_active_flash(block_name.c_str());
     if (active_flash == 0) {
         switch_bios_flash_region(block_name);
@@ -87,152 +91,17 @@ Fpd_bios::get_bios_version_from_spiflash() const
         active_flash = fpd_bios_get_active_flash(block_name.c_str());
     }
 
-    memset(sys_cmd, 0, sizeof(sys_cmd));
-    snprintf(sys_cmd, sizeof(sys_cmd)-1,
-             "cat /proc/mtd | grep -i bios | cut -d':' -f1 > %s",
-             BIOS_MTD_INFO_FILE);
-    unlink(BIOS_MTD_INFO_FILE);
-    auto str = get_shell_cmd_output(sys_cmd);
-
-    rc = stat(BIOS_MTD_INFO_FILE, &img_statbuf);
-    if (rc) {
-        if (switch_bios_flag && (active_flash == 1)) {
-            switch_bios_flash_region(block_name);
-        }
-        std::string err_msg = "Unable to get size of file ";
-        err_msg.append(BIOS_MTD_INFO_FILE);
-        throw std::runtime_error(err_msg);
-    }
-
-    if (img_statbuf.st_size == 0) {
-        if (switch_bios_flag && (active_flash == 1)) {
-            switch_bios_flash_region(block_name);
-        }
-        std::string err_msg = BIOS_MTD_INFO_FILE;
-        err_msg.append(" file is empty");
-        throw std::runtime_error(err_msg);
-    }
-
-    img_fd = fopen(BIOS_MTD_INFO_FILE, "r");
-    if (!img_fd) {
-        if (switch_bios_flag && (active_flash == 1)){
-            switch_bios_flash_region(block_name);
-        }
-        std::string err_msg = "Unable to open file ";
-        err_msg.append(BIOS_MTD_INFO_FILE);
-        throw std::runtime_error(err_msg);
-    }
-
-    rc = fscanf(img_fd, "%s", mtd_dev);
-    if (rc == 0) {
-        fclose(img_fd);
-        if (switch_bios_flag && (active_flash == 1)) {
-            switch_bios_flash_region(block_name);
-        }
-        throw std::runtime_error("No MTD device found");
-    }
-    fclose(img_fd);
-
-    auto version_offset = std::stoul(fpd_t::get_fpga_offset("flash_version_offset"), nullptr, 0);
-    if (version_offset % 512) {
-        if (switch_bios_flag && (active_flash == 1)) {
-            switch_bios_flash_region(block_name);
-        }
-        std::string err_msg = "Invalid version offset: ";
-        err_msg.append(std::to_string(version_offset));
-        throw std::runtime_error(err_msg);
-    }
-
-    memset(sys_cmd, 0, sizeof(sys_cmd));
-    snprintf(sys_cmd, sizeof(sys_cmd)-1,
-             "dd if=/dev/%s of=%s count=1 skip=%lu status=none",
-             mtd_dev, BIOS_VER_INFO_FILE, (version_offset/512));
-    unlink(BIOS_VER_INFO_FILE);
-    str = get_shell_cmd_output(sys_cmd);
-
-    rc = stat(BIOS_VER_INFO_FILE, &img_statbuf);
-    if (rc) {
-        if (switch_bios_flag && (active_flash == 1)) {
-            switch_bios_flash_region(block_name);
-        }
-        std::string err_msg = "Unable to get size of file ";
-        err_msg.append(BIOS_VER_INFO_FILE);
-        throw std::runtime_error(err_msg);
-    }
-
-    if (img_statbuf.st_size == 0) {
-        if (switch_bios_flag && (active_flash == 1)) {
-            switch_bios_flash_region(block_name);
-        }
-        std::string err_msg = BIOS_VER_INFO_FILE;
-        err_msg.append(" file is empty");
-        throw std::runtime_error(err_msg);
-    }
-
-    img_fd = fopen(BIOS_VER_INFO_FILE, "rb");
-    if (!img_fd) {
-        if (switch_bios_flag && (active_flash == 1)) {
-            switch_bios_flash_region(block_name);
-        }
-        std::string err_msg = "Unable to open file ";
-        err_msg.append(BIOS_VER_INFO_FILE);
-        throw std::runtime_error(err_msg);
+    rc = bios_mtd_get_version("bios", version_offset, version,
+                              err_msg, sizeof(err_msg));
+    if (switch_bios_flag && (active_flash == 1)) {
+        switch_bios_flash_region(block_name);
     }
-
-    rc = fseek(img_fd, BIOS_SIGNATURE_OFFSET, SEEK_SET);
     if (rc) {
-        fclose(img_fd);
-        if (switch_bios_flag && (active_flash == 1)) {
-            switch_bios_flash_region(block_name);
-        }
-        throw std::runtime_error("Failed to move to BIOS version signature offset.");
-    }
-
-    (void)memset(flash_data, 0, sizeof(flash_data));
-    for (i = 0; i < BIOS_VER_BVDT_LEN; i++) {
-        if ((c = fgetc(img_fd)) == EOF) {
-            std::cerr << "Unexpected EOF" << std::endl;
-            break;
-        }
-        flash_data[i] = c;
-    }
-    flash_data[i] = '\0';
-
-    if (!strcmp(flash_data, BIOS_VER_SIGNATURE)) {
-        rc = fseek(img_fd, BIOS_VERSION_OFFSET, SEEK_SET);
-        if (rc) {
-            fclose(img_fd);
-            if (switch_bios_flag && (active_flash == 1)) {
-                switch_bios_flash_region(block_name);
-            }
-            throw std::runtime_error("Failed to move to BIOS version offset.");
-        }
-        memset(flash_data, 0, sizeof(flash_data));
-
-        for(i = 0; i < (BIOS_VER_LEN - 1); i++) {
-            if ((c = fgetc(img_fd)) == EOF) {
-                std::cerr << "Unexpected EOF" << std::endl;
-                break;
-            }
-            flash_data[i] = c;
-        }
-        flash_data[i] = '\0';
-        fclose(img_fd);
-        if (switch_bios_flag && (active_flash == 1)) {
-            switch_bios_flash_region(block_name);
-        }
-        return bios_extract_major_minor_version(std::string(flash_data));
-    } else {
-        fclose(img_fd);
-        if (switch_bios_flag && (active_flash == 1)) {
-            switch_bios_flash_region(block_name);
-        }
-        std::string err_msg = "Signature mismatch. Found: ";
-        err_msg.append(flash_data);
-        err_msg.append(" Expected: ");
-        err_msg.append(BIOS_VER_SIGNATURE);
         throw std::runtime_error(err_msg);
     }
+    entry.version = bios_extract_major_minor_version(std::string(version));
+    golden_cache_put(name(), entry);
+    return entry.version;
 }
 
 void 
@@ -256,6 +125,10 @@ Fpd_bios::program(bool force) const
         image_path.push_back("golden");
     }
 
+    // The capsule is flashed on the next reboot
+    if (golden) {
+        golden_cache_drop(name(), true);
+    }
     bios_upgrade(image_path[0], golden);
 }
 
@@ -44,6 +44,7 @@ void
 bios_upgrade(std::string image_path, int golden)
 {
     std::string info(__func__);
+    auto helper = std::make_unique<bsp2::fpd_t::phase_timer_t>("helper");
 
     // Create efi directory
     const char* efi_dir = "mkdir -p /boot/efi";
@@ -92,6 +93,8 @@ bios_upgrade(std::string image_path, int golden)
     const char* EFI_BIOS_UPG_VAR_PATH = "/sys/firmware/efi/efivars";
     if (std::filesystem::exists(EFI_BIOS_UPG_VAR_PATH)) {
         std::cout << "EFI VAR PATH exists\n";
+        helper.reset();
+        bsp2::fpd_t::phase_timer_t load("load");
         create_images(image_path);
     } else {
           info.append("\nEFI VAR PATH Does not exist, existing BIOS upgrade");
@@ -99,6 +102,7 @@ bios_upgrade(std::string image_path, int golden)
     }
 
     // Set OS Indication to upgrade BIOS on next reboot
+    bsp2::fpd_t::phase_timer_t activate("activate");
     if (golden) {
         const char* upgrade_cmd_1 = "sudo printf \"\\x07\\x00\\x00\\x00\\x04\\x00\\x00\\x00\\x00\\x00\\x00\\x00\" > /sys/firmware/efi/efivars/CiscoFlashSelected-59d1c24f-50f1-401a-b101-f33e0daed443";
         std::string upgrade_bios = exec_shell_command(upgrade_cmd_1);
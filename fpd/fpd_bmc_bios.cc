@@ -15,14 +15,15 @@
 
 #include "commonUtil.h"
 #include "fpd/bmc_bios.h"
+#include "biosUtil.h"
+#include "mtdUtil.h"
 
-#define BIOS_VER_SIGNATURE      "$BVDT$"
-#define BIOS_VER_INFO_FILE      "/tmp/bios_ver_info.txt"
-#define BIOS_MTD_INFO_FILE      "/tmp/mtd_bios.txt"
-#define BIOS_VER_LEN            18
-#define BIOS_VER_BVDT_LEN       6
-#define BIOS_SIGNATURE_OFFSET   256
-#define BIOS_VERSION_OFFSET     270
+// The package is a 128 byte header and the image of the full flash; the
+// "bios" partition holds the image past its first 8 MiB
+#define BIOS_IMAGE_HDR_SIZE         128
+#define BIOS_REGION_OFFSET          0x800000
+#define BIOS_FULL_MTD_NAME          "bios_full"
+#define BMC_X86_POWER_STATE         "/sys/bus/platform/devices/pseq/power_state"
 
 // BIOS version string is in format of x-x-abc-abc
 // We need x.x as numeric version string
@@ -40,19 +41,6 @@ bios_extract_major_minor_version(std::string version)
     return result;
 }
 
-static std::string 
-get_shell_cmd_output(const char* cmd) {
-    char  result[128];
-    FILE *fp = popen(cmd, "r");
-    if (!fp) {
-        throw std::runtime_error("popen() failed!");
-    }
-    fgets(result, sizeof(result), fp);
-    result[strcspn(result, "\n")] = 0;
-    pclose(fp);
-    return result;
-}
-
 void
 Fpd_bmc_bios::select_mux() const
 {
@@ -86,135 +74,18 @@ Fpd_bmc_bios::unselect_mux() const
 std::string
 Fpd_bmc_bios::get_bios_version_from_spiflash() const
 {
-    struct stat         img_statbuf;
-    char                sys_cmd[256] = {0};
-    char                flash_data[BIOS_VER_LEN] = { 0 };
-    char                mtd_dev[16] = { 0 };
-    int32_t             c;
-    int                 i, rc;
-    FILE                *img_fd;
-
-    memset(sys_cmd, 0, sizeof(sys_cmd));
-    snprintf(sys_cmd, sizeof(sys_cmd)-1,
-             "cat /proc/mtd | grep -i bios_full | cut -d':' -f1 > %s",
-             BIOS_MTD_INFO_FILE);
-    unlink(BIOS_MTD_INFO_FILE);
-    auto str = get_shell_cmd_output(sys_cmd);
-
-    rc = stat(BIOS_MTD_INFO_FILE, &img_statbuf);
-    if (rc) {
-        std::string err_msg = "Unable to get size of file ";
-        err_msg.append(BIOS_MTD_INFO_FILE);
-        unselect_mux();
-        throw std::runtime_error(err_msg);
-    }
-
-    if (img_statbuf.st_size == 0) {
-        std::string err_msg = BIOS_MTD_INFO_FILE;
-        err_msg.append(" file is empty");
-        unselect_mux();
-        throw std::runtime_error(err_msg);
-    }
-
-    img_fd = fopen(BIOS_MTD_INFO_FILE, "r");
-    if (!img_fd) {
-        std::string err_msg = "Unable to open file ";
-        err_msg.append(BIOS_MTD_INFO_FILE);
-        unselect_mux();
-        throw std::runtime_error(err_msg);
-    }
-
-    rc = fscanf(img_fd, "%s", mtd_dev);
-    if (rc == 0) {
-        fclose(img_fd);
-        unselect_mux();
-        throw std::runtime_error("No MTD device found");
-    }
-    fclose(img_fd);
+    char                err_msg[ERRBUF_SIZE] = {0};
+    char                version[BIOS_VER_LEN] = {0};
+    int                 rc;
 
     auto version_offset = std::stoul(fpd_t::get_fpga_offset("flash_version_offset"), nullptr, 0);
-    if (version_offset % 512) {
-        std::string err_msg = "Invalid version offset: ";
-        err_msg.append(std::to_string(version_offset));
-        unselect_mux();
-        throw std::runtime_error(err_msg);
-    }
-
-    memset(sys_cmd, 0, sizeof(sys_cmd));
-    snprintf(sys_cmd, sizeof(sys_cmd)-1,
-             "dd if=/dev/%s of=%s count=1 skip=%lu>& /dev/null",
-             mtd_dev, BIOS_VER_INFO_FILE, (version_offset/512));
-    unlink(BIOS_VER_INFO_FILE);
-    str = get_shell_cmd_output(sys_cmd);
-
-    rc = stat(BIOS_VER_INFO_FILE, &img_statbuf);
+    rc = bios_mtd_get_version("bios_full", version_offset, version,
+                              err_msg, sizeof(err_msg));
     if (rc) {
-        std::string err_msg = "Unable to get size of file ";
-        err_msg.append(BIOS_VER_INFO_FILE);
-        unselect_mux();
-        throw std::runtime_error(err_msg);
-    }
-
-    if (img_statbuf.st_size == 0) {
-        std::string err_msg = BIOS_VER_INFO_FILE;
-        err_msg.append(" file is empty");
-        unselect_mux();
-        throw std::runtime_error(err_msg);
-    }
-
-    img_fd = fopen(BIOS_VER_INFO_FILE, "rb");
-    if (!img_fd) {
-        std::string err_msg = "Unable to open file ";
-        err_msg.append(BIOS_VER_INFO_FILE);
-        unselect_mux();
-        throw std::runtime_error(err_msg);
-    }
-
-    rc = fseek(img_fd, BIOS_SIGNATURE_OFFSET, SEEK_SET);
-    if (rc) {
-        fclose(img_fd);
-        unselect_mux();
-        throw std::runtime_error("Failed to move to BIOS version signature offset.");
-    }
-
-    (void)memset(flash_data, 0, sizeof(flash_data));
-    for (i = 0; i < BIOS_VER_BVDT_LEN; i++) {
-        if ((c = fgetc(img_fd)) == EOF) {
-            std::cerr << "Unexpected EOF" << std::endl;
-            break;
-        }
-        flash_data[i] = c;
-    }
-    flash_data[i] = '\0';
-
-    if (!strcmp(flash_data, BIOS_VER_SIGNATURE)) {
-        rc = fseek(img_fd, BIOS_VERSION_OFFSET, SEEK_SET);
-        if (rc) {
-            fclose(img_fd);
-            unselect_mux();
-            throw std::runtime_error("Failed to move to BIOS version offset.");
-        }
-        memset(flash_data, 0, sizeof(flash_data));
-
-        for(i = 0; i < (BIOS_VER_LEN - 1); i++) {
-            if ((c = fgetc(img_fd)) == EOF) {
-                std::cerr << "Unexpected EOF" << std::endl;
-                break;
-            }
-            flash_data[i] = c;
-        }
-        flash_data[i] = '\0';
-        fclose(img_fd);
-        return bios_extract_major_minor_version(std::string(flash_data));
-    } else {
-        fclose(img_fd);
-        std::string err_msg = "Signature mismatch. Found: ";
-        err_msg.append(flash_data);
-        err_msg.append(" Expected: ");
-        err_msg.append(BIOS_VER_SIGNATURE);
         unselect_mux();
         throw std::runtime_error(err_msg);
     }
+    return bios_extract_major_minor_version(std::string(version));
 }
 
 void 
@@ -232,15 +103,50 @@ Fpd_bmc_bios::program(bool force) const
             throw std::system_error(EPERM, std::generic_category(), info);
         }
     }
-    auto helper = fpd_t::helper();
     auto image_path = fpd_t::path();
-    std::vector<std::string> mtd_name {image_path, fpd_t::get_fpga_offset("mtd_name")};
+    std::string mtd_name = fpd_t::get_fpga_offset("mtd_name");
+    uint64_t src_offset = BIOS_IMAGE_HDR_SIZE;
+    if (mtd_name != BIOS_FULL_MTD_NAME) {
+        src_offset += BIOS_REGION_OFFSET;
+    }
+
+    std::ifstream power(BMC_X86_POWER_STATE);
+    std::string state;
+    if (power >> state && state.find("on") != state.npos) {
+        std::string info(__func__);
+        info.append(": BIOS SPI flash upgrade requires x86 in power off state");
+        throw std::system_error(EBUSY, std::generic_category(), info);
+    }
 
     select_mux();
 
-    fpd_t::invoke(helper, mtd_name);
+    // Create the mtd partitions if the mux was not selected before
+    try {
+        std::vector<std::string> helper {fpd_t::get_fpga_offset("helper_script")};
+        fpd_t::invoke(helper, {});
+    } catch (...) {
+        unselect_mux();
+        throw;
+    }
 
+    char err_msg[ERRBUF_SIZE] = {0};
+    mtd_write_stats_t stats;
+    int rc;
+    std::cout << "Program " << mtd_name << " region" << std::endl;
+    {
+        phase_timer_t program("program");
+        rc = mtd_write_file(mtd_name.c_str(), image_path.c_str(), src_offset,
+                            &stats, err_msg, sizeof(err_msg));
+    }
     unselect_mux();
+    if (rc) {
+        std::string info(__func__);
+        info.append(": ").append(err_msg);
+        throw std::system_error(rc, std::generic_category(), info);
+    }
+    std::cout << "Programmed " << stats.blocks << " blocks of " << stats.erasesize
+              << " bytes: " << stats.written << " written (" << stats.erased
+              << " erased), " << stats.unchanged << " unchanged" << std::endl;
 }
 
 std::string 
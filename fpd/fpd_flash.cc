@@ -6,24 +6,93 @@
  */
 #include <iostream>
 #include <fstream>
+#include <algorithm>
 #include <dlfcn.h>
 #include <sys/stat.h>
 
 #include "commonUtil.h"
 #include "fpd_flash.h"
+#include "fpd_utils.h"
 #include "fpd/flash.h"
 
+// is_golden_booted() values from here up mean the primary image booted
+#define IOFPGA_PRIMARY_BOOTED   10
+
+static void
+fpd_flash_progress(void *cb_ctx, const fpd_progress_t *progress)
+{
+    const bsp2::fpd_t *fpd = static_cast<const bsp2::fpd_t *>(cb_ctx);
+
+    fpd->report_progress({progress->phase, progress->bytes_done,
+                          progress->bytes_total, progress->mbps,
+                          progress->eta_sec});
+
+    const fpd_phase_times_t *times = progress->times;
+    if (times) {
+        const std::pair<const char *, double> phases[] = {
+            {"load", times->load_sec},       {"inflate", times->inflate_sec},
+            {"erase", times->erase_sec},     {"program", times->program_sec},
+            {"verify", times->verify_sec},
+        };
+        for (const auto &it : phases) {
+            if (it.second > 0) {
+                bsp2::fpd_t::op_timer_t::add_phase(it.first, it.second);
+            }
+        }
+    }
+}
+
+//
+// The golden metadata on flash, as "<major>.<minor>" and its checksum
+//
+static golden_version_t
+golden_version_from_flash(const bsp2::fpd_t &fpd, const std::string &source)
+{
+    uint32_t mdata_offset = std::stoul(fpd.get_fpga_offset("mdata_offset"), nullptr, 0);
+    std::string block_name = fpd.get_fpga_offset("uio_block_name");
+    golden_version_t entry = {source, "", 0};
+    uint16_t version;
+
+    if (get_iofpga_mdata_from_flash(block_name.c_str(), mdata_offset, &version,
+                                    &entry.checksum)) {
+        throw std::system_error(EIO, std::generic_category(),
+                                "Failed to read golden version from flash");
+    }
+    entry.version = std::to_string(version >> 8) + "." + std::to_string(version & 0xFF);
+    return entry;
+}
+
+static std::string
+golden_source(const bsp2::fpd_t &fpd)
+{
+    return fpd.get_fpga_offset("uio_block_name") + "@" + fpd.get_fpga_offset("mdata_offset");
+}
+
+//
+// Golden version from the cache, as long as the checksum of the metadata
+// sector on flash still matches the entry; a golden image written by
+// other means is picked up at the next query
+//
+static std::string
+golden_version(const bsp2::fpd_t &fpd)
+{
+    std::string source = golden_source(fpd);
+    golden_version_t cached;
+    bool hit = golden_cache_get(fpd.name(), source, cached);
+    golden_version_t entry = golden_version_from_flash(fpd, source);
+
+    if (hit && cached.checksum == entry.checksum) {
+        return cached.version;
+    }
+    golden_cache_put(fpd.name(), entry);
+    return entry.version;
+}
+
 std::string
 Fpd_flash::get_running_version() const
 {
     if (fpd_t::is_golden_fpd()) {
-        uint32_t mdata_offset = std::stoul(fpd_t::get_fpga_offset("mdata_offset"), nullptr, 0);
-        std::string block_name = fpd_t::get_fpga_offset("uio_block_name");
-
-        uint16_t golden_version = get_iofpga_version_from_flash(block_name.c_str(), mdata_offset);
-        auto major = golden_version >> 8;
-        auto minor = golden_version & 0xFF;
-        return (std::to_string(major) + "." + std::to_string(minor));
+        return golden_version(*this);
     }
 
     std::string version = fpd_t::get_version();
@@ -62,8 +131,12 @@ Fpd_flash::program(bool force) const {
     uint32_t mdata_size = std::stoul(fpd_t::get_fpga_offset("mdata_size"), nullptr, 0);
     std::string block_name = fpd_t::get_fpga_offset("uio_block_name");
 
-    ret = program_iofpga(path, image_offset, image_size,
-                         mdata_offset, mdata_size, block_name.c_str());
+    if (fpd_t::is_golden_fpd()) {
+        golden_cache_drop(name());
+    }
+    ret = program_iofpga_progress(path, image_offset, image_size,
+                                  mdata_offset, mdata_size, block_name.c_str(),
+                                  fpd_flash_progress, (void *)static_cast<const bsp2::fpd_t *>(this));
     if (ret) {
         std::string info("Failed to program iofpga");
         throw std::system_error(ret, std::generic_category(), info);
@@ -80,25 +153,140 @@ Fpd_flash::erase() const {
     uint32_t mdata_size = std::stoul(fpd_t::get_fpga_offset("mdata_size"), nullptr, 0);
     std::string block_name = fpd_t::get_fpga_offset("uio_block_name");
 
-    ret = erase_iofpga(image_offset, image_size,
-                       mdata_offset, mdata_size, block_name.c_str());
+    if (fpd_t::is_golden_fpd()) {
+        golden_cache_drop(name());
+    }
+    ret = erase_iofpga_progress(image_offset, image_size,
+                                mdata_offset, mdata_size, block_name.c_str(),
+                                fpd_flash_progress, (void *)static_cast<const bsp2::fpd_t *>(this));
     if (ret) {
         std::string info("Failed to erase iofpga");
         throw std::system_error(ret, std::generic_category(), info);
     }
 }
 
+void
+Fpd_flash::stage(uint32_t rate_kbs) const
+{
+    auto image_path = fpd_t::path();
+    uint32_t image_offset = std::stoul(fpd_t::get_fpga_offset("image_offset"), nullptr, 0);
+    uint32_t image_size = std::stoul(fpd_t::get_fpga_offset("image_size"), nullptr, 0);
+    uint32_t mdata_offset = std::stoul(fpd_t::get_fpga_offset("mdata_offset"), nullptr, 0);
+    uint32_t mdata_size = std::stoul(fpd_t::get_fpga_offset("mdata_size"), nullptr, 0);
+    std::string block_name = fpd_t::get_fpga_offset("uio_block_name");
+
+    // Staging leaves the metadata erased, which must not happen to the
+    // region the FPGA would boot from
+    int booted = is_golden_booted(block_name.c_str());
+    if (booted < 0) {
+        throw std::system_error(EIO, std::generic_category(), "Failed to get image boot status");
+    }
+    if (fpd_t::is_golden_fpd() == (booted < IOFPGA_PRIMARY_BOOTED)) {
+        std::string info("Cannot stage the running ");
+        info.append(fpd_t::is_golden_fpd() ? "golden" : "primary")
+            .append(" region, stage the other region or program this one");
+        throw std::system_error(EBUSY, std::generic_category(), info);
+    }
+
+    if (fpd_t::is_golden_fpd()) {
+        golden_cache_drop(name());
+    }
+    int ret = stage_iofpga(image_path.c_str(), image_offset, image_size,
+                           mdata_offset, mdata_size, block_name.c_str(), rate_kbs,
+                           fpd_flash_progress, (void *)static_cast<const bsp2::fpd_t *>(this));
+    if (ret) {
+        std::string info("Failed to stage iofpga");
+        throw std::system_error(ret, std::generic_category(), info);
+    }
+}
+
+void
+Fpd_flash::commit() const
+{
+    auto image_path = fpd_t::path();
+    uint32_t image_offset = std::stoul(fpd_t::get_fpga_offset("image_offset"), nullptr, 0);
+    uint32_t image_size = std::stoul(fpd_t::get_fpga_offset("image_size"), nullptr, 0);
+    uint32_t mdata_offset = std::stoul(fpd_t::get_fpga_offset("mdata_offset"), nullptr, 0);
+    uint32_t mdata_size = std::stoul(fpd_t::get_fpga_offset("mdata_size"), nullptr, 0);
+    std::string block_name = fpd_t::get_fpga_offset("uio_block_name");
+
+    if (fpd_t::is_golden_fpd()) {
+        golden_cache_drop(name());
+    }
+    int ret = commit_iofpga(image_path.c_str(), image_offset, image_size,
+                            mdata_offset, mdata_size, block_name.c_str());
+    if (ret) {
+        std::string info("Failed to commit iofpga");
+        if (ret == ENOENT) {
+            info.append(", the image is not staged");
+        }
+        throw std::system_error(ret, std::generic_category(), info);
+    }
+}
+
+std::string
+Fpd_flash::verify() const
+{
+    char msg[ERRBUF_SIZE] = {0};
+    auto image_path = fpd_t::path();
+    uint32_t image_offset = std::stoul(fpd_t::get_fpga_offset("image_offset"), nullptr, 0);
+    uint32_t image_size = std::stoul(fpd_t::get_fpga_offset("image_size"), nullptr, 0);
+    uint32_t mdata_offset = std::stoul(fpd_t::get_fpga_offset("mdata_offset"), nullptr, 0);
+    uint32_t mdata_size = std::stoul(fpd_t::get_fpga_offset("mdata_size"), nullptr, 0);
+    std::string block_name = fpd_t::get_fpga_offset("uio_block_name");
+
+    int ret = verify_iofpga(image_path.c_str(), image_offset, image_size,
+                            mdata_offset, mdata_size, block_name.c_str(),
+                            fpd_flash_progress, (void *)static_cast<const bsp2::fpd_t *>(this),
+                            msg, sizeof(msg));
+    if (fpd_t::is_golden_fpd()) {
+        // Bring the cached version in line with the flash just compared
+        try {
+            golden_version(*this);
+        } catch (const std::system_error &) {
+            golden_cache_drop(name());
+        }
+    }
+    if (ret) {
+        std::string info("Failed to verify iofpga: ");
+        info.append(msg);
+        throw std::system_error(ret, std::generic_category(), info);
+    }
+    return msg;
+}
+
+//
+// The image and metadata regions, and whatever lies between them, so the
+// file can be written back at the offset it was read from
+//
+std::string
+Fpd_flash::read(const std::string &out_path) const
+{
+    char msg[ERRBUF_SIZE] = {0};
+    uint32_t image_offset = std::stoul(fpd_t::get_fpga_offset("image_offset"), nullptr, 0);
+    uint32_t image_size = std::stoul(fpd_t::get_fpga_offset("image_size"), nullptr, 0);
+    uint32_t mdata_offset = std::stoul(fpd_t::get_fpga_offset("mdata_offset"), nullptr, 0);
+    uint32_t mdata_size = std::stoul(fpd_t::get_fpga_offset("mdata_size"), nullptr, 0);
+    std::string block_name = fpd_t::get_fpga_offset("uio_block_name");
+    uint32_t start = std::min(image_offset, mdata_offset);
+    uint32_t end = std::max(image_offset + image_size, mdata_offset + mdata_size);
+
+    int ret = read_iofpga(block_name.c_str(), start, end - start, out_path.c_str(),
+                          fpd_flash_progress, (void *)static_cast<const bsp2::fpd_t *>(this),
+                          msg, sizeof(msg));
+    if (ret) {
+        std::string info("Failed to read iofpga: ");
+        info.append(msg);
+        throw std::system_error(ret, std::generic_category(), info);
+    }
+    return msg;
+}
+
 std::string 
 Fpd_flash::running_version(void) const
 {
     if (fpd_t::is_golden_fpd()) {
-        uint32_t mdata_offset = std::stoul(fpd_t::get_fpga_offset("mdata_offset"), nullptr, 0);
-        std::string block_name = fpd_t::get_fpga_offset("uio_block_name");
-
-        uint16_t golden_version = get_iofpga_version_from_flash(block_name.c_str(), mdata_offset);
-        auto major = golden_version >> 8;
-        auto minor = golden_version & 0xFF;
-        return (std::to_string(major) + "." + std::to_string(minor));
+        return golden_version(*this);
     }
 
     std::string version = get_running_version();
@@ -107,7 +295,7 @@ Fpd_flash::running_version(void) const
     if (val == -1) {
         throw std::system_error(val, std::generic_category(), "Failed to get image boot status");
     }
-    if (val >= 10) {
+    if (val >= IOFPGA_PRIMARY_BOOTED) {
         return version + " (Primary)";
     } else {
         return version + " (Golden)";
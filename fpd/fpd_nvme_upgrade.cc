@@ -4,7 +4,14 @@
  * Copyright (c) 2022 by Cisco Systems, Inc.
  * All rights reserved.
  */
+#include <algorithm>
 #include <iostream>
+#include <system_error>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/nvme_ioctl.h>
 
 #include "commonUtil.h"
 #include "fpd/nvme.h"
@@ -12,23 +19,97 @@
 
 #define SMART_VENDOR_ID "0x1235"
 #define MICRON_VENDOR_ID "0x1344"
-#define NVME_TMP_FILE "/tmp/nvme-img.tmp"
+#define NVME_DEVICE "/dev/nvme0n1"
+#define NVME_ADMIN_FW_DOWNLOAD 0x11
+#define NVME_FW_XFER_SIZE 4096
+
+//
+// Send the payload to the controller with Firmware Image Download admin
+// commands, one inflate window at a time. This replaces writing the
+// whole image to a temporary file for "nvme fw-download".
+//
+static int
+nvme_fw_download(fpd_meta_info_t *meta, char *err_msg, uint32_t msg_size)
+{
+    fpd_img_stream_t *stream;
+    const void *chunk;
+    uint32_t len;
+    uint32_t offset = 0;
+    int rc;
+
+    int fd = open(NVME_DEVICE, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        rc = errno;
+        snprintf(err_msg, msg_size, "open %s: %s", NVME_DEVICE, strerror(rc));
+        return rc;
+    }
+    rc = fpd_img_stream_open(meta, FPD_STREAM_CHUNK_SIZE, &stream, err_msg, msg_size);
+    if (rc) {
+        close(fd);
+        return rc;
+    }
+    while (!(rc = fpd_img_stream_next(stream, &chunk, &len, err_msg, msg_size)) && len) {
+        for (uint32_t pos = 0; pos < len; pos += NVME_FW_XFER_SIZE) {
+            uint32_t xfer = std::min<uint32_t>(NVME_FW_XFER_SIZE, len - pos);
+            struct nvme_admin_cmd cmd = {};
+
+            // Firmware image pieces are dword granular
+            if (xfer % 4) {
+                snprintf(err_msg, msg_size, "image size not dword aligned");
+                rc = EINVAL;
+                break;
+            }
+            cmd.opcode = NVME_ADMIN_FW_DOWNLOAD;
+            cmd.addr = (uintptr_t)((const uint8_t *)chunk + pos);
+            cmd.data_len = xfer;
+            cmd.cdw10 = (xfer >> 2) - 1;
+            cmd.cdw11 = offset >> 2;
+            // A positive return is the NVMe status of a rejected command
+            int status = ioctl(fd, NVME_IOCTL_ADMIN_CMD, &cmd);
+            if (status < 0) {
+                rc = errno;
+                snprintf(err_msg, msg_size, "fw-download at offset 0x%x: %s",
+                         offset, strerror(rc));
+                break;
+            }
+            if (status) {
+                snprintf(err_msg, msg_size, "fw-download at offset 0x%x: status 0x%x",
+                         offset, status);
+                rc = EIO;
+                break;
+            }
+            offset += xfer;
+        }
+        if (rc) {
+            break;
+        }
+    }
+    // The digest was folded in while downloading; a mismatch stops us
+    // short of fw-commit so the staged image is never activated
+    if (!rc) {
+        rc = fpd_img_stream_check_digest(stream, err_msg, msg_size);
+        if (rc == ENODATA) {
+            rc = 0;
+        }
+    }
+    fpd_img_stream_close(stream);
+    close(fd);
+    return rc;
+}
 
 void 
 nvme_upgrade(std::string image_path, std::string pid)
 {
     char err_msg[128];
     uint32_t msg_size = 128;
-    char download_cmd[256] = {0};
     char commit_cmd[256] = {0};
     char commit_result[256] = {0};
     char *SLOT = "2";
     char *image_vendor = NULL;
     char *image_type = "NVME";
-    fpd_imgs_t *fpd_imgs;
+    fpd_catalog_t *catalog;
+    fpd_meta_info_t *match[2];
     int count;
-    void *data;
-    FILE *fp;
     int rc;
 
     std::string info(__func__);
@@ -57,7 +138,10 @@ nvme_upgrade(std::string image_path, std::string pid)
         throw std::runtime_error(info);
     }
 
-    rc = get_imgs_info(image_path.c_str(), &fpd_imgs, err_msg, msg_size);
+    {
+        bsp2::fpd_t::phase_timer_t load("load");
+        rc = fpd_catalog_open(image_path.c_str(), &catalog, err_msg, msg_size);
+    }
     if (rc) {
         printf("rc: %d\n", rc);
         info.append("\nFailed to parse file: (").append(image_path).append(")");
@@ -65,31 +149,26 @@ nvme_upgrade(std::string image_path, std::string pid)
         return;
     }
 
-    count = fpd_find_img(fpd_imgs, pid.c_str(), image_type, image_vendor);
+    // Ask for two so that an ambiguous bundle is caught
+    count = fpd_catalog_lookup(catalog, pid.c_str(), image_type, image_vendor,
+                               match, 2);
     if (count != 1) {
-        fpd_print_imgs_info(fpd_imgs);
+        fpd_print_imgs_info(fpd_catalog_imgs(catalog));
+        fpd_catalog_close(catalog);
         info.append("\nFailed to  get image file no match found: (").append(image_path).append(")");
         throw std::runtime_error(info);
     }
 
-    rc = img_inflate(fpd_imgs->match_list[0], &data, err_msg, msg_size);
-    if (rc) {
-        info.append("\nFailed to  inflate image rc %d", rc);
-        return;
-    }
-    fp = fopen(NVME_TMP_FILE, "wb");
-    fwrite(data, fpd_imgs->match_list[0]->img_msize, 1, fp);
-    fclose(fp);
-
+    // Stream the payload into the drive as it is inflated
     std::cout << "Downloading file into drive\n";
-    snprintf(download_cmd, sizeof(download_cmd)-1,
-             "sudo nvme fw-download /dev/nvme0n1 --fw=%s",
-             NVME_TMP_FILE);
-
-    std::string download_file = exec_shell_command(download_cmd);
-    if (download_file != "Firmware download success") {
-        info.append("\nFailed to download file: (").append(download_file).append(")");
-        throw std::runtime_error(info);
+    {
+        bsp2::fpd_t::phase_timer_t program("program");
+        rc = nvme_fw_download(match[0], err_msg, msg_size);
+    }
+    fpd_catalog_close(catalog);
+    if (rc) {
+        info.append("\nFailed to download file: (").append(err_msg).append(")");
+        throw std::system_error(rc, std::generic_category(), info);
     }
     std::cout << "Image downloaded into the drive\n";
 
@@ -98,7 +177,11 @@ nvme_upgrade(std::string image_path, std::string pid)
              "sudo nvme fw-commit /dev/nvme0n1 --slot=%s --action=1",
              SLOT);
 
-    std::string commit_verify = exec_shell_command(commit_cmd);
+    std::string commit_verify;
+    {
+        bsp2::fpd_t::phase_timer_t verify("verify");
+        commit_verify = exec_shell_command(commit_cmd);
+    }
     snprintf(commit_result, sizeof(commit_result)-1,
              "Success committing firmware action:1 slot:%s",
              SLOT);
@@ -106,6 +189,5 @@ nvme_upgrade(std::string image_path, std::string pid)
         info.append("\nFailed to commit verify image: (").append(commit_verify).append(")");
         throw std::runtime_error(info);
     }
-    remove(NVME_TMP_FILE);
     std::cout << "Firmware upgrade done\n";
 }
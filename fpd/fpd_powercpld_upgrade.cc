@@ -6,6 +6,7 @@
  */
 
 #include <iostream>
+#include "bsp/fpd.h"
 #include "fpd_utils.h"
 
 
@@ -21,16 +22,25 @@ program_powercpld_image (uint16_t mdata_size, std::string image_path)
     snprintf(upgrade_image_cmd, sizeof(upgrade_image_cmd)-1,
              "sudo dd if=%s bs=%d skip=1 of=%s",
              image_path.c_str(), mdata_size, IMAGE_FILE);
-    std::string upgrade_image = exec_shell_command(upgrade_image_cmd);
+    std::string upgrade_image;
+    {
+        bsp2::fpd_t::phase_timer_t load("load");
+        upgrade_image = exec_shell_command(upgrade_image_cmd);
+    }
 
     std::cout << "Upgrade image created" << std::endl;
 
     // Find mtd partition of power-cpld
     snprintf(part_str_cmd, sizeof(part_str_cmd)-1,
             "cat /proc/mtd | grep \"power-cpld\" | awk '{print $1;}'");
-    std::string part_str = exec_shell_command(part_str_cmd);
+    std::string part_str;
+    {
+        bsp2::fpd_t::phase_timer_t helper("helper");
+        part_str = exec_shell_command(part_str_cmd);
+    }
 
-    // Program microinit image
+    // Program microinit image, flashcp verifying it as it goes
+    bsp2::fpd_t::phase_timer_t program("program");
     snprintf(flashcp_cmd, sizeof(flashcp_cmd)-1,
             "sudo flashcp -v %s /dev/%s",
             IMAGE_FILE, part_str.c_str());
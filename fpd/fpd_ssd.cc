@@ -29,7 +29,10 @@ Fpd_ssd::program(bool force) const
             throw std::system_error(EPERM, std::generic_category(), info);
         }
     }
-    ret = ssd_fpd_upgrade();
+    {
+        phase_timer_t program("program");
+        ret = ssd_fpd_upgrade();
+    }
     if (ret == -1) {
         std::string info("program:");
         info.append("Failed to Program SSD");
@@ -5,10 +5,22 @@
  * All rights reserved.
  */
 #include <iostream>
+#include <fstream>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
 
+#include "bsp/fwd.h"
 #include "fpd_utils.h"
 
+#define GOLDEN_CACHE_ENV        "FPD_GOLDEN_CACHE"
+#define GOLDEN_CACHE_DIRS       { "/mnt/data1", "/var/lib", "/var/tmp" }
+#define GOLDEN_CACHE_FILE       "fpd_golden_versions.json"
+#define BOOT_ID_FILE            "/proc/sys/kernel/random/boot_id"
+
 std::string 
 exec_shell_command(const char* cmd) {
     char  result[128];
@@ -21,3 +33,140 @@ exec_shell_command(const char* cmd) {
     pclose(fp);
     return result;
 }
+
+static std::string
+golden_cache_path()
+{
+    const char *env = getenv(GOLDEN_CACHE_ENV);
+    struct stat st;
+
+    if (env && *env) {
+        return env;
+    }
+    for (const char *dir : GOLDEN_CACHE_DIRS) {
+        if (!stat(dir, &st) && S_ISDIR(st.st_mode)) {
+            return std::string(dir) + "/" + GOLDEN_CACHE_FILE;
+        }
+    }
+    return "";
+}
+
+static std::string
+boot_id()
+{
+    std::ifstream in(BOOT_ID_FILE);
+    std::string id;
+
+    in >> id;
+    return id;
+}
+
+//
+// Run update on the cache contents under an exclusive lock and write the
+// result back, so components programmed in parallel do not lose entries
+//
+template <typename F>
+static void
+golden_cache_update(F update)
+{
+    std::string path = golden_cache_path();
+    if (path.empty()) {
+        return;
+    }
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0 || flock(fd, LOCK_EX)) {
+        std::cerr << path << ": " << strerror(errno) << std::endl;
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+
+    std::string text;
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        text.append(buf, n);
+    }
+    json cache = json::parse(text, nullptr, false);
+    if (cache.is_discarded() || !cache.is_object()) {
+        cache = json::object();
+    }
+    update(cache);
+
+    text = cache.dump(4) + "\n";
+    if (ftruncate(fd, 0) || pwrite(fd, text.data(), text.size(), 0) != (ssize_t)text.size()) {
+        std::cerr << path << ": " << strerror(errno) << std::endl;
+    }
+    close(fd);
+}
+
+bool
+golden_cache_get(const std::string &fpd, const std::string &source,
+                 golden_version_t &entry)
+{
+    std::string path = golden_cache_path();
+    if (path.empty()) {
+        return false;
+    }
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    (void)flock(fd, LOCK_SH);
+    std::string text;
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        text.append(buf, n);
+    }
+    close(fd);
+
+    json cache = json::parse(text, nullptr, false);
+    if (cache.is_discarded() || !cache.is_object() || !cache.contains(fpd)) {
+        return false;
+    }
+    const json &e = cache[fpd];
+    if (!e.is_object() || e.value("pending", false) ||
+        e.value("source", "") != source || e.value("version", "").empty()) {
+        return false;
+    }
+    entry.source = source;
+    entry.version = e.value("version", "");
+    entry.checksum = e.value("checksum", 0u);
+    return true;
+}
+
+void
+golden_cache_put(const std::string &fpd, const golden_version_t &entry)
+{
+    std::string id = boot_id();
+
+    golden_cache_update([&](json &cache) {
+        // A program waiting for a reboot leaves the old version on flash
+        if (cache.contains(fpd) && cache[fpd].is_object() &&
+            cache[fpd].value("pending", false) &&
+            cache[fpd].value("boot_id", "") == id) {
+            return;
+        }
+        cache[fpd] = {
+            {"source", entry.source},
+            {"version", entry.version},
+            {"checksum", entry.checksum},
+        };
+    });
+}
+
+void
+golden_cache_drop(const std::string &fpd, bool pending)
+{
+    std::string id = boot_id();
+
+    golden_cache_update([&](json &cache) {
+        if (pending) {
+            cache[fpd] = {{"pending", true}, {"boot_id", id}};
+        } else {
+            cache.erase(fpd);
+        }
+    });
+}
@@ -0,0 +1,257 @@
+/*------------------------------------------------------------------
+ * mmioUtil.c
+ *
+ * Process wide cache of PCI BAR mappings used by the FPD utilities.
+ *
+ * Copyright (c) 2022 by Cisco Systems, Inc.
+ * All rights reserved.
+ *-----------------------------------------------------------------
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "commonUtil.h"
+#include "mmioUtil.h"
+
+#define IORESOURCE_MEM      0x00000200
+
+typedef struct mmio_region_desc_ {
+    const char *name;
+    uint16_t vendor;
+    uint16_t device;
+    uint64_t bar_size;
+} mmio_region_desc_t;
+
+static const mmio_region_desc_t mmio_regions[MMIO_REGION_MAX] = {
+    [MMIO_REGION_SILVERBOLT] = { "SILVERBOLT", PCI_VENDOR_ANY,
+                                 SILVERBOLT_PCI_DEVICE_ID, SILVERBOLT_BAR_SIZE },
+    [MMIO_REGION_CYCLONUS]   = { "CYCLONUS", PCI_VENDOR_ANY,
+                                 CYCLONUS_PCI_DEVICE_ID, CYCLONUS_BAR_SIZE },
+};
+
+static pthread_mutex_t mmio_lock = PTHREAD_MUTEX_INITIALIZER;
+static mmio_bar_t mmio_bars[MMIO_REGION_MAX];
+
+static int
+sysfs_read_hex(const char *bdf, const char *attr, unsigned long *value)
+{
+    char path[256];
+    char buf[32];
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "%s/%s/%s", PCI_SYSFS_DEVICES_PATH, bdf, attr);
+    fp = fopen(path, "r");
+    if (!fp) {
+        return errno;
+    }
+    if (!fgets(buf, sizeof(buf), fp)) {
+        fclose(fp);
+        return EIO;
+    }
+    fclose(fp);
+    *value = strtoul(buf, NULL, 16);
+    return 0;
+}
+
+/*
+ * Find the memory BAR of the given size in the sysfs "resource" file of
+ * a device. Returns the BAR index, or -1 if none matches.
+ */
+static int
+sysfs_find_bar(const char *bdf, uint64_t bar_size, uint64_t *phys)
+{
+    char path[256];
+    unsigned long long start, end, flags;
+    FILE *fp;
+    int bar;
+
+    snprintf(path, sizeof(path), "%s/%s/resource", PCI_SYSFS_DEVICES_PATH, bdf);
+    fp = fopen(path, "r");
+    if (!fp) {
+        return -1;
+    }
+    for (bar = 0; bar < PCI_MAX_BARS; bar++) {
+        if (fscanf(fp, "%llx %llx %llx", &start, &end, &flags) != 3) {
+            break;
+        }
+        if (!(flags & IORESOURCE_MEM) || !end) {
+            continue;
+        }
+        if (end - start + 1 == bar_size) {
+            fclose(fp);
+            *phys = start;
+            return bar;
+        }
+    }
+    fclose(fp);
+    return -1;
+}
+
+static int
+mmio_resolve(const mmio_region_desc_t *desc, mmio_bar_t *bar)
+{
+    struct dirent *entry;
+    unsigned long vendor, device;
+    DIR *dir;
+
+    dir = opendir(PCI_SYSFS_DEVICES_PATH);
+    if (!dir) {
+        return errno;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        if (sysfs_read_hex(entry->d_name, "device", &device) ||
+            device != desc->device) {
+            continue;
+        }
+        if (desc->vendor != PCI_VENDOR_ANY &&
+            (sysfs_read_hex(entry->d_name, "vendor", &vendor) ||
+             vendor != desc->vendor)) {
+            continue;
+        }
+        bar->bar = sysfs_find_bar(entry->d_name, desc->bar_size, &bar->phys);
+        if (bar->bar < 0) {
+            continue;
+        }
+        /* Anything that does not fit is not a PCI address */
+        if (snprintf(bar->bdf, sizeof(bar->bdf), "%s", entry->d_name) >=
+            (int)sizeof(bar->bdf)) {
+            continue;
+        }
+        bar->size = desc->bar_size;
+        closedir(dir);
+        return 0;
+    }
+    closedir(dir);
+    return ENODEV;
+}
+
+static int
+mmio_map(mmio_bar_t *bar)
+{
+    char path[256];
+    void *virt;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/%s/resource%d",
+             PCI_SYSFS_DEVICES_PATH, bar->bdf, bar->bar);
+    fd = open(path, O_RDWR | O_SYNC);
+    if (fd < 0) {
+        return errno;
+    }
+    virt = mmap(NULL, bar->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    /* The mapping holds its own reference to the file */
+    close(fd);
+    if (virt == MAP_FAILED) {
+        return errno;
+    }
+    bar->virt = virt;
+    return 0;
+}
+
+const mmio_bar_t *
+mmio_get_bar(mmio_region_en region)
+{
+    const mmio_region_desc_t *desc;
+    mmio_bar_t *bar;
+    int rc;
+
+    if (region < 0 || region >= MMIO_REGION_MAX) {
+        errno = EINVAL;
+        return NULL;
+    }
+    desc = &mmio_regions[region];
+    bar = &mmio_bars[region];
+
+    pthread_mutex_lock(&mmio_lock);
+    if (!bar->virt) {
+        rc = mmio_resolve(desc, bar);
+        if (rc) {
+            fprintf(stderr, "Failed to find %s %lluM BAR. (%s)\n", desc->name,
+                    (unsigned long long)(desc->bar_size >> 20), strerror(rc));
+        } else {
+            rc = mmio_map(bar);
+            if (rc) {
+                fprintf(stderr, "Failed to map %s BAR%d of %s. (%s)\n",
+                        desc->name, bar->bar, bar->bdf, strerror(rc));
+            }
+        }
+        if (rc) {
+            memset(bar, 0, sizeof(*bar));
+            pthread_mutex_unlock(&mmio_lock);
+            errno = rc;
+            return NULL;
+        }
+    }
+    pthread_mutex_unlock(&mmio_lock);
+    return bar;
+}
+
+volatile void *
+mmio_region_regs(mmio_region_en region, uint64_t offset, size_t len)
+{
+    const mmio_bar_t *bar = mmio_get_bar(region);
+
+    if (!bar) {
+        return NULL;
+    }
+    if (offset >= bar->size || len > bar->size - offset) {
+        fprintf(stderr, "%s offset 0x%llx (+%zu) is outside the %lluM BAR\n",
+                mmio_regions[region].name, (unsigned long long)offset, len,
+                (unsigned long long)(bar->size >> 20));
+        errno = ERANGE;
+        return NULL;
+    }
+    return bar->virt + offset;
+}
+
+volatile uint32_t *
+mmio_silverbolt_regs(uint64_t offset)
+{
+    return mmio_region_regs(MMIO_REGION_SILVERBOLT, offset, sizeof(uint32_t));
+}
+
+volatile uint32_t *
+mmio_cyclonus_regs(uint64_t offset)
+{
+    return mmio_region_regs(MMIO_REGION_CYCLONUS, offset, sizeof(uint32_t));
+}
+
+volatile uint32_t *
+mmio_pim_regs(int pim, uint64_t offset, size_t len)
+{
+    if (pim < 1) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return mmio_region_regs(MMIO_REGION_SILVERBOLT,
+                            (uint64_t)(pim - 1) * SLPC_MEMORY_BASE +
+                            SLPC_MEMORY_OFFSET + offset, len);
+}
+
+void
+mmio_release_all(void)
+{
+    int i;
+
+    pthread_mutex_lock(&mmio_lock);
+    for (i = 0; i < MMIO_REGION_MAX; i++) {
+        if (mmio_bars[i].virt) {
+            munmap((void *)mmio_bars[i].virt, mmio_bars[i].size);
+        }
+        memset(&mmio_bars[i], 0, sizeof(mmio_bars[i]));
+    }
+    pthread_mutex_unlock(&mmio_lock);
+}
@@ -0,0 +1,245 @@
+/*------------------------------------------------------------------
+ * mtdUtil.c
+ *
+ * Access to MTD flash partitions through their char devices.
+ *
+ * Copyright (c) 2022 by Cisco Systems, Inc.
+ * All rights reserved.
+ *-----------------------------------------------------------------
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <mtd/mtd-user.h>
+#include "mtdUtil.h"
+
+/*
+ * First partition whose name contains name, or is name when exact
+ */
+static int
+mtd_find(const char *name, bool exact, char *dev, size_t dev_size,
+         char *err_msg, uint32_t msg_size)
+{
+    char line[256], mtd[MTD_DEV_NAME_LEN], part[128];
+    unsigned int size, erasesize;
+    FILE *fp;
+    int rc = ENODEV;
+
+    fp = fopen(MTD_PROC_FILE, "r");
+    if (!fp) {
+        rc = errno;
+        snprintf(err_msg, msg_size, "Failed to open %s: %s", MTD_PROC_FILE,
+                 strerror(rc));
+        return rc;
+    }
+
+    /* Lines look like: mtd0: 02000000 00010000 "bios_full" */
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "%31[^:]: %x %x \"%127[^\"]\"", mtd, &size,
+                   &erasesize, part) != 4) {
+            continue;
+        }
+        if (exact ? !strcmp(part, name) : strcasestr(part, name) != NULL) {
+            snprintf(dev, dev_size, "/dev/%s", mtd);
+            rc = 0;
+            break;
+        }
+    }
+    fclose(fp);
+    if (rc) {
+        snprintf(err_msg, msg_size, "No MTD device found for %s", name);
+    }
+    return rc;
+}
+
+int
+mtd_find_device(const char *name, char *dev, size_t dev_size,
+                char *err_msg, uint32_t msg_size)
+{
+    return mtd_find(name, false, dev, dev_size, err_msg, msg_size);
+}
+
+int
+mtd_read(const char *dev, uint64_t offset, void *buf, size_t len,
+         char *err_msg, uint32_t msg_size)
+{
+    ssize_t n;
+    int fd, rc = 0;
+
+    fd = open(dev, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        rc = errno;
+        snprintf(err_msg, msg_size, "Failed to open %s: %s", dev, strerror(rc));
+        return rc;
+    }
+    n = pread(fd, buf, len, offset);
+    if (n < 0) {
+        rc = errno;
+        snprintf(err_msg, msg_size, "Failed to read %s at 0x%llx: %s", dev,
+                 (unsigned long long)offset, strerror(rc));
+    } else if ((size_t)n != len) {
+        rc = EIO;
+        snprintf(err_msg, msg_size, "Short read of %s at 0x%llx: %zd of %zu bytes",
+                 dev, (unsigned long long)offset, n, len);
+    }
+    close(fd);
+    return rc;
+}
+
+static bool
+mtd_block_blank(const uint8_t *buf, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if (buf[i] != 0xff) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Bring one erase block at offset to the contents of want; cur holds
+ * what the flash has there now and is overwritten by the read back
+ */
+static int
+mtd_write_block(int fd, const char *dev, uint32_t offset, uint32_t len,
+                const uint8_t *want, uint8_t *cur, mtd_write_stats_t *stats,
+                char *err_msg, uint32_t msg_size)
+{
+    struct erase_info_user erase = { offset, len };
+    ssize_t n;
+    int rc;
+
+    if (!mtd_block_blank(cur, len)) {
+        if (ioctl(fd, MEMERASE, &erase)) {
+            rc = errno;
+            snprintf(err_msg, msg_size, "Failed to erase %s at 0x%x: %s", dev,
+                     offset, strerror(rc));
+            return rc;
+        }
+        stats->erased++;
+    }
+    n = pwrite(fd, want, len, offset);
+    if (n != (ssize_t)len) {
+        rc = n < 0 ? errno : EIO;
+        snprintf(err_msg, msg_size, "Failed to write %s at 0x%x: %s", dev,
+                 offset, strerror(rc));
+        return rc;
+    }
+    n = pread(fd, cur, len, offset);
+    if (n != (ssize_t)len || memcmp(cur, want, len)) {
+        snprintf(err_msg, msg_size, "Flash verification failed at %s 0x%x",
+                 dev, offset);
+        return EIO;
+    }
+    stats->written++;
+    return 0;
+}
+
+int
+mtd_write_file(const char *name, const char *path, uint64_t src_offset,
+               mtd_write_stats_t *stats, char *err_msg, uint32_t msg_size)
+{
+    char dev[MTD_DEV_NAME_LEN + 8];
+    struct mtd_info_user info;
+    struct stat st;
+    uint8_t *want = NULL, *cur = NULL;
+    uint64_t size, done;
+    uint32_t len;
+    ssize_t n;
+    int src = -1, fd = -1, rc;
+
+    memset(stats, 0, sizeof(*stats));
+    rc = mtd_find(name, true, dev, sizeof(dev), err_msg, msg_size);
+    if (rc) {
+        return rc;
+    }
+
+    src = open(path, O_RDONLY | O_CLOEXEC);
+    if (src < 0 || fstat(src, &st)) {
+        rc = errno;
+        snprintf(err_msg, msg_size, "Failed to open %s: %s", path, strerror(rc));
+        goto out;
+    }
+    if ((uint64_t)st.st_size <= src_offset) {
+        rc = EINVAL;
+        snprintf(err_msg, msg_size, "%s holds no image past offset 0x%llx",
+                 path, (unsigned long long)src_offset);
+        goto out;
+    }
+    size = st.st_size - src_offset;
+
+    fd = open(dev, O_RDWR | O_SYNC | O_CLOEXEC);
+    if (fd < 0 || ioctl(fd, MEMGETINFO, &info)) {
+        rc = errno;
+        snprintf(err_msg, msg_size, "Failed to open %s: %s", dev, strerror(rc));
+        goto out;
+    }
+    if (size > info.size) {
+        rc = EFBIG;
+        snprintf(err_msg, msg_size, "Image of %llu bytes does not fit %s of %u",
+                 (unsigned long long)size, dev, info.size);
+        goto out;
+    }
+
+    stats->erasesize = info.erasesize;
+    want = malloc(info.erasesize);
+    cur = malloc(info.erasesize);
+    if (!want || !cur) {
+        rc = ENOMEM;
+        snprintf(err_msg, msg_size, "Failed to allocate %u byte blocks",
+                 info.erasesize);
+        goto out;
+    }
+
+    for (done = 0; done < size; done += info.erasesize) {
+        len = size - done < info.erasesize ? size - done : info.erasesize;
+        n = pread(src, want, len, src_offset + done);
+        if (n != (ssize_t)len) {
+            rc = n < 0 ? errno : EIO;
+            snprintf(err_msg, msg_size, "Failed to read %s at 0x%llx: %s", path,
+                     (unsigned long long)(src_offset + done), strerror(rc));
+            goto out;
+        }
+        memset(want + len, 0xff, info.erasesize - len);
+
+        n = pread(fd, cur, info.erasesize, done);
+        if (n != (ssize_t)info.erasesize) {
+            rc = n < 0 ? errno : EIO;
+            snprintf(err_msg, msg_size, "Failed to read %s at 0x%llx: %s", dev,
+                     (unsigned long long)done, strerror(rc));
+            goto out;
+        }
+        stats->blocks++;
+        if (!memcmp(cur, want, info.erasesize)) {
+            stats->unchanged++;
+            continue;
+        }
+        rc = mtd_write_block(fd, dev, done, info.erasesize, want, cur, stats,
+                             err_msg, msg_size);
+        if (rc) {
+            goto out;
+        }
+    }
+
+out:
+    free(want);
+    free(cur);
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (src >= 0) {
+        close(src);
+    }
+    return rc;
+}
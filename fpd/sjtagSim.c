@@ -0,0 +1,572 @@
+/*------------------------------------------------------------------
+ * sjtagSim.c
+ *
+ * Software model of an SJTAG SPI controller block and the SPI flash
+ * behind it. Register stores and loads of the flash engine are handed to
+ * sjtag_sim_reg_write() / sjtag_sim_reg_read(), which run each command
+ * against an in memory (or file backed) NOR flash when the controller is
+ * started, the way the FPGA would.
+ *
+ * Flash semantics follow the parts in the spiflash model table: erase
+ * sets whole sectors to 0xFF, programming can only clear bits and wraps
+ * within a page, and program / erase need a write enable first. The
+ * controller stays busy for the time the command takes on the SPI wires
+ * and the flash reports Write In Progress for its program / erase time,
+ * so polling and waiting behave as on hardware.
+ *
+ * Copyright (c) 2022 by Cisco Systems, Inc.
+ * All rights reserved.
+ *-----------------------------------------------------------------
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "iofpga_sjtag_fpd.h"
+#include "sjtagSim.h"
+
+#define SIM_REG(field)                                                  \
+    (offsetof(fpgalib_sjtag_regs_t, cfgspi_reg) +                       \
+     offsetof(fpgalib_sjtag_cfgspi_reg_t, field))
+
+/* fpga_spi_control */
+#define SIM_CTRL_USE_ADDR       0x00000001U
+#define SIM_CTRL_DATA_DIR       0x00000002U     /* 1: write to flash */
+#define SIM_CTRL_USE_DUMMY      0x00000004U
+#define SIM_CTRL_USE_OPCODE     0x00000008U
+#define SIM_CTRL_ADDR_SIZE(v)   ((((v) >> 8) & 0x3) + 1)
+#define SIM_CTRL_CPUWR          0x00000400U
+#define SIM_CTRL_FIFO32         0x00000800U
+#define SIM_CTRL_ADDR_MSB(v)    ((v) & 0xff000000U)
+
+/* fpga_spi_status */
+#define SIM_STATUS_BUSY         0x00004000U
+#define SIM_STATUS_DONE         0x00008000U
+
+/* flash status / flag status registers */
+#define SIM_SR_WIP              0x01
+#define SIM_SR_WEL              0x02
+#define SIM_FSR_READY           0x80
+
+#define SIM_FIFO_BYTES          4096
+#define SIM_FIFO_DWORDS         (SIM_FIFO_BYTES / 4)
+
+struct sjtag_sim_ {
+    sjtag_sim_cfg_t cfg;
+    char block_name[SJTAG_BLOCK_NAME_LEN];
+
+    /* stand in for the register window */
+    volatile uint32_t *regs;
+    size_t regs_size;
+
+    /* flash contents, file backed if cfg.dir is set */
+    uint8_t *flash;
+
+    /* controller fifos, one dword per register access */
+    uint32_t wfifo[SIM_FIFO_DWORDS];
+    uint32_t wfifo_len;
+    uint32_t rfifo[SIM_FIFO_DWORDS];
+    uint32_t rfifo_len;
+    uint32_t rfifo_pos;
+
+    /* controller busy until, and Done not yet cleared */
+    uint64_t xfer_end_ns;
+    bool done;
+
+    /* flash state */
+    uint64_t wip_end_ns;
+    bool wel;
+    uint8_t bank;
+};
+
+static uint64_t
+sim_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+sim_warn(sjtag_sim_t *sim, const char *what, uint8_t opcode, uint32_t addr)
+{
+    fprintf(stderr, "sjtag sim %s: %s, opcode 0x%02x addr 0x%x\n",
+            sim->block_name, what, opcode, addr);
+}
+
+int
+sjtag_sim_cfg_parse(sjtag_sim_cfg_t *cfg, const char *spec)
+{
+    char buf[256];
+    char *save = NULL;
+    char *tok, *val, *end;
+    unsigned long num;
+
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->subsector_size = 4 * 1024;
+    cfg->spi_khz = 25000;
+    cfg->page_program_us = 120;
+    cfg->subsector_erase_us = 50 * 1000;
+    cfg->sector_erase_us = 150 * 1000;
+    cfg->bulk_erase_us = 150 * 1000 * 1000;
+
+    if (!spec) {
+        return 0;
+    }
+    snprintf(buf, sizeof(buf), "%s", spec);
+    for (tok = strtok_r(buf, ",", &save); tok;
+         tok = strtok_r(NULL, ",", &save)) {
+        if (!strcmp(tok, "1")) {
+            continue;
+        }
+        val = strchr(tok, '=');
+        if (!val) {
+            return EINVAL;
+        }
+        *val++ = '\0';
+        if (!strcmp(tok, "dir")) {
+            snprintf(cfg->dir, sizeof(cfg->dir), "%s", val);
+            continue;
+        }
+        num = strtoul(val, &end, 0);
+        if (end == val || *end) {
+            return EINVAL;
+        }
+        if (!strcmp(tok, "model")) {
+            cfg->model = num;
+        } else if (!strcmp(tok, "spi_khz")) {
+            cfg->spi_khz = num;
+        } else if (!strcmp(tok, "page")) {
+            cfg->page_size = num;
+        } else if (!strcmp(tok, "sector")) {
+            cfg->sector_size = num;
+        } else if (!strcmp(tok, "subsector")) {
+            cfg->subsector_size = num;
+        } else if (!strcmp(tok, "program_us")) {
+            cfg->page_program_us = num;
+        } else if (!strcmp(tok, "erase_us")) {
+            cfg->sector_erase_us = num;
+        } else if (!strcmp(tok, "subsector_erase_us")) {
+            cfg->subsector_erase_us = num;
+        } else if (!strcmp(tok, "bulk_erase_us")) {
+            cfg->bulk_erase_us = num;
+        } else {
+            return EINVAL;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Map the flash contents: a <dir>/<block>.bin file when a directory is
+ * configured, anonymous memory otherwise. Bytes never written read 0xFF.
+ */
+static int
+sim_flash_map(sjtag_sim_t *sim)
+{
+    char path[256];
+    struct stat st;
+    void *mem;
+    char *c;
+    int fd;
+
+    if (!sim->cfg.dir[0]) {
+        mem = mmap(NULL, sim->cfg.capacity, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            return errno;
+        }
+        memset(mem, 0xFF, sim->cfg.capacity);
+        sim->flash = mem;
+        return 0;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s.bin", sim->cfg.dir, sim->block_name);
+    for (c = path + strlen(sim->cfg.dir) + 1; *c; c++) {
+        if (*c == '/') {
+            *c = '_';
+        }
+    }
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return errno;
+    }
+    if (fstat(fd, &st) || ftruncate(fd, sim->cfg.capacity)) {
+        close(fd);
+        return errno;
+    }
+    mem = mmap(NULL, sim->cfg.capacity, PROT_READ | PROT_WRITE, MAP_SHARED,
+               fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        return errno;
+    }
+    if ((uint64_t)st.st_size < sim->cfg.capacity) {
+        memset((uint8_t *)mem + st.st_size, 0xFF,
+               sim->cfg.capacity - st.st_size);
+    }
+    sim->flash = mem;
+    return 0;
+}
+
+sjtag_sim_t *
+sjtag_sim_create(const sjtag_sim_cfg_t *cfg, const char *block_name)
+{
+    sjtag_sim_t *sim;
+    long page = sysconf(_SC_PAGESIZE);
+    void *mem;
+    int rc;
+
+    if (!cfg->capacity || !cfg->page_size || !cfg->sector_size ||
+        !cfg->subsector_size || cfg->capacity % cfg->sector_size) {
+        errno = EINVAL;
+        return NULL;
+    }
+    sim = calloc(1, sizeof(*sim));
+    if (!sim) {
+        return NULL;
+    }
+    sim->cfg = *cfg;
+    snprintf(sim->block_name, sizeof(sim->block_name), "%s", block_name);
+
+    sim->regs_size = (sizeof(fpgalib_sjtag_regs_t) + page - 1) & ~(page - 1);
+    mem = mmap(NULL, sim->regs_size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        rc = errno;
+        free(sim);
+        errno = rc;
+        return NULL;
+    }
+    sim->regs = mem;
+
+    rc = sim_flash_map(sim);
+    if (rc) {
+        munmap((void *)sim->regs, sim->regs_size);
+        free(sim);
+        errno = rc;
+        return NULL;
+    }
+    return sim;
+}
+
+void
+sjtag_sim_destroy(sjtag_sim_t *sim)
+{
+    if (!sim) {
+        return;
+    }
+    munmap(sim->flash, sim->cfg.capacity);
+    munmap((void *)sim->regs, sim->regs_size);
+    free(sim);
+}
+
+void *
+sjtag_sim_regs(sjtag_sim_t *sim)
+{
+    return (void *)sim->regs;
+}
+
+/*
+ * Bytes travel through the 32 bit fifos most significant byte first
+ */
+static uint8_t
+sim_wfifo_byte(sjtag_sim_t *sim, uint32_t idx, bool fifo32)
+{
+    if (!fifo32) {
+        return idx < sim->wfifo_len ? sim->wfifo[idx] & 0xFF : 0xFF;
+    }
+    if (idx / 4 >= sim->wfifo_len) {
+        return 0xFF;
+    }
+    return sim->wfifo[idx / 4] >> (24 - 8 * (idx % 4));
+}
+
+static void
+sim_rfifo_fill(sjtag_sim_t *sim, const uint8_t *data, uint32_t len)
+{
+    uint32_t ii;
+
+    if (len > SIM_FIFO_BYTES) {
+        len = SIM_FIFO_BYTES;
+    }
+    memset(sim->rfifo, 0, sizeof(sim->rfifo));
+    for (ii = 0; ii < len; ii++) {
+        sim->rfifo[ii / 4] |= (uint32_t)data[ii] << (24 - 8 * (ii % 4));
+    }
+    sim->rfifo_len = (len + 3) / 4;
+    sim->rfifo_pos = 0;
+}
+
+static void
+sim_flash_read(sjtag_sim_t *sim, uint32_t addr, uint32_t len)
+{
+    uint8_t data[SIM_FIFO_BYTES];
+    uint32_t ii;
+
+    if (len > sizeof(data)) {
+        len = sizeof(data);
+    }
+    for (ii = 0; ii < len; ii++) {
+        data[ii] = sim->flash[(addr + ii) % sim->cfg.capacity];
+    }
+    sim_rfifo_fill(sim, data, len);
+}
+
+static void
+sim_flash_program(sjtag_sim_t *sim, uint32_t addr, uint32_t len, bool fifo32)
+{
+    uint32_t page = sim->cfg.page_size;
+    uint32_t base = (addr % sim->cfg.capacity) / page * page;
+    uint32_t ii;
+
+    if (len > page) {
+        sim_warn(sim, "program longer than a page wraps", 0, addr);
+    }
+    for (ii = 0; ii < len; ii++) {
+        sim->flash[base + (addr + ii) % page] &=
+            sim_wfifo_byte(sim, ii, fifo32);
+    }
+}
+
+static void
+sim_flash_erase(sjtag_sim_t *sim, uint32_t addr, uint32_t size)
+{
+    addr = (addr % sim->cfg.capacity) / size * size;
+    memset(sim->flash + addr, 0xFF, size);
+}
+
+/*
+ * Run the command set up in the opcode / address, size and control
+ * registers, as the controller does when CPUWR is written
+ */
+static void
+sim_execute(sjtag_sim_t *sim, uint32_t ctrl)
+{
+    uint32_t addr_op = sim->regs[SIM_REG(fpga_spi_addr_op) / 4];
+    uint32_t len = sim->regs[SIM_REG(fpga_spi_rdsize) / 4] & 0xfff;
+    bool fifo32 = ctrl & SIM_CTRL_FIFO32;
+    uint8_t opcode = 0;
+    uint32_t addr = 0;
+    uint32_t addr_len = 0;
+    uint64_t now = sim_now_ns();
+    bool wip = now < sim->wip_end_ns;
+    uint64_t busy_us = 0;
+    uint64_t wire_bytes;
+    uint8_t reg;
+
+    if (ctrl & SIM_CTRL_USE_OPCODE) {
+        opcode = addr_op >> 24;
+    }
+    if (ctrl & SIM_CTRL_USE_ADDR) {
+        addr_len = SIM_CTRL_ADDR_SIZE(ctrl);
+        addr = addr_op & 0x00ffffffU;
+        if (addr_len == 4) {
+            addr |= SIM_CTRL_ADDR_MSB(ctrl);
+        } else {
+            addr |= (uint32_t)(sim->bank & 0x7f) << 24;
+        }
+    }
+    if ((ctrl & SIM_CTRL_DATA_DIR) && !len) {
+        len = fifo32 ? sim->wfifo_len * 4 : sim->wfifo_len;
+    }
+
+    sim->rfifo_len = 0;
+    sim->rfifo_pos = 0;
+
+    if (wip && opcode != SPIFLASH_READ_STATUS_REGISTER &&
+        opcode != SPIFLASH_READ_FLAG_STATUS_REGISTER) {
+        sim_warn(sim, "command while flash is busy ignored", opcode, addr);
+        goto xfer;
+    }
+
+    switch (opcode) {
+    case SPIFLASH_READ_ID:
+    case SPIFLASH_READ_ID_1:
+    case SPIFLASH_READ_ID_2: {
+        uint8_t id[SIM_FIFO_BYTES] = {0};
+
+        memcpy(id, sim->cfg.jedec_id, sizeof(sim->cfg.jedec_id));
+        sim_rfifo_fill(sim, id, len);
+        break;
+    }
+    case SPIFLASH_READ_STATUS_REGISTER:
+        reg = (wip ? SIM_SR_WIP : 0) | (sim->wel ? SIM_SR_WEL : 0);
+        sim_rfifo_fill(sim, &reg, 1);
+        break;
+    case SPIFLASH_READ_FLAG_STATUS_REGISTER:
+        reg = wip ? 0 : SIM_FSR_READY;
+        sim_rfifo_fill(sim, &reg, 1);
+        break;
+    case SPIFLASH_WRITE_ENABLE:
+        sim->wel = true;
+        break;
+    case SPIFLASH_WRITE_DISABLE:
+        sim->wel = false;
+        break;
+    case SPIFLASH_READ_BRRD_REGISTER:
+    case SPIFLASH_READ_EXTENDED_ADDRESS_REGISTER:
+        sim_rfifo_fill(sim, &sim->bank, 1);
+        break;
+    case SPIFLASH_WRITE_BRWR_REGISTER:
+    case SPIFLASH_WRITE_EXTENDED_ADDRESS_REGISTER:
+        sim->bank = sim_wfifo_byte(sim, 0, fifo32);
+        sim->wel = false;
+        break;
+    case SPIFLASH_ENTER_4BYTE_ADDRESS_MODE:
+    case SPIFLASH_EXIT_4BYTE_ADDRESS_MODE:
+        /* the controller sends the address size of each command */
+        break;
+    case SPIFLASH_READ:
+    case SPIFLASH_FAST_READ:
+    case SPIFLASH_4READ:
+    case SPIFLASH_4FAST_READ:
+    case SPIFLASH_QUAD_OUTPUT_FAST_READ:
+    case SPIFLASH_4QUAD_OUTPUT_FAST_READ:
+        sim_flash_read(sim, addr, len);
+        break;
+    case SPIFLASH_PAGE_PROGRAM:
+    case SPIFLASH_EXTENDED_QUAD_INPUT_FAST_PROGRAM_2:
+    case SPIFLASH_QUAD_INPUT_FAST_PROGRAM:
+    case SPIFLASH_4QUAD_INPUT_FAST_PROGRAM:
+        if (!sim->wel) {
+            sim_warn(sim, "program without write enable ignored", opcode,
+                     addr);
+            break;
+        }
+        sim_flash_program(sim, addr, len, fifo32);
+        busy_us = sim->cfg.page_program_us;
+        sim->wel = false;
+        break;
+    case SPIFLASH_SUBSECTOR_ERASE:
+    case SPIFLASH_SUBSECTOR_4ERASE:
+    case SPIFLASH_SECTOR_ERASE:
+    case SPIFLASH_4SECTOR_ERASE:
+        if (!sim->wel) {
+            sim_warn(sim, "erase without write enable ignored", opcode, addr);
+            break;
+        }
+        if (opcode == SPIFLASH_SUBSECTOR_ERASE ||
+            opcode == SPIFLASH_SUBSECTOR_4ERASE) {
+            sim_flash_erase(sim, addr, sim->cfg.subsector_size);
+            busy_us = sim->cfg.subsector_erase_us;
+        } else {
+            sim_flash_erase(sim, addr, sim->cfg.sector_size);
+            busy_us = sim->cfg.sector_erase_us;
+        }
+        sim->wel = false;
+        break;
+    case SPIFLASH_BULK_ERASE:
+    case SPIFLASH_BULK_ERASE_1:
+        if (!sim->wel) {
+            sim_warn(sim, "erase without write enable ignored", opcode, addr);
+            break;
+        }
+        sim_flash_erase(sim, 0, sim->cfg.capacity);
+        busy_us = sim->cfg.bulk_erase_us;
+        sim->wel = false;
+        break;
+    default:
+        sim_warn(sim, "unsupported opcode ignored", opcode, addr);
+        break;
+    }
+
+xfer:
+    sim->wfifo_len = 0;
+
+    /* opcode, address, a dummy byte and the data, a bit per clock */
+    wire_bytes = 1 + addr_len + ((ctrl & SIM_CTRL_USE_DUMMY) ? 1 : 0) + len;
+    sim->xfer_end_ns = now;
+    if (sim->cfg.spi_khz) {
+        sim->xfer_end_ns += wire_bytes * 8 * 1000000ULL / sim->cfg.spi_khz;
+    }
+    if (busy_us) {
+        sim->wip_end_ns = sim->xfer_end_ns + busy_us * 1000;
+    }
+    sim->done = true;
+}
+
+void
+sjtag_sim_reg_write(sjtag_sim_t *sim, uint32_t offset, uint32_t value)
+{
+    if (offset + sizeof(uint32_t) > sim->regs_size) {
+        return;
+    }
+    switch (offset) {
+    case SIM_REG(fpga_spi_status):
+        /* Done is write 1 to clear */
+        if (value & SIM_STATUS_DONE) {
+            sim->done = false;
+        }
+        break;
+    case SIM_REG(fpga_spi_data):
+        sjtag_sim_fifo_write(sim, &value, 1);
+        break;
+    case SIM_REG(fpga_spi_control):
+        if (value & SIM_CTRL_CPUWR) {
+            sim_execute(sim, value);
+            value &= ~SIM_CTRL_CPUWR;
+        }
+        sim->regs[offset / 4] = value;
+        break;
+    default:
+        sim->regs[offset / 4] = value;
+        break;
+    }
+}
+
+uint32_t
+sjtag_sim_reg_read(sjtag_sim_t *sim, uint32_t offset)
+{
+    uint32_t value;
+
+    if (offset + sizeof(uint32_t) > sim->regs_size) {
+        return 0xFFFFFFFF;
+    }
+    switch (offset) {
+    case SIM_REG(fpga_spi_status):
+        if (sim_now_ns() < sim->xfer_end_ns) {
+            return SIM_STATUS_BUSY;
+        }
+        return sim->done ? SIM_STATUS_DONE : 0;
+    case SIM_REG(fpga_spi_data):
+        sjtag_sim_fifo_read(sim, &value, 1);
+        return value;
+    default:
+        return sim->regs[offset / 4];
+    }
+}
+
+void
+sjtag_sim_fifo_write(sjtag_sim_t *sim, const uint32_t *data, uint32_t count)
+{
+    if (count > SIM_FIFO_DWORDS - sim->wfifo_len) {
+        sim_warn(sim, "wfifo overflow", 0, 0);
+        count = SIM_FIFO_DWORDS - sim->wfifo_len;
+    }
+    memcpy(sim->wfifo + sim->wfifo_len, data, count * sizeof(*data));
+    sim->wfifo_len += count;
+}
+
+void
+sjtag_sim_fifo_read(sjtag_sim_t *sim, uint32_t *data, uint32_t count)
+{
+    uint32_t avail = sim->rfifo_len - sim->rfifo_pos;
+    uint32_t n = count < avail ? count : avail;
+
+    memcpy(data, sim->rfifo + sim->rfifo_pos, n * sizeof(*data));
+    sim->rfifo_pos += n;
+    if (n < count) {
+        memset(data + n, 0, (count - n) * sizeof(*data));
+    }
+}
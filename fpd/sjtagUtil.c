@@ -1,9 +1,17 @@
 #include "iofpga_sjtag_fpd.h"
 #include "spiflash_util.h"
+#include "sjtagSim.h"
+#include "fpdJournal.h"
 #include <errno.h>
 #include <stddef.h>
 #include <sys/mman.h>
 #include <dlfcn.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <openssl/evp.h>
+#include <zlib.h>
 
 #define DEVMEM "/dev/mem"
 #define SJTAG_BLOCK_OFFSET 0x0 //0x62000
@@ -102,10 +110,15 @@
 #define SLPC_MEMORY_OFFSET          0x40100
 #define PINPOINTER_SPI_BLOCK_ADDR   0x32000
 
-int fd;
-spi_cfi_t cfi; // spi config
+/*
+ * The SPI configuration lives inside the context of its block, so helpers
+ * that are handed the cfi can find the registers it belongs to.
+ */
+#define sjtag_cfi_ctx(cfi) \
+  ((sjtag_ctx_t *)((char *)(cfi) - offsetof(sjtag_ctx_t, cfi)))
 
-static uint8_t sjtag_read_fifo(uint8_t *data, uint16_t data_len, char *err_msg,
+static uint8_t sjtag_read_fifo(sjtag_ctx_t *ctx, uint8_t *data,
+                               uint16_t data_len, char *err_msg,
                                uint32_t msg_size);
 void sjtag_dump_data(char *client, uint32_t addr, uint8_t *data, int32_t len);
 uint8_t sjtag_wait_till_wip(spi_cfi_t *cfi, uint8_t delay_factor, char *err_msg,
@@ -113,7 +126,9 @@ uint8_t sjtag_wait_till_wip(spi_cfi_t *cfi, uint8_t delay_factor, char *err_msg,
 void sjtag_segment_range(uint32_t target_addr, uint32_t target_len,
                          uint32_t seg_size, uint32_t *start_seg,
                          uint32_t *end_seg);
-void* map_base = NULL;
+int iofpga_get_spi_cfg(sjtag_ctx_t *ctx);
+static pthread_mutex_t sjtag_ctxs_lock = PTHREAD_MUTEX_INITIALIZER;
+static sjtag_ctx_t sjtag_ctxs[SJTAG_MAX_CTXS];
 
 spiflash_cfg_t spiflash_models_cfg[SPIFLASH_MODEL_MAX] = {
     /* SPIFLASH_MODEL_UNKNOWN */
@@ -518,6 +533,71 @@ static inline char *spiflash_oper_str(spiflash_oper_t oper) {
   }
 }
 
+/*
+ * Maps a 3 byte address memory opcode to its native 4 byte address
+ * equivalent. Opcodes without one are returned unchanged.
+ */
+static uint8_t spiflash_4byte_opcode(uint8_t opcode) {
+  switch (opcode) {
+  case SPIFLASH_READ:
+    return SPIFLASH_4READ;
+  case SPIFLASH_FAST_READ:
+    return SPIFLASH_4FAST_READ;
+  case SPIFLASH_QUAD_OUTPUT_FAST_READ:
+    return SPIFLASH_4QUAD_OUTPUT_FAST_READ;
+  case SPIFLASH_PAGE_PROGRAM:
+    return SPIFLASH_EXTENDED_QUAD_INPUT_FAST_PROGRAM_2;
+  case SPIFLASH_QUAD_INPUT_FAST_PROGRAM:
+    return SPIFLASH_4QUAD_INPUT_FAST_PROGRAM;
+  case SPIFLASH_SECTOR_ERASE:
+    return SPIFLASH_4SECTOR_ERASE;
+  case SPIFLASH_SUBSECTOR_ERASE:
+    return SPIFLASH_SUBSECTOR_4ERASE;
+  default:
+    return opcode;
+  }
+}
+
+/*
+ * Returns true if opcode always carries a 4 byte address, whatever the
+ * addressing mode of the flash.
+ */
+static bool spiflash_opcode_is_4byte(uint8_t opcode) {
+  switch (opcode) {
+  case SPIFLASH_4READ:
+  case SPIFLASH_4FAST_READ:
+  case SPIFLASH_4QUAD_OUTPUT_FAST_READ:
+  case SPIFLASH_EXTENDED_QUAD_INPUT_FAST_PROGRAM_2:
+  case SPIFLASH_4QUAD_INPUT_FAST_PROGRAM:
+  case SPIFLASH_4SECTOR_ERASE:
+  case SPIFLASH_SUBSECTOR_4ERASE:
+    return true;
+  default:
+    return false;
+  }
+}
+
+/*
+ * Returns true if the flash is driven with native 4 byte address opcodes.
+ * A part configured with force_3byte keeps 3 byte addresses and the bank
+ * register even though it has a 4 byte mode.
+ */
+static bool spiflash_native_4byte(const spi_cfi_t *cfi) {
+  return cfi->mode == FPGALIB_SPI_MODE_4BYTE_ADDRESS_SET && !cfi->force_3byte;
+}
+
+/*
+ * Default memory opcode for the flash: the native 4 byte address form
+ * when the flash is driven that way, so that no bank switching is
+ * needed, otherwise the configured one.
+ */
+static uint8_t spiflash_mem_opcode(spi_cfi_t *cfi, uint8_t opcode) {
+  if (spiflash_native_4byte(cfi)) {
+    return spiflash_4byte_opcode(opcode);
+  }
+  return opcode;
+}
+
 /*
  * Prepares SPI FPGA block command for a given oper SPI Flash operation.
  * Known opcodes will be used if user doesn't provide opcode in the command
@@ -575,7 +655,7 @@ uint8_t spiflash_prepare_spi_command(spi_cfi_t *cfi, spiflash_oper_t oper,
   case SPIFLASH_OPER_READ_MEM:
 
     if (!cmd->opcode) {
-      cmd->opcode = cfi->read;
+      cmd->opcode = spiflash_mem_opcode(cfi, cfi->read);
     }
 
     switch (cmd->opcode) {
@@ -608,9 +688,22 @@ uint8_t spiflash_prepare_spi_command(spi_cfi_t *cfi, spiflash_oper_t oper,
 
       break;
 
-    case SPIFLASH_4FAST_READ:
     case SPIFLASH_4READ:
 
+      cmd->go_rd = 1;
+      cmd->go_wr = 0;
+      cmd->wr_ena = 0;
+      cmd->addr_width = 1;
+      cmd->data_width = 1;
+      cmd->dummy_len = 0;
+      cmd->addr_len = 4;
+      cmd->inst_len = 1;
+      cmd->mode_len = 0;
+
+      break;
+
+    case SPIFLASH_4FAST_READ:
+
       cmd->go_rd = 1;
       cmd->go_wr = 0;
       cmd->wr_ena = 0;
@@ -675,7 +768,7 @@ uint8_t spiflash_prepare_spi_command(spi_cfi_t *cfi, spiflash_oper_t oper,
   case SPIFLASH_OPER_PROGRAM_MEM:
 
     if (!cmd->opcode) {
-      cmd->opcode = cfi->program;
+      cmd->opcode = spiflash_mem_opcode(cfi, cfi->program);
     }
 
     switch (cmd->opcode) {
@@ -746,7 +839,7 @@ uint8_t spiflash_prepare_spi_command(spi_cfi_t *cfi, spiflash_oper_t oper,
   case SPIFLASH_OPER_ERASE_MEM:
 
     if (!cmd->opcode) {
-      cmd->opcode = cfi->erase;
+      cmd->opcode = spiflash_mem_opcode(cfi, cfi->erase);
     }
 
     switch (cmd->opcode) {
@@ -937,9 +1030,10 @@ uint8_t spiflash_prepare_spi_command(spi_cfi_t *cfi, spiflash_oper_t oper,
 
   /*
    * Check if config table has force 3 byte mode. Overwrite if force
-   * 3 byte enabled
+   * 3 byte enabled, unless the opcode itself takes a 4 byte address
    */
-  if ((cfi->force_3byte) && (cmd->addr_len == 4)) {
+  if ((cfi->force_3byte) && (cmd->addr_len == 4) &&
+      !spiflash_opcode_is_4byte(cmd->opcode)) {
     cmd->addr_len = 3;
   }
 
@@ -966,28 +1060,107 @@ char *spi_mode_str(fpgalib_spi_mode_en mode) {
   }
 }
 
-void pci_util_write(uint32_t target, uint32_t data) {
+void pci_util_write(sjtag_ctx_t *ctx, uint32_t target, uint32_t data) {
   void *virt_addr;
 
-  if (map_base) {
-    virt_addr = map_base + target;
+  if (ctx->sim) {
+    sjtag_sim_reg_write(ctx->sim, target, data);
+  } else if (ctx->map_base) {
+    virt_addr = ctx->map_base + target;
 
-    *((uint32_t *)virt_addr) = data;
+    *((volatile uint32_t *)virt_addr) = data;
   }
 }
 
-void pci_util_read(uint32_t target, uint32_t *data) {
+void pci_util_read(sjtag_ctx_t *ctx, uint32_t target, uint32_t *data) {
   void *virt_addr;
 
-  if (map_base) {
-    virt_addr = map_base + target;
-    *data = *((uint32_t *)virt_addr);
+  if (ctx->sim) {
+    *data = sjtag_sim_reg_read(ctx->sim, target);
+  } else if (ctx->map_base) {
+    virt_addr = ctx->map_base + target;
+    *data = *((volatile uint32_t *)virt_addr);
+  }
+}
+
+#ifdef UIO_SUPPORTED
+/*
+ * Open the interrupt of a UIO device and unmask it
+ */
+static int sjtag_uio_open(int uio_num) {
+  char path[32];
+  int32_t enable = 1;
+  int ufd;
+
+  snprintf(path, sizeof(path), "/dev/uio%d", uio_num);
+  ufd = open(path, O_RDWR | O_CLOEXEC);
+  if (ufd < 0) {
+    return -1;
+  }
+  if (write(ufd, &enable, sizeof(enable)) != sizeof(enable)) {
+    close(ufd);
+    return -1;
   }
+  return ufd;
+}
+#endif //UIO_SUPPORTED
+
+/*
+ * Back the block with the software model of sjtagSim.c, set up from the
+ * SJTAG_SIM_ENV settings. Flash geometry and JEDEC ID come from the
+ * selected entry of the flash model table unless overridden.
+ */
+static void *
+sjtag_sim_map_block(sjtag_ctx_t *ctx, const char *block_name)
+{
+    const char *spec = getenv(SJTAG_SIM_ENV);
+    const spiflash_cfg_t *model;
+    sjtag_sim_cfg_t sim_cfg;
+
+    if (sjtag_sim_cfg_parse(&sim_cfg, spec)) {
+        fprintf(stderr, "bad %s setting '%s'\n", SJTAG_SIM_ENV, spec);
+        return NULL;
+    }
+    if (sim_cfg.model <= SPIFLASH_MODEL_UNKNOWN ||
+        sim_cfg.model >= SPIFLASH_MODEL_MAX) {
+        sim_cfg.model = SPIFLASH_MODEL_MICRON_MT25QL256ABA8ESF_0SIT;
+    }
+    model = &spiflash_models_cfg[sim_cfg.model];
+
+    sim_cfg.jedec_id[0] = model->manuf_id;
+    sim_cfg.jedec_id[1] = model->memory_type;
+    sim_cfg.jedec_id[2] = model->memory_density;
+    sim_cfg.jedec_id[3] = model->vendor_id0;
+    sim_cfg.jedec_id[4] = model->vendor_id1;
+    if (!sim_cfg.capacity) {
+        sim_cfg.capacity = model->capacity;
+    }
+    if (!sim_cfg.page_size) {
+        sim_cfg.page_size = model->page_size;
+    }
+    if (!sim_cfg.sector_size) {
+        sim_cfg.sector_size = model->sector[0].size;
+    }
+
+    ctx->sim = sjtag_sim_create(&sim_cfg, block_name);
+    if (!ctx->sim) {
+        fprintf(stderr, "failed to simulate block %s (%s)\n", block_name,
+                strerror(errno));
+        return NULL;
+    }
+    fprintf(stderr, "block %s is simulated: %s\n", block_name,
+            model->vendor_name);
+    ctx->map_base = sjtag_sim_regs(ctx->sim);
+    return ctx->map_base;
 }
 
-void *
-mmap_sjtag_block(const char *block_name)
+static void *
+mmap_sjtag_block(sjtag_ctx_t *ctx, const char *block_name)
 {
+    ctx->uio_fd = -1;
+    if (getenv(SJTAG_SIM_ENV)) {
+        return sjtag_sim_map_block(ctx, block_name);
+    }
     if (!strncmp(block_name, "IOFP-JTAG", 9) ||
         !strncmp(block_name, "IOFP-SPI0", 9)) {
 
@@ -1000,29 +1173,93 @@ mmap_sjtag_block(const char *block_name)
             return NULL;
         }
 
-        map_base = uio_mmap(device_info, 0);
-        if (!map_base) {
+        ctx->map_base = uio_mmap(device_info, 0);
+        if (!ctx->map_base) {
             fprintf(stderr, "uio mmap failed. block_name: %s\n", block_name);
             return NULL;
         }
+        ctx->uio_fd = sjtag_uio_open(device_info->uio_num);
 #else
 	return NULL;
 #endif //UIO_SUPPORTED
     } else {
         // PINPOINTER
         int pim = atoi(block_name);
-        map_base = get_pinpointer_block_virtual_addr(pim, PINPOINTER_SPI_BLOCK_ADDR);
-        if (!map_base) {
+        ctx->map_base = get_pinpointer_block_virtual_addr(pim, PINPOINTER_SPI_BLOCK_ADDR,
+                                                          sizeof(fpgalib_sjtag_regs_t));
+        if (!ctx->map_base) {
             fprintf(stderr, "PIM mmap failed. PIM: %d\n", pim);
             return NULL;
         }
     }
-    return map_base;
+    return ctx->map_base;
+}
+
+sjtag_ctx_t *
+sjtag_ctx_open(const char *block_name)
+{
+    sjtag_ctx_t *ctx = NULL;
+    int i;
+
+    pthread_mutex_lock(&sjtag_ctxs_lock);
+    for (i = 0; i < SJTAG_MAX_CTXS; i++) {
+        if (!sjtag_ctxs[i].map_base) {
+            if (!ctx) {
+                ctx = &sjtag_ctxs[i];
+            }
+            continue;
+        }
+        if (!strncmp(sjtag_ctxs[i].block_name, block_name,
+                     SJTAG_BLOCK_NAME_LEN)) {
+            pthread_mutex_unlock(&sjtag_ctxs_lock);
+            return &sjtag_ctxs[i];
+        }
+    }
+    if (!ctx) {
+        pthread_mutex_unlock(&sjtag_ctxs_lock);
+        fprintf(stderr, "no free sjtag context for block %s\n", block_name);
+        return NULL;
+    }
+
+    memset(ctx, 0, sizeof(*ctx));
+    if (!mmap_sjtag_block(ctx, block_name)) {
+        ctx->map_base = NULL;
+        pthread_mutex_unlock(&sjtag_ctxs_lock);
+        return NULL;
+    }
+    snprintf(ctx->block_name, SJTAG_BLOCK_NAME_LEN, "%s", block_name);
+    pthread_mutex_init(&ctx->lock, NULL);
+    ctx->cfi_valid = false;
+    ctx->bank_addr = -1;
+    pthread_mutex_unlock(&sjtag_ctxs_lock);
+    return ctx;
+}
+
+int
+sjtag_ctx_spi_cfg(sjtag_ctx_t *ctx)
+{
+    int rc;
+
+    if (!ctx->cfi_valid) {
+        /*
+         * Configuring the flash may leave its bank register anywhere.
+         * From then on only this context moves it, under ctx->lock, so
+         * the cached value holds across operations.
+         */
+        ctx->bank_addr = -1;
+        rc = iofpga_get_spi_cfg(ctx);
+        if (rc) {
+            return rc;
+        }
+        ctx->cfi_valid = true;
+    }
+    return 0;
 }
 
-uint8_t iofpga_reg_read_access(char *client, uint32_t offset, uint32_t *data,
-                               char *err_msg, uint32_t msg_size) {
-  pci_util_read(PCI_ADDRESS + offset, data);
+uint8_t iofpga_reg_read_access(sjtag_ctx_t *ctx, char *client, uint32_t offset,
+                               uint32_t *data, char *err_msg,
+                               uint32_t msg_size) {
+  pci_util_read(ctx, PCI_ADDRESS + offset, data);
   FPRINTF(stderr, "     %s: reg read access: offset 0x%x "
           "err_msg(%s) msg_size(%d)\n", 
           client, offset, err_msg, msg_size);
@@ -1034,17 +1271,16 @@ int is_golden_booted(const char *block_name) {
     int result = 0;
     uint32_t data = 0;
     uint32_t target = 0x24; // fpga_stat
-    void *map_base = NULL;
     uint32_t *virt_addr;
 
-    map_base = mmap_sjtag_block(block_name);
-    if (!map_base) {
+    sjtag_ctx_t *ctx = sjtag_ctx_open(block_name);
+    if (!ctx) {
         fprintf(stderr, "failed to mmap block %s\n", block_name);
         return -1;
     }
 
     // Read x86 Status Register
-    virt_addr = map_base + target;
+    virt_addr = ctx->map_base + target;
     data = *virt_addr;
     
     if (!strncmp(block_name, "IOFP-JTAG", 9)) {
@@ -1057,16 +1293,17 @@ int is_golden_booted(const char *block_name) {
     return result; 
 }
 
-uint8_t iofpga_reg_write_access(char *client, uint32_t offset, uint32_t data,
+uint8_t iofpga_reg_write_access(sjtag_ctx_t *ctx, char *client,
+                                uint32_t offset, uint32_t data,
                                 char *err_msg, uint32_t msg_size) {
-  pci_util_write(PCI_ADDRESS + offset, data);
+  pci_util_write(ctx, PCI_ADDRESS + offset, data);
   FPRINTF(stderr, "     %s: reg write access: offset 0x%x "
           "err_msg(%s) msg_size(%d)\n", 
           client, offset, err_msg, msg_size);
   return 0;
 }
 
-uint8_t sjtag_controller_spi_reg_dump() {
+uint8_t sjtag_controller_spi_reg_dump(sjtag_ctx_t *ctx) {
   uint32_t ctrl_reg = 0;
   uint32_t status_reg = 0;
   uint32_t rdsize_reg = 0;
@@ -1080,7 +1317,7 @@ uint8_t sjtag_controller_spi_reg_dump() {
   ctrl_reg = SJTAG_BLOCK_OFFSET + offsetof(fpgalib_sjtag_regs_t, cfgspi_reg) +
              offsetof(fpgalib_sjtag_cfgspi_reg_t, fpga_spi_control);
   value = 0;
-  rc = iofpga_reg_read_access("read sjtag ctrl reg", ctrl_reg, &value, err_msg,
+  rc = iofpga_reg_read_access(ctx, "read sjtag ctrl reg", ctrl_reg, &value, err_msg,
                               msg_size);
   FPRINTF(stderr, "\nctrl reg dump dbg 0x%x: 0x%08x \n", ctrl_reg, value);
 
@@ -1088,21 +1325,21 @@ uint8_t sjtag_controller_spi_reg_dump() {
                offsetof(fpgalib_sjtag_cfgspi_reg_t, fpga_spi_status);
 
   value = 0;
-  rc = iofpga_reg_read_access("read sjtag status reg", status_reg, &value,
+  rc = iofpga_reg_read_access(ctx, "read sjtag status reg", status_reg, &value,
                               err_msg, msg_size);
   FPRINTF(stderr, "\nstatus reg dump dbg 0x%x: 0x%08x \n", status_reg, value);
 
   rdsize_reg = SJTAG_BLOCK_OFFSET + offsetof(fpgalib_sjtag_regs_t, cfgspi_reg) +
                offsetof(fpgalib_sjtag_cfgspi_reg_t, fpga_spi_rdsize);
   value = 0;
-  rc = iofpga_reg_read_access("read sjtag rdsize reg dump", rdsize_reg, &value,
+  rc = iofpga_reg_read_access(ctx, "read sjtag rdsize reg dump", rdsize_reg, &value,
                               err_msg, msg_size);
   FPRINTF(stderr, "\nrd siz reg dbg 0x%x: 0x%08x \n", rdsize_reg, value);
 
   data_reg = SJTAG_BLOCK_OFFSET + offsetof(fpgalib_sjtag_regs_t, cfgspi_reg) +
              offsetof(fpgalib_sjtag_cfgspi_reg_t, fpga_spi_data);
   value = 0;
-  rc = iofpga_reg_read_access("read sjtag data reg dump", data_reg, &value,
+  rc = iofpga_reg_read_access(ctx, "read sjtag data reg dump", data_reg, &value,
                               err_msg, msg_size);
   FPRINTF(stderr, "\ndata reg dbg   0x%x: 0x%08x \n", data_reg, value);
 
@@ -1110,15 +1347,16 @@ uint8_t sjtag_controller_spi_reg_dump() {
                 offsetof(fpgalib_sjtag_regs_t, cfgspi_reg) +
                 offsetof(fpgalib_sjtag_cfgspi_reg_t, fpga_spi_addr_op);
   value = 0;
-  rc = iofpga_reg_read_access("read sjtag data reg dump", addr_op_reg, &value,
+  rc = iofpga_reg_read_access(ctx, "read sjtag data reg dump", addr_op_reg, &value,
                               err_msg, msg_size);
   FPRINTF(stderr, "\naddr_op dbg    0x%x: 0x%08x \n", addr_op_reg, value);
 
   return rc;
 }
 
-static uint8_t sjtag_op_addr_reg_set(uint8_t opcode, uint32_t addr,
-                                     char *err_msg, uint32_t msg_size) {
+static uint8_t sjtag_op_addr_reg_set(sjtag_ctx_t *ctx, uint8_t opcode,
+                                     uint32_t addr, char *err_msg,
+                                     uint32_t msg_size) {
   int rc = 0;
   uint32_t msb_addr = 0;
   uint32_t ls3b_addr = 0;
@@ -1140,7 +1378,7 @@ static uint8_t sjtag_op_addr_reg_set(uint8_t opcode, uint32_t addr,
   /*
    * Write LSB address and OPCODE
    */
-  rc = iofpga_reg_write_access("write sjtag addr opcode reg", opcode_reg,
+  rc = iofpga_reg_write_access(ctx, "write sjtag addr opcode reg", opcode_reg,
                                addr_op, err_msg, msg_size);
   if (rc) {
     FPRINTF(stderr, "opcode addr reg write failed rc %d\n", rc);
@@ -1153,7 +1391,7 @@ static uint8_t sjtag_op_addr_reg_set(uint8_t opcode, uint32_t addr,
   /*
    * Read SPI Controller Instruction register
    */
-  rc = iofpga_reg_read_access("read sjtag ctrl reg", ctrl_reg, &spi_ctl,
+  rc = iofpga_reg_read_access(ctx, "read sjtag ctrl reg", ctrl_reg, &spi_ctl,
                               err_msg, msg_size);
   if (rc) {
     FPRINTF(stderr, "ctrl reg write failed rc %d\n", rc);
@@ -1166,7 +1404,7 @@ static uint8_t sjtag_op_addr_reg_set(uint8_t opcode, uint32_t addr,
   /*
    * Write SPI Controller Instruction register for MSB addr
    */
-  rc = iofpga_reg_write_access("write sjtag ctrl reg for MSB addr", ctrl_reg,
+  rc = iofpga_reg_write_access(ctx, "write sjtag ctrl reg for MSB addr", ctrl_reg,
                                spi_ctl, err_msg, msg_size);
   if (rc) {
     FPRINTF(stderr, "ctrl reg write failed rc %d\n", rc);
@@ -1178,13 +1416,124 @@ static uint8_t sjtag_op_addr_reg_set(uint8_t opcode, uint32_t addr,
   return 0;
 }
 
-static uint8_t sjtag_controller_check_for_ready(uint8_t delay_factor,
+static uint64_t sjtag_now_nsec(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t sjtag_now_usec(void) {
+  return sjtag_now_nsec() / 1000;
+}
+
+/*
+ * Adaptive polling. Every kind of wait on a block keeps a running average
+ * of how long it takes to complete. A wait first re-checks back to back for
+ * about twice that average, so short transactions finish without paying a
+ * sleep quantum, then sleeps with exponential backoff up to max_sleep_us so
+ * that long ones (sector erase) don't burn a CPU.
+ */
+#define SJTAG_SPIN_MIN_NS 2000
+#define SJTAG_SPIN_MAX_NS 200000
+
+typedef struct sjtag_waiter_ {
+  uint64_t *avg_ns;
+  uint64_t start_ns;
+  uint64_t spin_ns;
+  uint32_t sleep_us;
+  uint32_t max_sleep_us;
+} sjtag_waiter_t;
+
+static void sjtag_wait_begin(sjtag_ctx_t *ctx, sjtag_waiter_t *w,
+                             sjtag_wait_kind_t kind, uint32_t max_sleep_us) {
+  w->avg_ns = &ctx->wait_avg_ns[kind];
+  w->start_ns = sjtag_now_nsec();
+  w->spin_ns = 2 * *w->avg_ns;
+  if (w->spin_ns < SJTAG_SPIN_MIN_NS) {
+    w->spin_ns = SJTAG_SPIN_MIN_NS;
+  } else if (w->spin_ns > SJTAG_SPIN_MAX_NS) {
+    w->spin_ns = SJTAG_SPIN_MAX_NS;
+  }
+  w->sleep_us = 1;
+  w->max_sleep_us = max_sleep_us ? max_sleep_us : 1;
+}
+
+/*
+ * Record the latency of a completed wait
+ */
+static void sjtag_wait_done(sjtag_waiter_t *w) {
+  uint64_t elapsed = sjtag_now_nsec() - w->start_ns;
+  uint64_t *avg = w->avg_ns;
+
+  *avg = *avg ? (*avg * 7 + elapsed) / 8 : elapsed;
+}
+
+/*
+ * Pause before the next check of a wait that has not completed yet.
+ * Returns ETIMEDOUT once the wait has run for longer than timeout_us.
+ */
+static uint8_t sjtag_wait_next(sjtag_waiter_t *w, uint64_t timeout_us) {
+  uint64_t elapsed = sjtag_now_nsec() - w->start_ns;
+
+  if (elapsed > timeout_us * 1000) {
+    return ETIMEDOUT;
+  }
+  if (elapsed < w->spin_ns) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+    return 0;
+  }
+  usleep(w->sleep_us);
+  w->sleep_us *= 2;
+  if (w->sleep_us > w->max_sleep_us) {
+    w->sleep_us = w->max_sleep_us;
+  }
+  return 0;
+}
+
+/*
+ * UIO interrupt of the SJTAG block. The controller raises it when a
+ * transaction completes; uio re-masks it after each event until 1 is
+ * written back to the device. Blocks without a working interrupt line are
+ * detected after a few silent waits and fall back to polling.
+ */
+#define SJTAG_UIO_MAX_MISSES 3
+
+/*
+ * Wait up to timeout_us for the interrupt of the block.
+ * Returns 1 if it fired, 0 if the caller has to poll.
+ */
+static int sjtag_uio_wait(sjtag_ctx_t *ctx, uint32_t timeout_us) {
+  struct pollfd pfd = { .fd = ctx->uio_fd, .events = POLLIN };
+  int32_t enable = 1;
+  uint32_t events;
+
+  if (ctx->uio_fd < 0 || ctx->uio_misses >= SJTAG_UIO_MAX_MISSES) {
+    return 0;
+  }
+  if (poll(&pfd, 1, (timeout_us + 999) / 1000) == 1 &&
+      read(ctx->uio_fd, &events, sizeof(events)) == sizeof(events) &&
+      write(ctx->uio_fd, &enable, sizeof(enable)) == sizeof(enable)) {
+    ctx->uio_misses = 0;
+    return 1;
+  }
+  if (++ctx->uio_misses == SJTAG_UIO_MAX_MISSES) {
+    fprintf(stderr, "no SJTAG interrupt seen on %s, polling for completion\n",
+            ctx->block_name);
+  }
+  return 0;
+}
+
+static uint8_t sjtag_controller_check_for_ready(sjtag_ctx_t *ctx,
+                                                uint8_t delay_factor,
                                                 char *err_msg,
                                                 uint32_t msg_size) {
   uint8_t rc = 0;
   uint32_t value = 0;
-  int count = 0;
   uint32_t status_reg = 0;
+  sjtag_waiter_t w;
 
   FPRINTF(stderr, "sjtag_controller_check_for_ready start\n");
   status_reg = SJTAG_BLOCK_OFFSET + offsetof(fpgalib_sjtag_regs_t, cfgspi_reg) +
@@ -1194,31 +1543,31 @@ static uint8_t sjtag_controller_check_for_ready(uint8_t delay_factor,
    * Bit14: Busy : SPI Core is currently performing an operation
    *               if set to 1. Wait till it gets cleared
    */
-  do {
-    rc = iofpga_reg_read_access("read sjtag status reg", status_reg, &value,
+  sjtag_wait_begin(ctx, &w, SJTAG_WAIT_TRANS, 100 * delay_factor);
+  for (;;) {
+    rc = iofpga_reg_read_access(ctx, "read sjtag status reg", status_reg, &value,
                                 err_msg, msg_size);
 
     if (rc) {
       FPRINTF(stderr, "status reg read failed rc %d\n", rc);
       return rc;
     }
-
-    count++;
-    usleep(100 * delay_factor);
-
-    if (count > IOFPGA_SJTAG_TRANS_TIMEOUT) {
-      break;
-    }
     FPRINTF(stderr, "read val: %d\n",
             (SJ_SPI_CSRS__FPGA_SPI_STATUS_REG__BUSY__READ(value)));
-  } while (SJ_SPI_CSRS__FPGA_SPI_STATUS_REG__BUSY__READ(value));
+    if (!SJ_SPI_CSRS__FPGA_SPI_STATUS_REG__BUSY__READ(value)) {
+      break;
+    }
+    if (sjtag_wait_next(&w, IOFPGA_SJTAG_TRANS_TIMEOUT * 100)) {
+      break;
+    }
+  }
 
   value = 0;
   /*
    * Bit15: Done : Last Operation is completed if set to 1.
    *               Write 1 to clear it before starting next operation
    */
-  rc = iofpga_reg_read_access("read sjtag status reg", status_reg, &value,
+  rc = iofpga_reg_read_access(ctx, "read sjtag status reg", status_reg, &value,
                               err_msg, msg_size);
 
   if (rc) {
@@ -1227,7 +1576,7 @@ static uint8_t sjtag_controller_check_for_ready(uint8_t delay_factor,
   }
 
   if (SJ_SPI_CSRS__FPGA_SPI_STATUS_REG__DONE__READ(value)) {
-    rc = iofpga_reg_write_access("write sjtag status reg", status_reg, value,
+    rc = iofpga_reg_write_access(ctx, "write sjtag status reg", status_reg, value,
                                  err_msg, msg_size);
     if (rc) {
       FPRINTF(stderr, "status reg write failed rc %d\n", rc);
@@ -1253,13 +1602,15 @@ static uint8_t sjtag_controller_check_for_ready(uint8_t delay_factor,
  *         Otherwise:
  *            Error code with message
  */
-static uint8_t sjtag_wait_until_transaction_complete(uint8_t delay_factor,
+static uint8_t sjtag_wait_until_transaction_complete(sjtag_ctx_t *ctx,
+                                                     uint8_t delay_factor,
                                                      char *err_msg,
                                                      uint32_t msg_size) {
   uint8_t rc = 0;
   uint32_t value = 0;
-  int count = 0;
   uint32_t status_reg = 0;
+  sjtag_waiter_t w;
+  int irq_tried = 0;
 
   FPRINTF(stderr, "sjtag_wait_until_transaction_complete start %d\n", delay_factor);
   status_reg = SJTAG_BLOCK_OFFSET + offsetof(fpgalib_sjtag_regs_t, cfgspi_reg) +
@@ -1267,32 +1618,40 @@ static uint8_t sjtag_wait_until_transaction_complete(uint8_t delay_factor,
 
   /*
    * Bit14: Busy : SPI Core is currently performing an operation
-   *               if set to 1. Wait till it gets cleared
+   *               if set to 1. Wait till it gets cleared. Sleep on the
+   *               block interrupt if there is one, the status register
+   *               stays authoritative either way.
    */
-  do {
-    rc = iofpga_reg_read_access("read sjtag status reg", status_reg, &value,
+  sjtag_wait_begin(ctx, &w, SJTAG_WAIT_TRANS, 100 * delay_factor);
+  for (;;) {
+    rc = iofpga_reg_read_access(ctx, "read sjtag status reg", status_reg, &value,
                                 err_msg, msg_size);
     if (rc) {
       FPRINTF(stderr, "status reg read failed rc %d\n", rc);
       return rc;
     }
-
-    count++;
-    usleep(1);
-
-    if (count > IOFPGA_SJTAG_TRANS_TIMEOUT) {
+    if (!SJ_SPI_CSRS__FPGA_SPI_STATUS_REG__BUSY__READ(value)) {
+      sjtag_wait_done(&w);
+      break;
+    }
+    if (!irq_tried) {
+      irq_tried = 1;
+      if (sjtag_uio_wait(ctx, IOFPGA_SJTAG_TRANS_TIMEOUT * 10)) {
+        continue;
+      }
+    }
+    if (sjtag_wait_next(&w, IOFPGA_SJTAG_TRANS_TIMEOUT * 100)) {
       break;
     }
-  } while (SJ_SPI_CSRS__FPGA_SPI_STATUS_REG__BUSY__READ(value));
+  }
 
   value = 0;
-  count = 0;
 
   /*
    * Bit15: Done : Last Operation is completed if set to 1.
    *               Write 1 to clear it before starting next operation
    */
-  rc = iofpga_reg_read_access("read sjtag status reg", status_reg, &value,
+  rc = iofpga_reg_read_access(ctx, "read sjtag status reg", status_reg, &value,
                               err_msg, msg_size);
 
   if (rc) {
@@ -1305,21 +1664,18 @@ static uint8_t sjtag_wait_until_transaction_complete(uint8_t delay_factor,
    *               Ensure Operation is done
    */
   FPRINTF(stderr, "Ensure bit set to 1\n");
+  sjtag_wait_begin(ctx, &w, SJTAG_WAIT_TRANS, 100 * delay_factor);
   while (!(SJ_SPI_CSRS__FPGA_SPI_STATUS_REG__DONE__READ(value))) {
-    rc = iofpga_reg_read_access("read sjtag status reg", status_reg, &value,
+    if (sjtag_wait_next(&w, IOFPGA_SJTAG_TRANS_TIMEOUT * 100)) {
+      break;
+    }
+    rc = iofpga_reg_read_access(ctx, "read sjtag status reg", status_reg, &value,
                                 err_msg, msg_size);
 
     if (rc) {
       FPRINTF(stderr, "status reg read failed rc %d\n", rc);
       return rc;
     }
-
-    count++;
-    usleep(1);
-
-    if (count > IOFPGA_SJTAG_TRANS_TIMEOUT) {
-      break;
-    }
   }
 
   FPRINTF(stderr, "sjtag_wait_until_transaction_complete end\n");
@@ -1335,6 +1691,7 @@ static uint8_t sjtag_wait_until_transaction_complete(uint8_t delay_factor,
 static uint8_t sjtag_ctl_reg_set(spi_cfi_t *cfi, fpgalib_spi_cmd_t *cmd,
                                  uint16_t data_len, char *err_msg,
                                  uint32_t msg_size) {
+  sjtag_ctx_t *ctx = sjtag_cfi_ctx(cfi);
   uint8_t rc = 0;
   uint32_t data = 0;
   uint32_t rdsize_reg = 0;
@@ -1352,7 +1709,7 @@ static uint8_t sjtag_ctl_reg_set(spi_cfi_t *cfi, fpgalib_spi_cmd_t *cmd,
   /*
    * Ensure SPI Controller is Ready to initiate the Command
    */
-  rc = sjtag_controller_check_for_ready(cfi->delay_factor, err_msg, msg_size);
+  rc = sjtag_controller_check_for_ready(ctx, cfi->delay_factor, err_msg, msg_size);
 
   SJ_SPI_CSRS__FPGA_SPI_RDSIZE_REG__RDSIZE__MODIFY(data, data_len);
 
@@ -1362,7 +1719,7 @@ static uint8_t sjtag_ctl_reg_set(spi_cfi_t *cfi, fpgalib_spi_cmd_t *cmd,
   /*
    * Write Data Size value to SPI Read Size register
    */
-  rc = iofpga_reg_write_access("write sjtag rdsize reg", rdsize_reg, data,
+  rc = iofpga_reg_write_access(ctx, "write sjtag rdsize reg", rdsize_reg, data,
                                err_msg, msg_size);
   if (rc) {
     FPRINTF(stderr, "rdsize reg write failed rc %d\n", rc);
@@ -1376,7 +1733,7 @@ static uint8_t sjtag_ctl_reg_set(spi_cfi_t *cfi, fpgalib_spi_cmd_t *cmd,
   /*
    * Read SPI Controller Instruction register
    */
-  rc = iofpga_reg_read_access("read sjtag ctrl reg", ctrl_reg, &data, err_msg,
+  rc = iofpga_reg_read_access(ctx, "read sjtag ctrl reg", ctrl_reg, &data, err_msg,
                               msg_size);
 
   if (rc) {
@@ -1440,6 +1797,17 @@ static uint8_t sjtag_ctl_reg_set(spi_cfi_t *cfi, fpgalib_spi_cmd_t *cmd,
     SJ_SPI_CSRS__FPGA_SPI_CONTROL_REG__USE_ADDR__MODIFY(data, 1);
     break;
 
+  case SPIFLASH_4READ:
+  case SPIFLASH_EXTENDED_QUAD_INPUT_FAST_PROGRAM_2:
+  case SPIFLASH_4SECTOR_ERASE:
+  case SPIFLASH_SUBSECTOR_4ERASE:
+    /*
+     * Native 4 byte address opcodes: Address Size is always 4 Bytes
+     */
+    SJ_SPI_CSRS__FPGA_SPI_CONTROL_REG__ADDR_SIZE__MODIFY(data, 3);
+    SJ_SPI_CSRS__FPGA_SPI_CONTROL_REG__USE_ADDR__MODIFY(data, 1);
+    break;
+
   case SPIFLASH_WRITE_BRWR_REGISTER:
     /*
      * Disable FIFO32 bit; FIFO accessed 8-bits at a time
@@ -1460,7 +1828,7 @@ static uint8_t sjtag_ctl_reg_set(spi_cfi_t *cfi, fpgalib_spi_cmd_t *cmd,
   /*
    * Write SPI Controller Instruction register
    */
-  rc = iofpga_reg_write_access("write sjtag ctrl reg", ctrl_reg, data, err_msg,
+  rc = iofpga_reg_write_access(ctx, "write sjtag ctrl reg", ctrl_reg, data, err_msg,
                                msg_size);
   if (rc) {
     FPRINTF(stderr, "ctrl reg write failed rc %d\n", rc);
@@ -1473,13 +1841,13 @@ static uint8_t sjtag_ctl_reg_set(spi_cfi_t *cfi, fpgalib_spi_cmd_t *cmd,
   SJ_SPI_CSRS__FPGA_SPI_CONTROL_REG__CPUWR__MODIFY(data, 1);
 
 #if DEBUG
-  sjtag_controller_spi_reg_dump();
+  sjtag_controller_spi_reg_dump(ctx);
 #endif
 
   /*
    * Initiate Command for SPI transfer Write SPI Controller Instruction register
    */
-  rc = iofpga_reg_write_access("write sjtag ctrl reg for spi transfer",
+  rc = iofpga_reg_write_access(ctx, "write sjtag ctrl reg for spi transfer",
                                ctrl_reg, data, err_msg, msg_size);
   if (rc) {
     FPRINTF(stderr, "ctrl reg write failed rc %d\n", rc);
@@ -1491,7 +1859,7 @@ static uint8_t sjtag_ctl_reg_set(spi_cfi_t *cfi, fpgalib_spi_cmd_t *cmd,
   /*
    * Ensure SPI Controller has successfully completed the given Command
    */
-  rc = sjtag_wait_until_transaction_complete(cfi->spi_delay_factor, err_msg,
+  rc = sjtag_wait_until_transaction_complete(ctx, cfi->spi_delay_factor, err_msg,
                                              msg_size);
 
   if (rc != 0) {
@@ -1505,6 +1873,7 @@ static uint8_t sjtag_ctl_reg_set(spi_cfi_t *cfi, fpgalib_spi_cmd_t *cmd,
 
 uint8_t sjtag_spi_read_bank_addr(spi_cfi_t *cfi, uint8_t exp_bank_addr,
                                  char *err_msg, uint32_t msg_size) {
+  sjtag_ctx_t *ctx = sjtag_cfi_ctx(cfi);
   uint8_t rc = 0;
   fpgalib_spi_cmd_t cmd = {0};
   uint8_t bank_addr[1] = {0};
@@ -1534,7 +1903,7 @@ uint8_t sjtag_spi_read_bank_addr(spi_cfi_t *cfi, uint8_t exp_bank_addr,
   }
 
   /* Set opcode and register address */
-  rc = sjtag_op_addr_reg_set(cmd.opcode, 0, /* SPI Flash Addr */
+  rc = sjtag_op_addr_reg_set(ctx, cmd.opcode, 0, /* SPI Flash Addr */
                              err_msg, msg_size);
 
   if (rc != 0) {
@@ -1552,7 +1921,7 @@ uint8_t sjtag_spi_read_bank_addr(spi_cfi_t *cfi, uint8_t exp_bank_addr,
   }
 
   /* Check for sjtag FPGA Block transaction complete */
-  rc = sjtag_wait_until_transaction_complete(cfi->spi_delay_factor, err_msg,
+  rc = sjtag_wait_until_transaction_complete(ctx, cfi->spi_delay_factor, err_msg,
                                              msg_size);
   if (rc != 0) {
     FPRINTF(stderr, "Couldn't complete the SPI Flash transaction %s\n",
@@ -1560,7 +1929,7 @@ uint8_t sjtag_spi_read_bank_addr(spi_cfi_t *cfi, uint8_t exp_bank_addr,
     return rc;
   }
 
-  rc = sjtag_read_fifo(bank_addr, 1, /* 1 Byte read from buffer */
+  rc = sjtag_read_fifo(ctx, bank_addr, 1, /* 1 Byte read from buffer */
                        err_msg, msg_size);
   if (rc != 0) {
     FPRINTF(stderr, "Couldn't read rfifo register [%s]\n", err_msg);
@@ -1593,6 +1962,7 @@ uint8_t sjtag_spi_read_bank_addr(spi_cfi_t *cfi, uint8_t exp_bank_addr,
  */
 static uint8_t sjtag_flash_read_fsr(spi_cfi_t *cfi, uint32_t *status,
                                     char *err_msg, uint32_t msg_size) {
+  sjtag_ctx_t *ctx = sjtag_cfi_ctx(cfi);
 
   uint8_t rc = 0;
   uint8_t fsr;
@@ -1613,7 +1983,7 @@ static uint8_t sjtag_flash_read_fsr(spi_cfi_t *cfi, uint32_t *status,
   }
 
   /* Set opcode and register address */
-  rc = sjtag_op_addr_reg_set(cmd.opcode, 0, /* SPI Flash Addr */
+  rc = sjtag_op_addr_reg_set(ctx, cmd.opcode, 0, /* SPI Flash Addr */
                              err_msg, msg_size);
 
   if (rc != 0) {
@@ -1631,7 +2001,7 @@ static uint8_t sjtag_flash_read_fsr(spi_cfi_t *cfi, uint32_t *status,
   }
 
   /* Check for sjtag FPGA Block transaction complete */
-  rc = sjtag_wait_until_transaction_complete(cfi->spi_delay_factor, err_msg,
+  rc = sjtag_wait_until_transaction_complete(ctx, cfi->spi_delay_factor, err_msg,
                                              msg_size);
   if (rc != 0) {
     FPRINTF(stderr, "Couldn't complete the SPI Flash transaction: [%s]\n",
@@ -1642,7 +2012,7 @@ static uint8_t sjtag_flash_read_fsr(spi_cfi_t *cfi, uint32_t *status,
   /*
    * Get spi flash status register value
    */
-  rc = sjtag_read_fifo(&fsr, 1, err_msg, msg_size);
+  rc = sjtag_read_fifo(ctx, &fsr, 1, err_msg, msg_size);
 
   if (rc != 0) {
     FPRINTF(stderr, "Couldn't read rfifo register: [%s]\n", err_msg);
@@ -1672,9 +2042,10 @@ static uint8_t sjtag_flash_read_fsr(spi_cfi_t *cfi, uint32_t *status,
  */
 static uint8_t sjtag_wait_till_fsr_ready(spi_cfi_t *cfi, uint8_t delay_factor,
                                          char *err_msg, uint32_t msg_size) {
+  sjtag_ctx_t *ctx = sjtag_cfi_ctx(cfi);
   uint8_t rc = 0;
-  uint32_t ii;
   uint32_t fsr;
+  sjtag_waiter_t w;
 
   FPRINTF(stderr, "%s start\n", __FUNCTION__);
   /*
@@ -1695,7 +2066,8 @@ static uint8_t sjtag_wait_till_fsr_ready(spi_cfi_t *cfi, uint8_t delay_factor,
   /*
    * Check for SPI Flash Flag Status Register for ready to accept transations
    */
-  for (ii = 0; ii < IOFPGA_SJTAG_READY_TIMEOUT; ii++) {
+  sjtag_wait_begin(ctx, &w, SJTAG_WAIT_FSR, 100 * delay_factor);
+  do {
     rc = sjtag_flash_read_fsr(cfi, &fsr, err_msg, msg_size);
 
     if (rc != 0) {
@@ -1703,12 +2075,11 @@ static uint8_t sjtag_wait_till_fsr_ready(spi_cfi_t *cfi, uint8_t delay_factor,
       return rc;
     }
 
-    if (!(fsr & SPIFLASH_FSR_READY)) {
-      usleep(100 * delay_factor); // Do not change here
-    } else {
+    if (fsr & SPIFLASH_FSR_READY) {
+      sjtag_wait_done(&w);
       return (0);
     }
-  }
+  } while (!sjtag_wait_next(&w, IOFPGA_SJTAG_READY_TIMEOUT * 100 * delay_factor));
 
   snprintf(err_msg, msg_size,
            "Timed out waiting for SPI Flash device to be ready, "
@@ -1728,6 +2099,7 @@ static uint8_t sjtag_wait_till_fsr_ready(spi_cfi_t *cfi, uint8_t delay_factor,
  */
 static uint8_t sjtag_flash_wr_ena_dis(spi_cfi_t *cfi, uint8_t ena_dis,
                                       char *err_msg, uint32_t msg_size) {
+  sjtag_ctx_t *ctx = sjtag_cfi_ctx(cfi);
   FPRINTF(stderr, "%s start\n", __FUNCTION__);
   uint8_t rc = 0;
   fpgalib_spi_cmd_t cmd = {0};
@@ -1769,7 +2141,7 @@ static uint8_t sjtag_flash_wr_ena_dis(spi_cfi_t *cfi, uint8_t ena_dis,
   }
 
   /* Set opcode and register address */
-  rc = sjtag_op_addr_reg_set(cmd.opcode, 0, /* SPI Flash Addr */
+  rc = sjtag_op_addr_reg_set(ctx, cmd.opcode, 0, /* SPI Flash Addr */
                              err_msg, msg_size);
 
   if (rc != 0) {
@@ -1787,7 +2159,7 @@ static uint8_t sjtag_flash_wr_ena_dis(spi_cfi_t *cfi, uint8_t ena_dis,
   }
 
   /* Check for sjtag FPGA Block transaction complete */
-  rc = sjtag_wait_until_transaction_complete(cfi->spi_delay_factor, err_msg,
+  rc = sjtag_wait_until_transaction_complete(ctx, cfi->spi_delay_factor, err_msg,
                                              msg_size);
   if (rc != 0) {
     FPRINTF(stderr, "Couldn't complete the SPI Flash transaction %s\n",
@@ -1801,6 +2173,7 @@ static uint8_t sjtag_flash_wr_ena_dis(spi_cfi_t *cfi, uint8_t ena_dis,
 
 static int sjtag_spi_write_bank_addr(spi_cfi_t *cfi, int bank_data,
                                      char *err_msg, uint32_t msg_size) {
+  sjtag_ctx_t *ctx = sjtag_cfi_ctx(cfi);
   int rc = 0;
   uint32_t data = 0;
   uint32_t ctrl_reg = 0;
@@ -1841,7 +2214,7 @@ static int sjtag_spi_write_bank_addr(spi_cfi_t *cfi, int bank_data,
   data = 0x00A;
   ctrl_reg = SJTAG_BLOCK_OFFSET + offsetof(fpgalib_sjtag_regs_t, cfgspi_reg) +
              offsetof(fpgalib_sjtag_cfgspi_reg_t, fpga_spi_control);
-  rc = iofpga_reg_write_access("write ctrl reg", ctrl_reg, data, err_msg,
+  rc = iofpga_reg_write_access(ctx, "write ctrl reg", ctrl_reg, data, err_msg,
                                msg_size);
   if (rc != 0) {
     FPRINTF(stderr, "fail to write ctrl reg [%s]\n", err_msg);
@@ -1857,7 +2230,7 @@ static int sjtag_spi_write_bank_addr(spi_cfi_t *cfi, int bank_data,
   }
 
   /* Set opcode and register address */
-  rc = sjtag_op_addr_reg_set(cmd.opcode, 0, /* 1 Byte write */
+  rc = sjtag_op_addr_reg_set(ctx, cmd.opcode, 0, /* 1 Byte write */
                              err_msg, msg_size);
 
   if (rc != 0) {
@@ -1879,7 +2252,7 @@ static int sjtag_spi_write_bank_addr(spi_cfi_t *cfi, int bank_data,
 
   data_reg = SJTAG_BLOCK_OFFSET + offsetof(fpgalib_sjtag_regs_t, cfgspi_reg) +
              offsetof(fpgalib_sjtag_cfgspi_reg_t, fpga_spi_data);
-  rc = iofpga_reg_write_access("sjtag data reg write", data_reg, data, err_msg,
+  rc = iofpga_reg_write_access(ctx, "sjtag data reg write", data_reg, data, err_msg,
                                msg_size);
   if (rc != 0) {
     FPRINTF(stderr, "fail to write data reg [%s]\n", err_msg);
@@ -1894,7 +2267,7 @@ static int sjtag_spi_write_bank_addr(spi_cfi_t *cfi, int bank_data,
   }
 
   /* Check for operation done */
-  rc = sjtag_wait_until_transaction_complete(cfi->spi_delay_factor, err_msg,
+  rc = sjtag_wait_until_transaction_complete(ctx, cfi->spi_delay_factor, err_msg,
                                              msg_size);
   if (rc != 0) {
     FPRINTF(stderr, "Couldn't complete the SPI Flash transaction [%s]\n",
@@ -1907,21 +2280,66 @@ static int sjtag_spi_write_bank_addr(spi_cfi_t *cfi, int bank_data,
 }
 
 /*
- * Service routine to READ page data from SPI Flash memory.
+ * Service routine to point the Bank / Extended Address Register of the
+ * flash at the 16MB bank holding addr, for parts that are driven with 3
+ * byte addresses. Bank Read/Write Register opcodes must be valid and
+ * non-zero; (addr >> 24) goes to the Bank register and the low 3 bytes
+ * to the addr opcode register.
+ *
+ * The bank last written is cached in the device context, so the register
+ * is only written and read back when an access moves to another bank,
+ * i.e. at most once per 16MB rather than twice per page. Flashes driven
+ * with native 4 byte address opcodes never need it.
+ *
+ * Returns 0 on Success
+ *         otherwise - Error code with message
+ */
+static uint8_t sjtag_spi_select_bank(spi_cfi_t *cfi, uint32_t addr,
+                                     char *err_msg, uint32_t msg_size) {
+  sjtag_ctx_t *ctx = sjtag_cfi_ctx(cfi);
+  int bank = addr >> 24;
+  uint8_t rc;
+
+  if (!cfi->wr_ear || !cfi->rd_ear || spiflash_native_4byte(cfi)) {
+    return 0;
+  }
+  if (ctx->bank_addr == bank) {
+    return 0;
+  }
+
+  /* Unknown until the new value has been read back */
+  ctx->bank_addr = -1;
+  rc = sjtag_spi_write_bank_addr(cfi, bank, err_msg, msg_size);
+  if (rc != 0) {
+    return rc;
+  }
+  rc = sjtag_spi_read_bank_addr(cfi, bank, err_msg, msg_size);
+  if (rc != 0) {
+    FPRINTF(stderr, "bank addr mismatch, [%s]\n", err_msg);
+    return rc;
+  }
+  ctx->bank_addr = bank;
+  return 0;
+}
+
+/*
+ * Service routine to start a page READ from SPI Flash memory. The
+ * controller fetches the page into its rfifo on its own; the data is
+ * collected with sjtag_page_read_finish().
  * INPUT:
- *  cfi  - SPI Common Flash Interface Data
+ *  cfi      - SPI Common Flash Interface Data
  *  addr     - SPI Flash memory Address
- *  data     - Pointer to get SPI Flash data that read
  *  data_len - How many bytes need to read from given addr
  *  err_msg  - Error message buffer
  *  msg_size - Error message buffer size
  *
- * Returns 0 when read from SPI Flash
+ * Returns 0 when the read is under way
  *  otherwise - error code with message
  */
-static uint8_t sjtag_page_read(spi_cfi_t *cfi, uint32_t addr, uint8_t *data,
-                               uint16_t data_len, char *err_msg,
-                               uint32_t msg_size) {
+static uint8_t sjtag_page_read_start(spi_cfi_t *cfi, uint32_t addr,
+                                     uint16_t data_len, char *err_msg,
+                                     uint32_t msg_size) {
+  sjtag_ctx_t *ctx = sjtag_cfi_ctx(cfi);
   uint8_t rc = 0;
   fpgalib_spi_cmd_t cmd = {0};
 
@@ -1961,25 +2379,11 @@ static uint8_t sjtag_page_read(spi_cfi_t *cfi, uint32_t addr, uint8_t *data,
     return rc;
   }
 
-  /*
-   * Check whether Bank Read/Write Register opcodes are valid and
-   * non-zero values. If yes, proceed with Bank Address Write
-   * Register otherwise skip writing to Bank Address Register
-   * (addr >> 24) - write 4 byte value to Bank register and
-   * 3 bytes to addr opcode register
-   */
-  if (cfi->wr_ear && cfi->rd_ear) {
-    rc = sjtag_spi_write_bank_addr(cfi, (addr >> 24), err_msg, msg_size);
-    if (rc != 0) {
-      FPRINTF(stderr, "fail to set bank addr [%s]\n", err_msg);
-      return rc;
-    }
-
-    rc = sjtag_spi_read_bank_addr(cfi, (addr >> 24), err_msg, msg_size);
-    if (rc != 0) {
-      FPRINTF(stderr, "bank addr mismatch, [%s]\n", err_msg);
-      return rc;
-    }
+  /* Point the flash at the 16MB bank of addr, if it has to be */
+  rc = sjtag_spi_select_bank(cfi, addr, err_msg, msg_size);
+  if (rc != 0) {
+    FPRINTF(stderr, "fail to set bank addr [%s]\n", err_msg);
+    return rc;
   }
 
   rc = spiflash_prepare_spi_command(cfi, SPIFLASH_OPER_READ_MEM, &cmd, err_msg,
@@ -1990,7 +2394,7 @@ static uint8_t sjtag_page_read(spi_cfi_t *cfi, uint32_t addr, uint8_t *data,
   }
 
   /* Set opcode and register address */
-  rc = sjtag_op_addr_reg_set(cmd.opcode, addr, /* SPI Flash Addr */
+  rc = sjtag_op_addr_reg_set(ctx, cmd.opcode, addr, /* SPI Flash Addr */
                              err_msg, msg_size);
 
   if (rc != 0) {
@@ -2005,9 +2409,21 @@ static uint8_t sjtag_page_read(spi_cfi_t *cfi, uint32_t addr, uint8_t *data,
     FPRINTF(stderr, "Failed to set controller instruction [%s]\n", err_msg);
     return rc;
   }
+  return 0;
+}
+
+/*
+ * Wait for the read started by sjtag_page_read_start() and pull the page
+ * out of the rfifo. The CPU is free to do other work between the two.
+ */
+static uint8_t sjtag_page_read_finish(spi_cfi_t *cfi, uint8_t *data,
+                                      uint16_t data_len, char *err_msg,
+                                      uint32_t msg_size) {
+  sjtag_ctx_t *ctx = sjtag_cfi_ctx(cfi);
+  uint8_t rc = 0;
 
   /* Check for sjtag FPGA Block transaction complete */
-  rc = sjtag_wait_until_transaction_complete(cfi->spi_delay_factor, err_msg,
+  rc = sjtag_wait_until_transaction_complete(ctx, cfi->spi_delay_factor, err_msg,
                                              msg_size);
   if (rc != 0) {
     FPRINTF(stderr, "Couldn't complete the SPI Flash transaction: [%s]\n",
@@ -2016,7 +2432,7 @@ static uint8_t sjtag_page_read(spi_cfi_t *cfi, uint32_t addr, uint8_t *data,
   }
 
   /* Extract data from sjtag FPGA Block rfifo */
-  rc = sjtag_read_fifo(data, data_len, err_msg, msg_size);
+  rc = sjtag_read_fifo(ctx, data, data_len, err_msg, msg_size);
 
   if (rc != 0) {
     FPRINTF(stderr, "Failed read from sjtag FPGA Block rfifo [%s]\n", err_msg);
@@ -2045,23 +2461,24 @@ static uint8_t sjtag_page_read(spi_cfi_t *cfi, uint32_t addr, uint8_t *data,
  *  err_msg  - Error message buffer
  *  msg_size - Error message buffer size
  *
+ * A flash READ runs on across page boundaries, so the range is fetched in
+ * bursts of a whole rfifo, several pages each. Bursts are aligned to their
+ * size and so never straddle a 16MB bank, which keeps bank selects down
+ * to one per bank. Once a burst is out of the rfifo the next one is
+ * started, and the data is copied out while the controller fetches it.
+ *
  * Returns 0 when read from SPI Flash
  *  otherwise - error code with message
  */
 static uint8_t sjtag_read(spi_cfi_t *cfi, uint32_t addr, uint8_t *data,
                           uint32_t data_len, char *err_msg, uint32_t msg_size) {
+  uint8_t buf[2][IOFPGA_SJTAG_RDATA_SIZE];
+  const uint32_t burst = IOFPGA_SJTAG_RDATA_SIZE;
+  uint64_t end = (uint64_t)addr + data_len;
+  uint64_t lo, hi;
+  uint32_t pos;
+  uint8_t *cur;
   uint8_t rc = 0;
-  uint16_t page_size;
-  uint32_t ii;
-  uint32_t jj;
-  uint32_t kk;
-  uint32_t max_byte;
-  uint32_t start_pg;
-  uint32_t end_pg;
-  uint32_t start_rd_addr;
-  uint32_t start_wr_addr;
-  uint8_t *data_ptr = NULL;
-  uint8_t *this_data;
 
   FPRINTF(stderr, "Read SPI Flash Memory addr 0x%x data_len 0x%x\n", addr,
           data_len);
@@ -2081,108 +2498,111 @@ static uint8_t sjtag_read(spi_cfi_t *cfi, uint32_t addr, uint8_t *data,
              cfi->dev_inst, IOFPGA_SJTAG_MAX_DEV);
     return (ENODEV);
   }
-
-  page_size = cfi->page_size;
-
-  if (page_size == 0 || page_size > IOFPGA_SJTAG_PAGE_SIZE) {
-    snprintf(err_msg, msg_size,
-             "Internal SW can't handle page_size %d "
-             "bigger than expected %d",
-             page_size, IOFPGA_SJTAG_PAGE_SIZE);
-    return (EINVAL);
-  }
-
-  /* A segment of data_len, start at addr are within these pages */
-  sjtag_segment_range(addr, data_len, page_size, &start_pg, &end_pg);
-  data_ptr = malloc(page_size);
-  if (data_ptr == NULL) {
-    snprintf(err_msg, msg_size, "failed to allocate memory %s",
-             strerror(errno));
-    return ENOMEM;
+  if (!data_len) {
+    return 0;
   }
 
-  /*
-   * NOTE: SPI FLASH is operated on page alignment
-   * The request "addr" may be in the middle of the first page
-   * The request "data_len" may be ended in the middle of the last page
-   * First page and last page can be the same page
-   * This function will read more than the request "data_len";
-   * adjustment is needed, so the returned result is exactly the request
-   */
-
-  /*
-   * Read 1 page at a time then transfer it to data
-   */
-  this_data = (uint8_t *)data;
-  kk = 0;
-
-  for (ii = start_pg; ii < end_pg; ii++) {
-    start_rd_addr = ii * page_size; /* Top of the page, and <= addr */
-    memset(data_ptr, 0, sizeof(page_size));
-
-    rc = sjtag_page_read(cfi, start_rd_addr, data_ptr, page_size, err_msg,
-                         msg_size);
-
+  pos = addr & ~(burst - 1);
+  rc = sjtag_page_read_start(cfi, pos, burst, err_msg, msg_size);
+  for (cur = buf[0]; rc == 0 && pos < end; pos += burst) {
+    rc = sjtag_page_read_finish(cfi, cur, burst, err_msg, msg_size);
     if (rc != 0) {
-      FPRINTF(stderr,
-              "Failed to the read page %d of "
-              "start_pg %d end_pg %d size %d %s\n",
-              ii, start_pg, end_pg, page_size, err_msg);
-      goto clean_exit;
-    }
-
-    if (ii == start_pg) { /* 1st page read */
-      /* Max num of capture bytes */
-      max_byte = start_rd_addr + page_size - addr;
-
-      /* Start point to capture */
-      start_wr_addr = page_size - max_byte;
-    } else {
-      /* Max num of capture bytes */
-      max_byte = page_size; /* Max num of capture bytes */
-
-      start_wr_addr = 0; /* Start point to capture */
+      break;
     }
-
-    /* Case of last page */
-    if ((kk + max_byte) > data_len) {
-      max_byte = data_len - kk;
+    if (pos + (uint64_t)burst < end) {
+      rc = sjtag_page_read_start(cfi, pos + burst, burst, err_msg, msg_size);
+      if (rc != 0) {
+        break;
+      }
     }
 
-    /* Store into data */
-    for (jj = 0; jj < max_byte; jj++) {
-      this_data[kk] = *(data_ptr + start_wr_addr);
-      start_wr_addr++;
-      kk++;
-    }
+    lo = addr > pos ? addr : pos;
+    hi = end < (uint64_t)pos + burst ? end : (uint64_t)pos + burst;
+    memcpy(data + (lo - addr), cur + (lo - pos), hi - lo);
+    cur = cur == buf[0] ? buf[1] : buf[0];
   }
 
+  if (rc != 0) {
+    FPRINTF(stderr, "Failed to read burst at 0x%x of addr 0x%x len 0x%x %s\n",
+            pos, addr, data_len, err_msg);
+    return rc;
+  }
   FPRINTF(stderr, "Success Reading SPI Flash addr 0x%x data_len 0x%x\n", addr,
           data_len);
+  return 0;
+}
 
-clean_exit:
-
-  if (data_ptr) {
-    free(data_ptr);
-  }
+/*
+ * The rfifo / wfifo data register carries the flash bytes most significant
+ * byte first, so every dword moved through it is byte reversed. Swap a
+ * whole buffer of dwords at once: 16 bytes per shuffle where the CPU has
+ * SSSE3, a bswap per dword otherwise. dst and src may be unaligned but
+ * must not overlap.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target("ssse3")))
+static uint32_t sjtag_swap_dwords_ssse3(uint8_t *dst, const uint8_t *src,
+                                        uint32_t dwords) {
+  const __m128i rev = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11,
+                                   4, 5, 6, 7, 0, 1, 2, 3);
+  uint32_t ii;
 
-  return rc;
+  for (ii = 0; ii + 4 <= dwords; ii += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + ii * 4));
+    _mm_storeu_si128((__m128i *)(dst + ii * 4), _mm_shuffle_epi8(v, rev));
+  }
+  return ii;
+}
+#endif
+
+static void sjtag_swap_dwords(uint8_t *dst, const uint8_t *src,
+                              uint32_t dwords) {
+  uint32_t ii = 0;
+  uint32_t value;
+
+#if defined(__x86_64__) || defined(__i386__)
+  if (__builtin_cpu_supports("ssse3")) {
+    ii = sjtag_swap_dwords_ssse3(dst, src, dwords);
+  }
+#endif
+  for (; ii < dwords; ii++) {
+    memcpy(&value, src + ii * 4, sizeof(value));
+    value = __builtin_bswap32(value);
+    memcpy(dst + ii * 4, &value, sizeof(value));
+  }
+}
+
+/*
+ * Data register of the sjtag FPGA Block fifos
+ */
+static volatile uint32_t *sjtag_fifo_reg(sjtag_ctx_t *ctx) {
+  return (volatile uint32_t *)((uint8_t *)ctx->map_base + PCI_ADDRESS +
+                               SJTAG_BLOCK_OFFSET +
+                               offsetof(fpgalib_sjtag_regs_t, cfgspi_reg) +
+                               offsetof(fpgalib_sjtag_cfgspi_reg_t,
+                                        fpga_spi_data));
 }
 
 /*
  * Service routine to Reads SPI Flash Data from FPGA sjtag block rfifo register
  *
+ * The fifo is drained in a tight loop of register loads into a bounce
+ * buffer, which is then byte swapped into data in one go.
+ *
  * Returns 0 on Success
  *         otherwise - Error code with message
  */
-static uint8_t sjtag_read_fifo(uint8_t *data, uint16_t data_len, char *err_msg,
+static uint8_t sjtag_read_fifo(sjtag_ctx_t *ctx, uint8_t *data,
+                               uint16_t data_len, char *err_msg,
                                uint32_t msg_size) {
-  uint8_t rc = 0;
-  uint32_t ii = 0, jj = 0;
-  uint32_t rfifo_reg = 0;
+  uint32_t raw[IOFPGA_SJTAG_RDATA_SIZE / 4] = {0};
+  volatile uint32_t *rfifo;
   uint16_t max_dwords = 0;
   uint16_t max_bytes = 0;
-  uint32_t value = 0;
+  uint32_t fifo_dwords;
+  uint32_t ii;
 
   FPRINTF(stderr, "sjtag_read_fifo start\n");
   if (data == NULL) {
@@ -2199,58 +2619,42 @@ static uint8_t sjtag_read_fifo(uint8_t *data, uint16_t data_len, char *err_msg,
             IOFPGA_SJTAG_RDATA_SIZE, data_len);
     return (EINVAL);
   }
+  if (!ctx->map_base) {
+    snprintf(err_msg, msg_size, "sjtag block %s is not mapped",
+             ctx->block_name);
+    return ENODEV;
+  }
 
   max_dwords = data_len / 4;
   max_bytes = data_len % 4;
+  fifo_dwords = max_dwords + (max_bytes != 0);
+  rfifo = sjtag_fifo_reg(ctx);
 
-  rfifo_reg = SJTAG_BLOCK_OFFSET + offsetof(fpgalib_sjtag_regs_t, cfgspi_reg) +
-              offsetof(fpgalib_sjtag_cfgspi_reg_t, fpga_spi_data);
-
-  /*
-   * Get first n-1 dwords
-   */
-  for (ii = 0; ii < max_dwords; ii++) {
-    value = 0;
-    rc = iofpga_reg_read_access("sjtag read fifo", rfifo_reg, &value, err_msg,
-                                msg_size);
-
-    if (rc != 0) {
-      FPRINTF(stderr, "Failed to read rfifo register : [%s]\n", err_msg);
-      return rc;
-    }
-
-    /* Endian-ness conversion requirement:
-     * SJ SPI interface needs Endian-ness conversion
-     * and hence the need for new Register Access functions for
-     * reading and programming SPI flash memory.
-     * Use register access functions appropriately while adding
-     * support for new SJ SPI interface as all SJ devices may not
-     * need swapping.
-     */
-    value = htobe32(value);
-
-    for (jj = 0; jj < 4; jj++) {
-      *(data + (ii * 4) + jj) = ((value >> (jj * 8)) & 0xFF);
+  if (ctx->sim) {
+    sjtag_sim_fifo_read(ctx->sim, raw, fifo_dwords);
+  } else {
+    for (ii = 0; ii < fifo_dwords; ii++) {
+      raw[ii] = *rfifo;
     }
   }
 
+  /* Endian-ness conversion requirement:
+   * SJ SPI interface needs Endian-ness conversion
+   * and hence the need for new Register Access functions for
+   * reading and programming SPI flash memory.
+   * Use register access functions appropriately while adding
+   * support for new SJ SPI interface as all SJ devices may not
+   * need swapping.
+   */
+  sjtag_swap_dwords(data, (uint8_t *)raw, max_dwords);
+
   /*
    * Get the last bytes
    */
   if (max_bytes) {
-    value = 0;
-    rc = iofpga_reg_read_access("sjtag read fifo", rfifo_reg, &value, err_msg,
-                                msg_size);
-    if (rc != 0) {
-      FPRINTF(stderr, "Failed to read rfifo register: [%s]\n", err_msg);
-      return rc;
-    }
-
-    value = htobe32(value);
+    uint32_t value = __builtin_bswap32(raw[max_dwords]);
 
-    for (jj = 0; jj < max_bytes; jj++) {
-      *(data + (ii * 4) + jj) = ((value >> (jj * 8)) & 0xFF);
-    }
+    memcpy(data + max_dwords * 4, &value, max_bytes);
   }
 
   FPRINTF(stderr, "sjtag_read_fifo end\n");
@@ -2262,6 +2666,7 @@ static uint8_t sjtag_read_fifo(uint8_t *data, uint16_t data_len, char *err_msg,
  */
 static uint8_t sjtag_flash_read_sr(spi_cfi_t *cfi, uint32_t *status,
                                    char *err_msg, uint32_t msg_size) {
+  sjtag_ctx_t *ctx = sjtag_cfi_ctx(cfi);
   uint8_t rc = 0;
   uint8_t fsr;
   fpgalib_spi_cmd_t cmd = {0};
@@ -2282,7 +2687,7 @@ static uint8_t sjtag_flash_read_sr(spi_cfi_t *cfi, uint32_t *status,
   }
 
   /* Set opcode and register address */
-  rc = sjtag_op_addr_reg_set(cmd.opcode, 0 /* SPI Flash Addr */, err_msg,
+  rc = sjtag_op_addr_reg_set(ctx, cmd.opcode, 0 /* SPI Flash Addr */, err_msg,
                              msg_size);
   if (rc != 0) {
     FPRINTF(stderr, "Failed to set opcode and registers: [%s]\n", err_msg);
@@ -2298,7 +2703,7 @@ static uint8_t sjtag_flash_read_sr(spi_cfi_t *cfi, uint32_t *status,
   }
 
   /* Check for sjtag FPGA Block transaction complete */
-  rc = sjtag_wait_until_transaction_complete(cfi->spi_delay_factor, err_msg,
+  rc = sjtag_wait_until_transaction_complete(ctx, cfi->spi_delay_factor, err_msg,
                                              msg_size);
   if (rc != 0) {
     FPRINTF(stderr, "Couldn't complete the SPI Flash transaction : [%s]\n",
@@ -2309,7 +2714,7 @@ static uint8_t sjtag_flash_read_sr(spi_cfi_t *cfi, uint32_t *status,
   /*
    * Get spi flash status register value
    */
-  rc = sjtag_read_fifo(&fsr, 1, err_msg, msg_size);
+  rc = sjtag_read_fifo(ctx, &fsr, 1, err_msg, msg_size);
 
   if (rc != 0) {
     FPRINTF(stderr, "Couldn't read rfifo register : [%s]\n", err_msg);
@@ -2324,10 +2729,11 @@ static uint8_t sjtag_flash_read_sr(spi_cfi_t *cfi, uint32_t *status,
 
 uint8_t sjtag_wait_till_wip(spi_cfi_t *cfi, uint8_t delay_factor, char *err_msg,
                             uint32_t msg_size) {
+  sjtag_ctx_t *ctx = sjtag_cfi_ctx(cfi);
 
   uint8_t rc = 0; // SUCCESS
   uint32_t sr;    // status Register
-  uint32_t i;
+  sjtag_waiter_t w;
 
   FPRINTF(stderr, "%s start\n", __FUNCTION__);
   if (!cfi) {
@@ -2346,7 +2752,8 @@ uint8_t sjtag_wait_till_wip(spi_cfi_t *cfi, uint8_t delay_factor, char *err_msg,
   /*
    * Check for SPI Flash Flag Status Register for ready to accept transations
    */
-  for (i = 0; i < IOFPGA_SJTAG_READY_TIMEOUT; i++) {
+  sjtag_wait_begin(ctx, &w, SJTAG_WAIT_WIP, 100 * delay_factor);
+  do {
     rc = sjtag_flash_read_sr(cfi, &sr, err_msg, msg_size);
 
     if (rc != 0) {
@@ -2354,12 +2761,11 @@ uint8_t sjtag_wait_till_wip(spi_cfi_t *cfi, uint8_t delay_factor, char *err_msg,
       return rc;
     }
 
-    if (sr & SPIFLASH_SR_WIP) {
-      usleep(100 * delay_factor);
-    } else {
+    if (!(sr & SPIFLASH_SR_WIP)) {
+      sjtag_wait_done(&w);
       return 0;
     }
-  }
+  } while (!sjtag_wait_next(&w, IOFPGA_SJTAG_READY_TIMEOUT * 100 * delay_factor));
 
   snprintf(err_msg, msg_size,
            "Timed out waiting for SPI Flash device to be ready, "
@@ -2375,6 +2781,7 @@ uint8_t sjtag_wait_till_wip(spi_cfi_t *cfi, uint8_t delay_factor, char *err_msg,
 uint8_t iofpga_read_spi_jedec_id(uint8_t *data, uint16_t data_len,
                                  spi_cfi_t *cfi, char *err_msg,
                                  uint32_t msg_size) {
+  sjtag_ctx_t *ctx = sjtag_cfi_ctx(cfi);
   uint8_t rc = 0;              // Success
   fpgalib_spi_cmd_t cmd = {0}; // spi command
 
@@ -2396,7 +2803,7 @@ uint8_t iofpga_read_spi_jedec_id(uint8_t *data, uint16_t data_len,
   sjtag_wait_till_wip(cfi, cfi->spi_delay_factor, err_msg, msg_size);
 
   /* Set opcode and register address */
-  rc = sjtag_op_addr_reg_set(cmd.opcode, 0 /* SPI Flash Addr */, err_msg,
+  rc = sjtag_op_addr_reg_set(ctx, cmd.opcode, 0 /* SPI Flash Addr */, err_msg,
                              msg_size);
 
   if (rc != 0) {
@@ -2414,7 +2821,7 @@ uint8_t iofpga_read_spi_jedec_id(uint8_t *data, uint16_t data_len,
   }
 
   /* Check for operation done */
-  rc = sjtag_wait_until_transaction_complete(cfi->spi_delay_factor, err_msg,
+  rc = sjtag_wait_until_transaction_complete(ctx, cfi->spi_delay_factor, err_msg,
                                              msg_size);
   if (rc != 0) {
     FPRINTF(stderr, "Couldn't complete the SPI Flash transaction: [%s]\n",
@@ -2425,7 +2832,7 @@ uint8_t iofpga_read_spi_jedec_id(uint8_t *data, uint16_t data_len,
   /*
    * Get SPI Flash JEDEC ID
    */
-  rc = sjtag_read_fifo(data, data_len, err_msg, msg_size);
+  rc = sjtag_read_fifo(ctx, data, data_len, err_msg, msg_size);
 
   if (rc != 0) {
     FPRINTF(stderr, "Couldn't read rfifo register: [%s]\n", err_msg);
@@ -2528,23 +2935,28 @@ uint8_t spiflash_cfi_data(spiflash_cfg_t *config, spi_cfi_t *cfi) {
    */
   if (cfi->enter_4byte) {
     cfi->mode = FPGALIB_SPI_MODE_4BYTE_ADDRESS_SET;
+  } else {
+    cfi->mode = FPGALIB_SPI_MODE_4BYTE_ADDRESS_UNSET;
   }
 
   FPRINTF(stderr, "spiflash_cfi_data end\n");
   return 0;
 }
 
-int iofpga_get_spi_cfg(char *err_msg, uint32_t msg_size) {
+int iofpga_get_spi_cfg(sjtag_ctx_t *ctx) {
   FPRINTF(stderr, "iofpga_get_spi_cfg start\n");
   spiflash_cfg_t *spiflash_cfg = &spiflash_models_cfg[0];
+  spi_cfi_t *cfi = &ctx->cfi;
+  char *err_msg = ctx->err_msg;
+  uint32_t msg_size = sizeof(ctx->err_msg);
 
   uint8_t jedec_id[JEDEC_ID_LEN] = {0};
   uint8_t rc = 0;
 
   // set up cfi with defaults.
-  spiflash_cfi_data(spiflash_cfg, &cfi);
+  spiflash_cfi_data(spiflash_cfg, cfi);
 
-  rc = iofpga_read_spi_jedec_id(jedec_id, sizeof(jedec_id), &cfi, err_msg,
+  rc = iofpga_read_spi_jedec_id(jedec_id, sizeof(jedec_id), cfi, err_msg,
                                 msg_size);
   if (rc) {
     printf("Failed to get jedec_id from SPI Flash! "
@@ -2555,11 +2967,13 @@ int iofpga_get_spi_cfg(char *err_msg, uint32_t msg_size) {
   memset(&spiflash_cfg, 0, sizeof(spiflash_cfg));
   spiflash_cfg = get_spiflash_cfg(jedec_id);
   if (spiflash_cfg == NULL) {
+      snprintf(err_msg, msg_size, "unknown SPI flash %02x %02x %02x",
+               jedec_id[0], jedec_id[1], jedec_id[2]);
       printf("failed to get spiflash cfg\n");
       return -1;
   }
 
-  spiflash_cfi_data(spiflash_cfg, &cfi);
+  spiflash_cfi_data(spiflash_cfg, cfi);
 
   FPRINTF(stderr, "iofpga_get_spi_cfg end\n");
   return 0;
@@ -2758,17 +3172,21 @@ void fpd_version_str (fpd_version_t *ver,
 /*
  * Service routine to Sets SPI Flash Data into FPGA sjtag block rfifo register
  *
+ * data is byte swapped into a bounce buffer in one go, which is then fed
+ * to the fifo in a tight loop of register stores.
+ *
  * Returns 0 on Success
  *         otherwise - Error code with message
  */
-static uint8_t sjtag_write_fifo(uint8_t *data, uint16_t data_len, char *err_msg,
+static uint8_t sjtag_write_fifo(sjtag_ctx_t *ctx, uint8_t *data,
+                                uint16_t data_len, char *err_msg,
                                 uint32_t msg_size) {
-  uint8_t rc = 0;
-  uint32_t ii, jj;
-  uint32_t wfifo_reg;
+  uint32_t raw[IOFPGA_SJTAG_WDATA_SIZE / 4 + 1];
+  volatile uint32_t *wfifo;
   uint16_t max_dwords = 0;
   uint16_t max_bytes = 0;
-  uint32_t value = 0;
+  uint32_t fifo_dwords;
+  uint32_t ii;
 
   FPRINTF(stderr, "%s start\n", __FUNCTION__);
   if (!data) {
@@ -2782,59 +3200,35 @@ static uint8_t sjtag_write_fifo(uint8_t *data, uint16_t data_len, char *err_msg,
     FPRINTF(stderr, "%s\n", err_msg);
     return (EINVAL);
   }
+  if (!ctx->map_base) {
+    snprintf(err_msg, msg_size, "sjtag block %s is not mapped",
+             ctx->block_name);
+    return ENODEV;
+  }
 
   max_dwords = data_len / 4;
   max_bytes = data_len % 4;
+  fifo_dwords = max_dwords + (max_bytes != 0);
+  wfifo = sjtag_fifo_reg(ctx);
 
-  wfifo_reg = SJTAG_BLOCK_OFFSET + offsetof(fpgalib_sjtag_regs_t, cfgspi_reg) +
-              offsetof(fpgalib_sjtag_cfgspi_reg_t, fpga_spi_data);
-
-  /*
-   * Set first n-1 dwords
-   */
-  for (ii = 0; ii < max_dwords; ii++) {
-    value = 0;
-    for (jj = 0; jj < 4; jj++) {
-      value |= (*(data + (ii * 4) + jj) << (jj * 8));
-    }
-
-    /* Endian-ness conversion requirement:
-     * SJ SPI interface needs Endian-ness conversion
-     * and hence the need for new Register Access functions for
-     * reading and programming SPI flash memory.
-     * Use register access functions appropriately while adding
-     * support for new SJ SPI interface as all SJ devices may not
-     * need swapping.
-     */
-    value = htobe32(value);
-
-    rc = iofpga_reg_write_access("sjtag write fifo", wfifo_reg, value, err_msg,
-                                 msg_size);
-
-    if (rc != 0) {
-      snprintf(err_msg, msg_size, "Failed to write wfifo register %d", rc);
-      FPRINTF(stderr, "%s\n", err_msg);
-      return rc;
-    }
-  }
+  /* Endian-ness conversion requirement, see sjtag_read_fifo() */
+  sjtag_swap_dwords((uint8_t *)raw, data, max_dwords);
 
   /*
-   * Get the last bytes
+   * The last bytes go out in the low order bytes of a final dword
    */
   if (max_bytes) {
-    value = 0;
-    for (jj = 0; jj < 4; jj++) {
-      value |= (*(data + (ii * 4) + jj) << (jj * 8));
-    }
+    uint32_t value = 0;
 
-    value = htobe32(value);
+    memcpy(&value, data + max_dwords * 4, max_bytes);
+    raw[max_dwords] = __builtin_bswap32(value);
+  }
 
-    rc = iofpga_reg_write_access("sjtag write fifo", wfifo_reg, value, err_msg,
-                                 msg_size);
-    if (rc != 0) {
-      snprintf(err_msg, msg_size, "Failed to write wfifo register %d", rc);
-      FPRINTF(stderr, "%s\n", err_msg);
-      return rc;
+  if (ctx->sim) {
+    sjtag_sim_fifo_write(ctx->sim, raw, fifo_dwords);
+  } else {
+    for (ii = 0; ii < fifo_dwords; ii++) {
+      *wfifo = raw[ii];
     }
   }
 
@@ -2858,6 +3252,7 @@ static uint8_t sjtag_write_fifo(uint8_t *data, uint16_t data_len, char *err_msg,
 static uint8_t sjtag_page_write(spi_cfi_t *cfi, uint32_t addr, uint8_t *data,
                                 uint16_t data_len, char *err_msg,
                                 uint32_t msg_size) {
+  sjtag_ctx_t *ctx = sjtag_cfi_ctx(cfi);
   uint8_t rc = 0;
   fpgalib_spi_cmd_t cmd = {0};
   uint8_t flash_wr_ena = 0;
@@ -2891,25 +3286,11 @@ static uint8_t sjtag_page_write(spi_cfi_t *cfi, uint32_t addr, uint8_t *data,
     return (EINVAL);
   }
 
-  /*
-   * Check whether Bank Read/Write Register opcodes are valid and
-   * non-zero values. If yes, proceed with Bank Address Write
-   * Register otherwise skip writing to Bank Address Register
-   * (addr >> 24) - write 4 byte value to Bank register and
-   * 3 bytes to addr opcode register
-   */
-  if (cfi->wr_ear && cfi->rd_ear) {
-    rc = sjtag_spi_write_bank_addr(cfi, (addr >> 24), err_msg, msg_size);
-    if (rc != 0) {
-      FPRINTF(stderr, "fail to set bank addr: [%s]\n", err_msg);
-      return rc;
-    }
-
-    rc = sjtag_spi_read_bank_addr(cfi, (addr >> 24), err_msg, msg_size);
-    if (rc != 0) {
-      FPRINTF(stderr, "bank addr mismatch: [%s]\n", err_msg);
-      return rc;
-    }
+  /* Point the flash at the 16MB bank of addr, if it has to be */
+  rc = sjtag_spi_select_bank(cfi, addr, err_msg, msg_size);
+  if (rc != 0) {
+    FPRINTF(stderr, "fail to set bank addr [%s]\n", err_msg);
+    return rc;
   }
 
   /* SPI Flash write enable */
@@ -2946,7 +3327,7 @@ static uint8_t sjtag_page_write(spi_cfi_t *cfi, uint32_t addr, uint8_t *data,
 #endif
 
   /* Write data into sjtag FPGA Block wfifo */
-  rc = sjtag_write_fifo(data, data_len, err_msg, msg_size);
+  rc = sjtag_write_fifo(ctx, data, data_len, err_msg, msg_size);
   if (rc != 0) {
     FPRINTF(stderr, "Failed to write into sjtag FPGA Block wfifo: [%s]\n",
             err_msg);
@@ -2954,7 +3335,7 @@ static uint8_t sjtag_page_write(spi_cfi_t *cfi, uint32_t addr, uint8_t *data,
   }
 
   /* Set opcode and register address */
-  rc = sjtag_op_addr_reg_set(cmd.opcode, addr, /* SPI Flash Addr */
+  rc = sjtag_op_addr_reg_set(ctx, cmd.opcode, addr, /* SPI Flash Addr */
                              err_msg, msg_size);
   if (rc != 0) {
     FPRINTF(stderr, "Failed to set opcode and register: [%s]\n", err_msg);
@@ -2970,7 +3351,7 @@ static uint8_t sjtag_page_write(spi_cfi_t *cfi, uint32_t addr, uint8_t *data,
   }
 
   /* Check for sjtag FPGA Block transaction complete */
-  rc = sjtag_wait_until_transaction_complete(cfi->spi_delay_factor, err_msg,
+  rc = sjtag_wait_until_transaction_complete(ctx, cfi->spi_delay_factor, err_msg,
                                              msg_size);
   if (rc != 0) {
     FPRINTF(stderr, "Couldn't complete the SPI Flash transaction: [%s]\n",
@@ -3009,6 +3390,334 @@ clean_exit:
   return 0;
 }
 
+/*
+ * Live progress of one phase of a program / erase, see fpd_progress_t.
+ * All the helpers are no-ops without a callback.
+ */
+typedef struct sjtag_progress_ {
+  fpd_progress_cb_t cb;
+  void *cb_ctx;
+  fpd_progress_t cur;
+  uint64_t last_ns;    /* time and bytes_done of the last report */
+  uint64_t last_bytes;
+} sjtag_progress_t;
+
+static void sjtag_progress_report(sjtag_progress_t *p, uint64_t now) {
+  fpd_progress_t *cur = &p->cur;
+  double secs = (now - p->last_ns) / 1e9;
+
+  if (secs > 0 && cur->bytes_done > p->last_bytes) {
+    cur->mbps = (cur->bytes_done - p->last_bytes) / secs / (1024 * 1024);
+  }
+  if (cur->bytes_done >= cur->bytes_total) {
+    cur->eta_sec = 0;
+  } else if (cur->mbps > 0) {
+    cur->eta_sec =
+        (cur->bytes_total - cur->bytes_done) / (cur->mbps * 1024 * 1024);
+  }
+  p->last_ns = now;
+  p->last_bytes = cur->bytes_done;
+  p->cb(p->cb_ctx, cur);
+}
+
+static void sjtag_progress_begin(sjtag_progress_t *p, const char *phase,
+                                 uint64_t bytes_total) {
+  if (!p || !p->cb) {
+    return;
+  }
+  p->cur.phase = phase;
+  p->cur.bytes_done = 0;
+  p->cur.bytes_total = bytes_total;
+  p->cur.mbps = 0;
+  p->cur.eta_sec = -1;
+  p->last_ns = sjtag_now_nsec();
+  p->last_bytes = 0;
+  p->cb(p->cb_ctx, &p->cur);
+}
+
+static void sjtag_progress_add(sjtag_progress_t *p, uint64_t bytes) {
+  uint64_t now;
+
+  if (!p || !p->cb) {
+    return;
+  }
+  p->cur.bytes_done += bytes;
+  if (p->cur.bytes_done > p->cur.bytes_total) {
+    p->cur.bytes_done = p->cur.bytes_total;
+  }
+  now = sjtag_now_nsec();
+  if (now - p->last_ns >= FPD_PROGRESS_INTERVAL_MS * 1000000ULL) {
+    sjtag_progress_report(p, now);
+  }
+}
+
+static void sjtag_progress_end(sjtag_progress_t *p) {
+  if (!p || !p->cb) {
+    return;
+  }
+  p->cur.bytes_done = p->cur.bytes_total;
+  sjtag_progress_report(p, sjtag_now_nsec());
+}
+
+/*
+ * Work done by the flash program routines, accumulated across calls.
+ * Times are in microseconds.
+ */
+typedef struct sjtag_program_stats_ {
+  uint32_t sectors;         /* sectors covered by the data */
+  uint32_t sectors_written; /* sectors that were (re)programmed */
+  uint32_t sectors_blank;   /* sectors found erased, erase skipped */
+  uint32_t pages;           /* pages that needed programming */
+  uint32_t pages_blank;     /* all 0xFF pages, write skipped */
+  uint64_t program_bytes;   /* bytes sent to the flash */
+  uint64_t verify_bytes;    /* bytes read back and compared */
+  uint64_t read_usec;       /* reading back, comparing, blank checks */
+  uint64_t load_usec;       /* mapping the image, checking its digest */
+  uint64_t inflate_usec;
+  uint64_t erase_usec;
+  uint64_t program_usec;
+  uint64_t verify_usec;
+  sjtag_progress_t *progress; /* live progress reporting, may be NULL */
+  fpd_journal_t *journal;     /* resume journal of the image, may be NULL */
+  bool erased;                /* flash known blank, nothing to read back */
+  uint32_t rate_kbs;          /* image KB/s to stay under, 0 for no limit */
+  uint64_t rate_start_ns;
+  uint64_t rate_bytes;
+} sjtag_program_stats_t;
+
+/*
+ * End the phase of p, handing over where its time went
+ */
+static void sjtag_progress_end_times(sjtag_progress_t *p,
+                                     const sjtag_program_stats_t *stats) {
+  fpd_phase_times_t times = {
+      .load_sec = stats->load_usec / 1e6,
+      .inflate_sec = stats->inflate_usec / 1e6,
+      .erase_sec = stats->erase_usec / 1e6,
+      .program_sec = stats->program_usec / 1e6,
+      .verify_sec = (stats->verify_usec + stats->read_usec) / 1e6,
+  };
+
+  if (!p || !p->cb) {
+    return;
+  }
+  /* times lives on this stack, the callback may only look at it now */
+  p->cur.times = &times;
+  sjtag_progress_end(p);
+  p->cur.times = NULL;
+}
+
+/*
+ * Hold the image program to stats->rate_kbs by sleeping once bytes more
+ * of it are done, so a background stage leaves the SPI controller idle
+ * most of the time.
+ */
+static void sjtag_rate_limit(sjtag_program_stats_t *stats, uint32_t bytes) {
+  uint64_t now, due_ns;
+
+  if (!stats->rate_kbs) {
+    return;
+  }
+  now = sjtag_now_nsec();
+  if (!stats->rate_start_ns) {
+    stats->rate_start_ns = now;
+  }
+  stats->rate_bytes += bytes;
+  due_ns = stats->rate_start_ns +
+           stats->rate_bytes * 1000000ULL / stats->rate_kbs * 1000 / 1024;
+  if (due_ns > now) {
+    struct timespec ts = {.tv_sec = (due_ns - now) / 1000000000ULL,
+                          .tv_nsec = (due_ns - now) % 1000000000ULL};
+    nanosleep(&ts, NULL);
+  }
+}
+
+/*
+ * Record in the journal that sector sec holds its final contents
+ */
+static void sjtag_journal_sector_done(sjtag_program_stats_t *stats,
+                                      uint32_t sec) {
+  fpd_journal_t *journal = stats->journal;
+
+  if (journal) {
+    fpd_journal_update(journal, sec + 1 - journal->rec.image_offset /
+                                              journal->rec.sector_size);
+  }
+}
+
+/*
+ * Check whether a buffer is all 0xFF, i.e. what an erased sector reads as.
+ * The data is AND-reduced a 64 byte block at a time in 64-bit lanes, which
+ * the compiler turns into vector code, with an early exit per block.
+ */
+static int sjtag_buf_is_blank(const uint8_t *buf, uint32_t len) {
+  uint64_t acc, word;
+  uint32_t ii = 0, jj;
+
+  for (; ii + 64 <= len; ii += 64) {
+    acc = ~0ULL;
+    for (jj = 0; jj < 64; jj += sizeof(word)) {
+      memcpy(&word, buf + ii + jj, sizeof(word));
+      acc &= word;
+    }
+    if (acc != ~0ULL) {
+      return 0;
+    }
+  }
+  for (; ii < len; ii++) {
+    if (buf[ii] != 0xFF) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/*
+ * Read back len bytes at addr and compare them with expect.
+ * INPUT:
+ *  cfi      - SPI Common Flash Interface Data
+ *  addr     - SPI Flash memory Address
+ *  expect   - data the flash should hold
+ *  len      - Length in bytes
+ *  stats    - Accumulated verify bytes and time, may be NULL
+ *  err_msg  - Error message buffer
+ *  msg_size - Error message buffer size
+ *
+ * The range is read a burst of pages at a time, as in sjtag_read(), into
+ * two alternating buffers. Once a burst is out of the rfifo the read of
+ * the next one is started, and the burst is compared while the controller
+ * fetches the next, so comparing costs no bus time. memcmp() is vectorized and stops at the first
+ * difference; only then is the exact offset looked for.
+ *
+ * Returns 0 when the flash holds the expected data
+ *  EFAULT at the first mismatch, otherwise - error code with message
+ */
+static uint8_t sjtag_verify_range(spi_cfi_t *cfi, uint32_t addr,
+                                  const uint8_t *expect, uint32_t len,
+                                  sjtag_program_stats_t *stats,
+                                  char *err_msg, uint32_t msg_size) {
+  uint8_t buf[2][IOFPGA_SJTAG_RDATA_SIZE];
+  uint32_t page_size = cfi->page_size;
+  uint32_t start_pg, end_pg, pg, pg_addr, lo, hi, jj;
+  uint64_t t0 = sjtag_now_usec();
+  uint8_t *cur;
+  uint8_t rc;
+
+  if (!len) {
+    return 0;
+  }
+  if (page_size == 0 || page_size > IOFPGA_SJTAG_RDATA_SIZE) {
+    snprintf(err_msg, msg_size,
+             "Internal SW can't handle page_size %d "
+             "bigger than expected %d",
+             page_size, IOFPGA_SJTAG_RDATA_SIZE);
+    return (EINVAL);
+  }
+  /* A single page read back after its write needs no more than the page */
+  if (len > page_size) {
+    page_size = IOFPGA_SJTAG_RDATA_SIZE;
+  }
+  sjtag_segment_range(addr, len, page_size, &start_pg, &end_pg);
+
+  rc = sjtag_page_read_start(cfi, start_pg * page_size, page_size, err_msg,
+                             msg_size);
+  for (pg = start_pg; rc == 0 && pg < end_pg; pg++) {
+    cur = buf[pg & 1];
+    pg_addr = pg * page_size;
+    rc = sjtag_page_read_finish(cfi, cur, page_size, err_msg, msg_size);
+    if (rc != 0) {
+      break;
+    }
+    if (pg + 1 < end_pg) {
+      rc = sjtag_page_read_start(cfi, pg_addr + page_size, page_size,
+                                 err_msg, msg_size);
+      if (rc != 0) {
+        break;
+      }
+    }
+
+    lo = addr > pg_addr ? addr : pg_addr;
+    hi = (addr + len) < (pg_addr + page_size) ? (addr + len)
+                                              : (pg_addr + page_size);
+    if (!memcmp(cur + (lo - pg_addr), expect + (lo - addr), hi - lo)) {
+      continue;
+    }
+    for (jj = lo; cur[jj - pg_addr] == expect[jj - addr]; jj++) {
+    }
+    snprintf(err_msg, msg_size,
+             "Flash verification failed at 0x%x: "
+             "flash data 0x%x != image data 0x%x",
+             jj, cur[jj - pg_addr], expect[jj - addr]);
+    FPRINTF(stderr, "%s\n", err_msg);
+    /* Leave the controller idle; the next page is already on its way */
+    if (pg + 1 < end_pg) {
+      char scratch[64];
+
+      sjtag_page_read_finish(cfi, buf[(pg + 1) & 1], page_size, scratch,
+                             sizeof(scratch));
+    }
+    rc = EFAULT;
+  }
+
+  if (stats) {
+    stats->verify_bytes += len;
+    stats->verify_usec += sjtag_now_usec() - t0;
+  }
+  return rc;
+}
+
+/*
+ * Write one page unless it is blank; the sector has been erased, so an
+ * all 0xFF page is already in place. With SPIFLASH_VERIFY_INLINE the page
+ * is read back as soon as the write completes, blank or not.
+ */
+static uint8_t sjtag_page_write_nonblank(spi_cfi_t *cfi, uint32_t addr,
+                                         uint8_t *data, uint16_t data_len,
+                                         sjtag_program_stats_t *stats,
+                                         char *err_msg, uint32_t msg_size) {
+  uint8_t rc = 0;
+
+  if (sjtag_buf_is_blank(data, data_len)) {
+    if (stats) {
+      stats->pages_blank++;
+    }
+  } else {
+    if (stats) {
+      stats->pages++;
+      stats->program_bytes += data_len;
+    }
+    rc = sjtag_page_write(cfi, addr, data, data_len, err_msg, msg_size);
+  }
+  if (rc == 0 && cfi->verify_flag == SPIFLASH_VERIFY_INLINE) {
+    rc = sjtag_verify_range(cfi, addr, data, data_len, stats, err_msg,
+                            msg_size);
+  }
+  return rc;
+}
+
+/*
+ * Throughput in MB/s of len bytes moved in usec
+ */
+static double sjtag_mbps(uint64_t len, uint64_t usec) {
+  return usec ? (double)len / usec : 0;
+}
+
+static void sjtag_program_stats_print(const char *what,
+                                      const sjtag_program_stats_t *stats) {
+  printf("%s: %u sectors, %u programmed, %u already blank; "
+         "%u pages written, %u blank pages skipped\n",
+         what, stats->sectors, stats->sectors_written, stats->sectors_blank,
+         stats->pages, stats->pages_blank);
+  printf("  read %llu ms, erase %llu ms, program %llu ms, verify %llu ms\n",
+         (unsigned long long)stats->read_usec / 1000,
+         (unsigned long long)stats->erase_usec / 1000,
+         (unsigned long long)stats->program_usec / 1000,
+         (unsigned long long)stats->verify_usec / 1000);
+  printf("  program %.2f MB/s, verify %.2f MB/s\n",
+         sjtag_mbps(stats->program_bytes, stats->program_usec),
+         sjtag_mbps(stats->verify_bytes, stats->verify_usec));
+}
+
 /*
  * Service routine to restore the pages erased as part of unaligned sector
  *
@@ -3076,8 +3785,8 @@ static uint8_t sjtag_flash_restore_unalign_sector_erase(
     /* Start point of written data */
     this_data = &first_sec_data[ii * page_size];
 
-    rc = sjtag_page_write(cfi, start_wr_addr, this_data, page_size, err_msg,
-                          msg_size);
+    rc = sjtag_page_write_nonblank(cfi, start_wr_addr, this_data, page_size,
+                                   NULL, err_msg, msg_size);
 
     if (rc != 0) {
       FPRINTF(stderr,
@@ -3103,8 +3812,8 @@ static uint8_t sjtag_flash_restore_unalign_sector_erase(
     /* Start point of written data */
     this_data = &last_sec_data[ii * page_size];
 
-    rc = sjtag_page_write(cfi, start_wr_addr, this_data, page_size, err_msg,
-                          msg_size);
+    rc = sjtag_page_write_nonblank(cfi, start_wr_addr, this_data, page_size,
+                                   NULL, err_msg, msg_size);
 
     if (rc != 0) {
       FPRINTF(stderr,
@@ -3251,6 +3960,7 @@ static uint8_t sjtag_flash_program_init(spi_cfi_t *cfi, uint32_t addr,
  */
 static uint8_t sjtag_erase(spi_cfi_t *cfi, uint32_t addr, uint32_t data_len,
                            char *err_msg, uint32_t msg_size) {
+  sjtag_ctx_t *ctx = sjtag_cfi_ctx(cfi);
   uint8_t rc = 0;
   uint8_t flash_wr_ena = 0;
   uint32_t ii;
@@ -3299,25 +4009,11 @@ static uint8_t sjtag_erase(spi_cfi_t *cfi, uint32_t addr, uint32_t data_len,
   /* A segment of data_len, start at addr are within these sectors */
   sjtag_segment_range(addr, data_len, sector_size, &start_sec, &end_sec);
 
-  /*
-   * Check whether Bank Read/Write Register opcodes are valid and
-   * non-zero values. If yes, proceed with Bank Address Write
-   * Register otherwise skip writing to Bank Address Register
-   * (addr >> 24) - write 4 byte value to Bank register and
-   * 3 bytes to addr opcode register
-   */
-  if (cfi->wr_ear && cfi->rd_ear) {
-    rc = sjtag_spi_write_bank_addr(cfi, (addr >> 24), err_msg, msg_size);
-    if (rc != 0) {
-      FPRINTF(stderr, "fail to set bank addr: [%s]\n", err_msg);
-      return rc;
-    }
-
-    rc = sjtag_spi_read_bank_addr(cfi, (addr >> 24), err_msg, msg_size);
-    if (rc != 0) {
-      FPRINTF(stderr, "bank addr mismatch, [%s]\n", err_msg);
-      return rc;
-    }
+  /* Point the flash at the 16MB bank of addr, if it has to be */
+  rc = sjtag_spi_select_bank(cfi, addr, err_msg, msg_size);
+  if (rc != 0) {
+    FPRINTF(stderr, "fail to set bank addr [%s]\n", err_msg);
+    return rc;
   }
 
   rc = spiflash_prepare_spi_command(cfi, SPIFLASH_OPER_ERASE_MEM, &cmd, err_msg,
@@ -3353,7 +4049,7 @@ static uint8_t sjtag_erase(spi_cfi_t *cfi, uint32_t addr, uint32_t data_len,
     }
 
     /* Set opcode and register address */
-    rc = sjtag_op_addr_reg_set(cmd.opcode,
+    rc = sjtag_op_addr_reg_set(ctx, cmd.opcode,
                                (ii * sector_size), /* SPI Flash Addr */
                                err_msg, msg_size);
     if (rc != 0) {
@@ -3370,7 +4066,7 @@ static uint8_t sjtag_erase(spi_cfi_t *cfi, uint32_t addr, uint32_t data_len,
     }
 
     /* Check for sjtag FPGA Block transaction complete */
-    rc = sjtag_wait_until_transaction_complete(cfi->spi_delay_factor, err_msg,
+    rc = sjtag_wait_until_transaction_complete(ctx, cfi->spi_delay_factor, err_msg,
                                                msg_size);
 
     if (rc != 0) {
@@ -3422,16 +4118,19 @@ clean_exit:
  *  data_len  - Length in bytes
  *  cb_ctx    - context for program progress callback
  *  program_progress_cb - callback function pointer for program progress
+ *  stats     - Accumulated sector and timing counts, may be NULL
  *  err_msg   - Error message buffer
  *  msg_size  - Error message buffer size
  *
+ * Sectors that already read back blank are not erased again.
+ *
  * Returns 0 when SPI Flash memory erased
  *  otherwise - error code with message
  */
 static uint8_t sjtag_flash_program_erase(
     spi_cfi_t *cfi, uint32_t addr, uint32_t data_len, void *cb_ctx,
-    void (*program_progress_cb)(void *cb_ctx, uint8_t percent), char *err_msg,
-    uint32_t msg_size) {
+    void (*program_progress_cb)(void *cb_ctx, uint8_t percent),
+    sjtag_program_stats_t *stats, char *err_msg, uint32_t msg_size) {
   uint8_t rc = 0;
   uint32_t sector_size;
   uint32_t start_sec;
@@ -3449,6 +4148,8 @@ static uint8_t sjtag_flash_program_erase(
   uint32_t erase_size_on_last_sec = 0;
   uint32_t idx = 0;
   uint8_t unaligned_sector = 0;
+  uint64_t t0, t1;
+  int blank;
 
   printf("Start erase SPI flash all sectors...\n");
   if (!cfi) {
@@ -3571,14 +4272,8 @@ static uint8_t sjtag_flash_program_erase(
   for (ii = start_sec; ii < end_sec; ii++) {
     start_wr_addr = ii * sector_size;
 
-    rc = sjtag_erase(cfi, start_wr_addr, sector_size, err_msg, msg_size);
-
-    if (rc != 0) {
-      FPRINTF(stderr, "Failed to Erase sector %d sector_size %d [%s]\n", ii,
-              sector_size, err_msg);
-      goto clean_exit;
-    }
-
+    /* A sector that already reads blank needs no erase */
+    t0 = sjtag_now_usec();
     rc = sjtag_read(cfi, start_wr_addr, wdata, sector_size, err_msg, msg_size);
 
     if (rc != 0) {
@@ -3586,27 +4281,58 @@ static uint8_t sjtag_flash_program_erase(
               sector_size, err_msg);
       goto clean_exit;
     }
+    blank = sjtag_buf_is_blank(wdata, sector_size);
+    t1 = sjtag_now_usec();
+    if (stats) {
+      stats->sectors++;
+      stats->sectors_blank += blank;
+      stats->read_usec += t1 - t0;
+    }
+
+    if (!blank) {
+      rc = sjtag_erase(cfi, start_wr_addr, sector_size, err_msg, msg_size);
+
+      if (rc != 0) {
+        FPRINTF(stderr, "Failed to Erase sector %d sector_size %d [%s]\n", ii,
+                sector_size, err_msg);
+        goto clean_exit;
+      }
+
+      rc = sjtag_read(cfi, start_wr_addr, wdata, sector_size, err_msg, msg_size);
+
+      if (rc != 0) {
+        FPRINTF(stderr, "Failed to Read sector %d sector_size %d [%s]\n", ii,
+                sector_size, err_msg);
+        goto clean_exit;
+      }
 
 #ifdef DEBUG
-    sjtag_dump_data("AFTER ERASE: SPI Flash Memory read", addr, wdata,
-                    sector_size);
+      sjtag_dump_data("AFTER ERASE: SPI Flash Memory read", addr, wdata,
+                      sector_size);
 #endif
 
-    /* Verification--Read back and compare to FF */
-    for (jj = 0, sum_err = 0; jj < sector_size; jj++) {
-      if (wdata[jj] != 0xFF) {
-        sum_err++;
+      /* Verification--Read back and compare to FF */
+      for (jj = 0, sum_err = 0; jj < sector_size; jj++) {
+        if (wdata[jj] != 0xFF) {
+          sum_err++;
+        }
       }
-    }
 
-    if (sum_err) {
-      snprintf(err_msg, msg_size,
-               "Could not ERASE sector %d sector_size 0x%x - there are "
-               "%d errors",
-               ii, sector_size, sum_err);
-      FPRINTF(stderr, "%s\n", err_msg);
-      rc = EFAULT;
-      goto clean_exit;
+      if (sum_err) {
+        snprintf(err_msg, msg_size,
+                 "Could not ERASE sector %d sector_size 0x%x - there are "
+                 "%d errors",
+                 ii, sector_size, sum_err);
+        FPRINTF(stderr, "%s\n", err_msg);
+        rc = EFAULT;
+        goto clean_exit;
+      }
+      if (stats) {
+        stats->erase_usec += sjtag_now_usec() - t1;
+      }
+    }
+    if (stats) {
+      sjtag_progress_add(stats->progress, sector_size);
     }
 
     if (program_progress_cb) {
@@ -3666,17 +4392,20 @@ clean_exit:
  *  save_data1 - pointer to saved last secotor data
  *  cb_ctx     - context for program progress callback
  *  program_progress_cb - callback function pointer for program progress
+ *  stats      - Accumulated sector and page counts, may be NULL
  *  err_msg    - Error message buffer
  *  msg_size   - Error message buffer size
  *
+ * Pages that are all 0xFF are skipped, the erase already left them so.
+ *
  * Returns 0 when SPI Flash memory programmed
  *  otherwise - error code with message
  */
 static uint8_t sjtag_flash_program_do(
     spi_cfi_t *cfi, uint32_t addr, uint8_t *data, uint32_t data_len,
     uint8_t *save_data0, uint8_t *save_data1, void *cb_ctx,
-    void (*program_progress_cb)(void *cb_ctx, uint8_t percent), char *err_msg,
-    uint32_t msg_size) {
+    void (*program_progress_cb)(void *cb_ctx, uint8_t percent),
+    sjtag_program_stats_t *stats, char *err_msg, uint32_t msg_size) {
   uint8_t rc = 0;
   uint32_t sector_size;
   uint32_t start_sec;
@@ -3810,8 +4539,8 @@ static uint8_t sjtag_flash_program_do(
     /* Start point of written data */
     this_data = &wdata[ii * page_size];
 
-    rc = sjtag_page_write(cfi, start_wr_addr, this_data, page_size, err_msg,
-                          msg_size);
+    rc = sjtag_page_write_nonblank(cfi, start_wr_addr, this_data, page_size,
+                                   stats, err_msg, msg_size);
 
     if (rc != 0) {
       FPRINTF(stderr,
@@ -3865,8 +4594,8 @@ static uint8_t sjtag_flash_program_do(
       start_wr_addr = jj * sector_size + ii * page_size;
       this_data = &wdata[ii * page_size]; /* Starting write addr */
 
-      rc = sjtag_page_write(cfi, start_wr_addr, this_data, page_size, err_msg,
-                            msg_size);
+      rc = sjtag_page_write_nonblank(cfi, start_wr_addr, this_data, page_size,
+                                     stats, err_msg, msg_size);
 
       if (rc != 0) {
         FPRINTF(stderr,
@@ -3937,8 +4666,8 @@ static uint8_t sjtag_flash_program_do(
     start_wr_addr = (end_sec - 1) * sector_size + ii * page_size;
     this_data = &wdata[ii * page_size]; /* Start point of written data */
 
-    rc = sjtag_page_write(cfi, start_wr_addr, this_data, page_size, err_msg,
-                          msg_size);
+    rc = sjtag_page_write_nonblank(cfi, start_wr_addr, this_data, page_size,
+                                   stats, err_msg, msg_size);
 
     if (rc != 0) {
       FPRINTF(stderr,
@@ -3968,6 +4697,9 @@ static uint8_t sjtag_flash_program_do(
   /** DONE -- Handle last sector **/
 
 done:
+  if (stats) {
+    stats->sectors_written += end_sec - start_sec;
+  }
   printf("Success to SPI flash program all sectors "
          "addr 0x%x data_len 0x%x\n",
           addr, data_len);
@@ -3987,6 +4719,7 @@ done:
  *  data_len  - Length in bytes
  *  cb_ctx    - context for program progress callback
  *  program_progress_cb - callback function pointer for program progress
+ *  stats     - Accumulated verify bytes and time, may be NULL
  *  err_msg   - Error message buffer
  *  msg_size  - Error message buffer size
  *
@@ -3996,23 +4729,13 @@ done:
 static uint8_t sjtag_flash_program_verify(
     spi_cfi_t *cfi, uint32_t addr, uint8_t *data, uint32_t data_len,
     void *cb_ctx, void (*program_progress_cb)(void *cb_ctx, uint8_t percent),
-    char *err_msg, uint32_t msg_size) {
+    sjtag_program_stats_t *stats, char *err_msg, uint32_t msg_size) {
   uint8_t rc = 0;
   uint32_t sector_size;
   uint32_t start_sec;
   uint32_t end_sec;
-  uint32_t start_rd_addr;
-  uint32_t page_size;
-  uint32_t start_idx = 0;
-  uint32_t end_idx = 0;
-  uint32_t i_align_idx = 0;
-  uint8_t wdata[IOFPGA_SPI_MAX_SECTOR_SIZE];
-  uint8_t *this_data;
-  uint32_t this_size;
-  uint32_t start_this;
-  uint32_t end_this;
-  uint32_t ii, jj;
-  uint32_t sum_err;
+  uint32_t lo, hi;
+  uint32_t ii;
   uint32_t num_sec_report_prog;
 
   printf("SPI flash verification start...\n");
@@ -4049,22 +4772,6 @@ static uint8_t sjtag_flash_program_verify(
   /* A segment of size data_len, start at addr are within these sectors */
   sjtag_segment_range(addr, data_len, sector_size, &start_sec, &end_sec);
 
-  page_size = cfi->page_size;
-
-  if (page_size == 0 || page_size > IOFPGA_SJTAG_PAGE_SIZE) {
-    snprintf(err_msg, msg_size,
-             "Internal SW can't handle page_size %d "
-             "bigger than expected %d",
-             page_size, IOFPGA_SJTAG_PAGE_SIZE);
-    FPRINTF(stderr, "%s\n", err_msg);
-    return (EINVAL);
-  }
-
-  /* Need to verify all sectors */
-  this_size = sector_size;
-  start_this = start_sec;
-  end_this = end_sec;
-
   num_sec_report_prog = (end_sec - start_sec) / (SPI_PROGRAM_VERIFY_PERCENT /
                                                  SPI_PROGRAM_REPORT_INTERVAL);
   if (((end_sec - start_sec) %
@@ -4073,117 +4780,22 @@ static uint8_t sjtag_flash_program_verify(
   }
 
   /*
-   * Read and verify all target segments (pages or sectors). Stop on error
+   * Read back and compare the part of each sector covered by the segment.
+   * Stop on the first mismatch.
    */
-  this_data = (uint8_t *)data; // Original input buffer
-
-  for (ii = start_this; ii < end_this; ii++) {
-    start_rd_addr = ii * this_size;
-
-    rc = sjtag_read(cfi, start_rd_addr, wdata, this_size, err_msg, msg_size);
+  for (ii = start_sec; ii < end_sec; ii++) {
+    lo = addr > ii * sector_size ? addr : ii * sector_size;
+    hi = (addr + data_len) < (ii + 1) * sector_size ? (addr + data_len)
+                                                    : (ii + 1) * sector_size;
 
+    rc = sjtag_verify_range(cfi, lo, data + (lo - addr), hi - lo, stats,
+                            err_msg, msg_size);
     if (rc != 0) {
-      FPRINTF(stderr, "Failed to Read sector %d sector_size %d [%s]\n", ii,
+      FPRINTF(stderr, "Failed to verify sector %d sector_size %d [%s]\n", ii,
               sector_size, err_msg);
       return rc;
     }
 
-    /*
-     * Verification -- Read back and compare with original input
-     */
-
-    /* Handle first segment */
-    if (ii == start_this) {
-      start_idx = (addr % this_size);
-      end_idx = (addr % this_size) + data_len;
-
-      if (end_idx > this_size) {
-        end_idx = this_size;
-      }
-
-      i_align_idx = end_idx - start_idx; // track for alignment
-
-      for (jj = start_idx, sum_err = 0; jj < end_idx; jj++) {
-        if (wdata[jj] != this_data[jj - start_idx]) {
-          sum_err++;
-          FPRINTF(stderr,
-                  "Verification failed at first "
-                  "sector %d size %d idx %d Flash data 0x%x != "
-                  "Actual data 0x%x\n",
-                  ii, this_size, jj, wdata[jj], this_data[jj - start_idx]);
-          break;
-        }
-      }
-
-      if (sum_err) {
-        snprintf(err_msg, msg_size,
-                 "Program verification failed at first sector %d "
-                 "sector_size %d - there are %d errors",
-                 ii, sector_size, sum_err);
-        FPRINTF(stderr, "%s\n", err_msg);
-        return (EFAULT);
-      }
-
-      /* Special case: "addr"+"data_len" is in only 1 segment */
-      if ((end_this - start_this) == 1) {
-        rc = 0;
-        goto done;
-      }
-
-    } else if (ii == (end_this - 1)) { /** Handle last sector **/
-      start_idx = 0;
-      end_idx = (addr + data_len) % this_size;
-
-      for (jj = start_idx, sum_err = 0; jj < end_idx; jj++) {
-        if (wdata[jj] != this_data[(end_this - start_this - 2) * this_size +
-                                   i_align_idx + jj]) {
-          sum_err++;
-          FPRINTF(stderr,
-                  "Verification failed at "
-                  "last sector %d size %d idx %d Flash data 0x%x != "
-                  "Actual data 0x%x\n",
-                  ii, this_size, jj, wdata[jj],
-                  this_data[(end_this - start_this - 2) * this_size +
-                            i_align_idx + jj]);
-          break;
-        }
-      }
-      if (sum_err) {
-        snprintf(err_msg, msg_size,
-                 "Program verification failed at last sector %d "
-                 "sector_size %d - there are %d errors",
-                 ii, sector_size, sum_err);
-        FPRINTF(stderr, "%s\n", err_msg);
-        return (EFAULT);
-      }
-    } else { /** Handle all middle sectors **/
-      start_idx = 0;
-      end_idx = this_size;
-      for (jj = start_idx, sum_err = 0; jj < end_idx; jj++) {
-        if (wdata[jj] !=
-            this_data[(ii - start_this - 1) * this_size + i_align_idx + jj]) {
-          sum_err++;
-          FPRINTF(
-              stderr,
-              "Verification failed at middle"
-              " sector %d size %d idx %d Flash data 0x%x != "
-              "Actual data 0x%x\n",
-              ii, this_size, jj, wdata[jj],
-              this_data[(ii - start_this - 1) * this_size + i_align_idx + jj]);
-          break;
-        }
-      }
-
-      if (sum_err) {
-        snprintf(err_msg, msg_size,
-                 "Program verification failed at middle sector %d "
-                 "sector_size %d - there are %d errors",
-                 ii, sector_size, sum_err);
-        FPRINTF(stderr, "%s\n", err_msg);
-        return (EFAULT);
-      }
-    }
-
     if (program_progress_cb) {
 
       if (ii == (end_sec - 1)) {
@@ -4202,7 +4814,6 @@ static uint8_t sjtag_flash_program_verify(
     }
   }
 
-done:
   printf("Success to SPI flash verify all sectors "
          "addr 0x%x data_len 0x%x\n",
           addr, data_len);
@@ -4219,6 +4830,8 @@ done:
  *  data_len - Length of data in bytes to read
  *  cb_ctx   - context for program progress callback
  *  program_progress_cb - callback function pointer for program progress
+ *  stats    - Accumulated sector, page and per phase timing counts,
+ *             may be NULL
  *  err_msg  - Error message buffer
  *  msg_size - Error message buffer size
  *
@@ -4231,8 +4844,10 @@ done:
 static uint8_t fpgalib_sjtag_flash_program_operation(
     spi_cfi_t *cfi, uint32_t addr, uint8_t *data, uint32_t data_len,
     void *cb_ctx, void (*program_progress_cb)(void *cb_ctx, uint8_t percent),
-    char *err_msg, uint32_t msg_size) {
+    sjtag_program_stats_t *stats, char *err_msg, uint32_t msg_size) {
   uint8_t rc = 0;
+  uint64_t t0 = sjtag_now_usec();
+  uint64_t verify_usec;
 
   /* Hold 1st original sector data */
   uint8_t *save_data0_ptr = NULL;
@@ -4309,12 +4924,15 @@ static uint8_t fpgalib_sjtag_flash_program_operation(
             err_msg);
     goto clean_exit;
   }
+  if (stats) {
+    stats->read_usec += sjtag_now_usec() - t0;
+  }
 
   /*
    * Erase and verify all sectors. Stop on error
    */
   rc = sjtag_flash_program_erase(cfi, addr, data_len, cb_ctx,
-                                 program_progress_cb, err_msg, msg_size);
+                                 program_progress_cb, stats, err_msg, msg_size);
 
   if (rc != 0) {
     FPRINTF(stderr, "Failed to Erase SPI Flash Memory to rogram %s\n", err_msg);
@@ -4324,9 +4942,16 @@ static uint8_t fpgalib_sjtag_flash_program_operation(
   /*
    * Program SPI Flash Memory after merging new data with buffered data
    */
+  t0 = sjtag_now_usec();
+  verify_usec = stats ? stats->verify_usec : 0;
   rc = sjtag_flash_program_do(cfi, addr, data, data_len, save_data0_ptr,
                               save_data1_ptr, cb_ctx, program_progress_cb,
-                              err_msg, msg_size);
+                              stats, err_msg, msg_size);
+  if (stats) {
+    /* less the time of any inline read back */
+    stats->program_usec += sjtag_now_usec() - t0 -
+                           (stats->verify_usec - verify_usec);
+  }
 
   if (rc != 0) {
     FPRINTF(stderr, "Failed to Program new data into SPI Flash Memory %s\n",
@@ -4337,9 +4962,10 @@ static uint8_t fpgalib_sjtag_flash_program_operation(
   /*
    * Verify the new data
    */
-  if (cfi->verify_flag) {
+  if (cfi->verify_flag == SPIFLASH_VERIFY_PASS) {
     rc = sjtag_flash_program_verify(cfi, addr, data, data_len, cb_ctx,
-                                    program_progress_cb, err_msg, msg_size);
+                                    program_progress_cb, stats, err_msg,
+                                    msg_size);
     if (rc != 0) {
       FPRINTF(stderr,
               "Verification failed to program "
@@ -4366,24 +4992,410 @@ clean_exit:
   return rc;
 }
 
-int iofpga_image_write(char *image_path, uint32_t fpga_image_offset, uint32_t fpga_image_size,
+/*
+ * Differential version of fpgalib_sjtag_flash_program_operation().
+ * INPUT:
+ *  cfi      - SPI Common Flash Interface Data
+ *  addr     - SPI Flash memory Address
+ *  data     - pointer to data that need to be written info SPI Flash
+ *  data_len - Length of data in bytes
+ *  stats    - Accumulated sector, page and per phase timing counts
+ *  err_msg  - Error message buffer
+ *  msg_size - Error message buffer size
+ *
+ * Every sector touched by the segment is read back and merged with the new
+ * data. Sectors that already hold the new data are left alone; only the
+ * others are erased (unless they read blank), programmed skipping all 0xFF
+ * pages, and verified if the part asks for it. Bytes outside the segment
+ * are restored from the read back copy, so the segment does not have to be
+ * sector aligned. With stats->erased the flash is taken to be blank and
+ * nothing is read back.
+ *
+ * Returns 0 when SPI Flash Memory Program success
+ *  otherwise - error code with message
+ */
+static uint8_t sjtag_flash_program_diff(spi_cfi_t *cfi, uint32_t addr,
+                                        uint8_t *data, uint32_t data_len,
+                                        sjtag_program_stats_t *stats,
+                                        char *err_msg, uint32_t msg_size) {
+  uint8_t rc = 0;
+  uint8_t *flash_data = NULL;
+  uint8_t *new_data = NULL;
+  uint32_t sector_size;
+  uint32_t page_size;
+  uint32_t start_sec;
+  uint32_t end_sec;
+  uint32_t sec_addr, lo, hi;
+  uint32_t ii, pg;
+  uint64_t t0, t1, verify_usec;
+
+  if (!data) {
+    snprintf(err_msg, msg_size, "data - NULL ptr");
+    return EINVAL;
+  }
+
+  sector_size = cfi->sector_size;
+  if (sector_size == 0 || sector_size > IOFPGA_SPI_MAX_SECTOR_SIZE) {
+    snprintf(err_msg, msg_size,
+             "Internal SW cann't handle sector_size %d "
+             "bigger than expected %d",
+             sector_size, IOFPGA_SPI_MAX_SECTOR_SIZE);
+    return (EINVAL);
+  }
+  page_size = cfi->page_size;
+  if (page_size == 0 || page_size > IOFPGA_SJTAG_PAGE_SIZE ||
+      sector_size % page_size) {
+    snprintf(err_msg, msg_size,
+             "Internal SW can't handle page_size %d "
+             "bigger than expected %d",
+             page_size, IOFPGA_SJTAG_PAGE_SIZE);
+    return (EINVAL);
+  }
+
+  flash_data = malloc(sector_size);
+  new_data = malloc(sector_size);
+  if (!flash_data || !new_data) {
+    snprintf(err_msg, msg_size,
+             "SPI Flash Memory PROGRAM operation "
+             "failed to allocate memory [%s]",
+             strerror(errno));
+    rc = ENOMEM;
+    goto clean_exit;
+  }
+
+  sjtag_segment_range(addr, data_len, sector_size, &start_sec, &end_sec);
+
+  for (ii = start_sec; ii < end_sec; ii++) {
+    sec_addr = ii * sector_size;
+    lo = addr > sec_addr ? addr : sec_addr;
+    hi = (addr + data_len) < (sec_addr + sector_size) ? (addr + data_len)
+                                                      : (sec_addr + sector_size);
+
+    t0 = sjtag_now_usec();
+    if (stats->erased) {
+      memset(flash_data, 0xFF, sector_size);
+    } else {
+      rc = sjtag_read(cfi, sec_addr, flash_data, sector_size, err_msg,
+                      msg_size);
+      if (rc != 0) {
+        FPRINTF(stderr, "Failed to Read sector %d sector_size %d [%s]\n", ii,
+                sector_size, err_msg);
+        goto clean_exit;
+      }
+    }
+    stats->sectors++;
+    if (!memcmp(flash_data + (lo - sec_addr), data + (lo - addr), hi - lo)) {
+      stats->read_usec += sjtag_now_usec() - t0;
+      sjtag_progress_add(stats->progress, hi - lo);
+      if (hi == sec_addr + sector_size) {
+        sjtag_journal_sector_done(stats, ii);
+      }
+      sjtag_rate_limit(stats, hi - lo);
+      continue;
+    }
+    memcpy(new_data, flash_data, sector_size);
+    memcpy(new_data + (lo - sec_addr), data + (lo - addr), hi - lo);
+    t1 = sjtag_now_usec();
+    stats->read_usec += t1 - t0;
+
+    if (sjtag_buf_is_blank(flash_data, sector_size)) {
+      stats->sectors_blank++;
+    } else {
+      rc = sjtag_erase(cfi, sec_addr, sector_size, err_msg, msg_size);
+      if (rc != 0) {
+        FPRINTF(stderr, "Failed to Erase sector %d sector_size %d [%s]\n", ii,
+                sector_size, err_msg);
+        goto clean_exit;
+      }
+    }
+    t0 = sjtag_now_usec();
+    stats->erase_usec += t0 - t1;
+    verify_usec = stats->verify_usec;
+
+    for (pg = 0; pg < sector_size; pg += page_size) {
+      rc = sjtag_page_write_nonblank(cfi, sec_addr + pg, new_data + pg,
+                                     page_size, stats, err_msg, msg_size);
+      if (rc != 0) {
+        FPRINTF(stderr,
+                "Failed to program sector %d page offset 0x%x [%s]\n", ii,
+                pg, err_msg);
+        goto clean_exit;
+      }
+    }
+    stats->program_usec += sjtag_now_usec() - t0 -
+                           (stats->verify_usec - verify_usec);
+
+    if (cfi->verify_flag == SPIFLASH_VERIFY_PASS) {
+      rc = sjtag_verify_range(cfi, sec_addr, new_data, sector_size, stats,
+                              err_msg, msg_size);
+      if (rc != 0) {
+        FPRINTF(stderr, "Failed to verify sector %d sector_size %d [%s]\n",
+                ii, sector_size, err_msg);
+        goto clean_exit;
+      }
+    }
+    stats->sectors_written++;
+    sjtag_progress_add(stats->progress, hi - lo);
+    /* A sector the segment ends inside is only done with the next one */
+    if (hi == sec_addr + sector_size) {
+      sjtag_journal_sector_done(stats, ii);
+    }
+    sjtag_rate_limit(stats, hi - lo);
+  }
+
+clean_exit:
+  free(flash_data);
+  free(new_data);
+  return rc;
+}
+
+static void sjtag_diff_stats_print(const sjtag_program_stats_t *stats,
+                                   uint32_t sector_size) {
+  uint32_t skipped = stats->sectors - stats->sectors_written;
+  uint64_t write_usec =
+      stats->erase_usec + stats->program_usec + stats->verify_usec;
+
+  sjtag_program_stats_print("Image program", stats);
+  printf("  %llu bytes written",
+         (unsigned long long)stats->sectors_written * sector_size);
+  /* Price the skipped sectors at what the rewritten ones cost */
+  if (stats->sectors_written) {
+    printf(", %u unchanged sectors skipped, about %llu ms saved", skipped,
+           (unsigned long long)(write_usec / stats->sectors_written *
+                                skipped / 1000));
+  }
+  printf("\n");
+}
+
+/*
+ * Program a compressed image payload as it is inflated.
+ * INPUT:
+ *  cfi      - SPI Common Flash Interface Data
+ *  addr     - SPI Flash memory Address of the image
+ *  meta     - Image description from get_data_info()
+ *  skip     - Bytes at the start of the payload already on the flash
+ *  stats    - Accumulated sector and timing counts
+ *  err_msg  - Error message buffer
+ *  msg_size - Error message buffer size
+ *
+ * Each inflate window is a whole number of maximum size sectors, so the
+ * windows line up with the erase granularity and only one window has to
+ * be resident at a time.
+ *
+ * Returns 0 when SPI Flash Memory Program success
+ *  otherwise - error code with message
+ */
+static uint8_t sjtag_flash_program_stream(spi_cfi_t *cfi, uint32_t addr,
+                                          fpd_meta_info_t *meta, uint32_t skip,
+                                          sjtag_program_stats_t *stats,
+                                          char *err_msg, uint32_t msg_size) {
+  fpd_img_stream_t *stream;
+  const void *chunk;
+  uint32_t len;
+  uint32_t offset = 0;
+  int rc;
+
+  rc = fpd_img_stream_open(meta, IOFPGA_SPI_MAX_SECTOR_SIZE, &stream,
+                           err_msg, msg_size);
+  if (rc) {
+    return rc;
+  }
+  for (;;) {
+    uint64_t t0 = sjtag_now_usec();
+
+    rc = fpd_img_stream_next(stream, &chunk, &len, err_msg, msg_size);
+    stats->inflate_usec += sjtag_now_usec() - t0;
+    if (rc || !len) {
+      break;
+    }
+    /* Payload before skip is already on the flash, only inflate it */
+    if (offset + len <= skip) {
+      offset += len;
+      continue;
+    }
+    if (offset < skip) {
+      chunk = (const uint8_t *)chunk + (skip - offset);
+      len -= skip - offset;
+      offset = skip;
+    }
+    rc = sjtag_flash_program_diff(cfi, addr + offset, (uint8_t *)chunk, len,
+                                  stats, err_msg, msg_size);
+    if (rc) {
+      break;
+    }
+    offset += len;
+  }
+  fpd_img_stream_close(stream);
+  return rc;
+}
+
+/*
+ * Flash read per sjtag_read() call when an image is read back: long
+ * enough to keep the burst pipeline busy, short enough to report
+ * progress a few times a second.
+ */
+#define IOFPGA_READBACK_CHUNK   (256 * 1024)
+
+/*
+ * MD5 of len bytes of flash at addr
+ */
+static int
+iofpga_flash_digest(sjtag_ctx_t *ctx, uint32_t addr, uint32_t len,
+                    uint8_t digest[MAX_MD5_DIGEST], sjtag_progress_t *progress)
+{
+    EVP_MD_CTX *md = EVP_MD_CTX_new();
+    uint8_t *buf = malloc(IOFPGA_READBACK_CHUNK);
+    uint32_t done, chunk;
+    int rc = 0;
+
+    if (!md || !buf || !EVP_DigestInit_ex(md, EVP_md5(), NULL)) {
+        snprintf(ctx->err_msg, sizeof(ctx->err_msg), "no memory for md5");
+        rc = ENOMEM;
+    }
+    for (done = 0; !rc && done < len; done += chunk) {
+        chunk = len - done < IOFPGA_READBACK_CHUNK ? len - done
+                                                   : IOFPGA_READBACK_CHUNK;
+        rc = sjtag_read(&ctx->cfi, addr + done, buf, chunk, ctx->err_msg,
+                        sizeof(ctx->err_msg));
+        if (!rc) {
+            EVP_DigestUpdate(md, buf, chunk);
+            sjtag_progress_add(progress, chunk);
+        }
+    }
+    if (!rc) {
+        EVP_DigestFinal_ex(md, digest, NULL);
+    }
+    EVP_MD_CTX_free(md);
+    free(buf);
+    return rc;
+}
+
+/*
+ * Byte compare the flash at addr with the first size bytes of the payload
+ * of meta, inflated on the way if it is compressed
+ */
+static int
+iofpga_flash_compare(sjtag_ctx_t *ctx, uint32_t addr, fpd_meta_info_t *meta,
+                     uint32_t size, sjtag_progress_t *progress)
+{
+    fpd_img_stream_t *stream;
+    const void *chunk;
+    uint32_t len, done = 0;
+    int rc;
+
+    rc = fpd_img_stream_open(meta, IOFPGA_READBACK_CHUNK, &stream,
+                             ctx->err_msg, sizeof(ctx->err_msg));
+    if (rc) {
+        return rc;
+    }
+    while (done < size &&
+           !(rc = fpd_img_stream_next(stream, &chunk, &len, ctx->err_msg,
+                                      sizeof(ctx->err_msg))) &&
+           len) {
+        if (len > size - done) {
+            len = size - done;
+        }
+        rc = sjtag_verify_range(&ctx->cfi, addr + done, chunk, len, NULL,
+                                ctx->err_msg, sizeof(ctx->err_msg));
+        if (rc) {
+            break;
+        }
+        sjtag_progress_add(progress, len);
+        done += len;
+    }
+    fpd_img_stream_close(stream);
+    return rc;
+}
+
+/*
+ * Check before a commit that the flash still holds the whole payload of
+ * meta at addr, as a stage of it left it; the journal alone only tells
+ * that the stage ran to the end. The payload is hashed against fw_md5
+ * when the image carries a verified one, else compared byte by byte.
+ *
+ * Returns 0 when the image is in place, EFAULT when the flash differs,
+ *  otherwise - error code with message
+ */
+static int
+iofpga_staged_check(sjtag_ctx_t *ctx, uint32_t addr, fpd_meta_info_t *meta,
+                    uint32_t size, bool has_md5, sjtag_progress_t *progress)
+{
+    uint8_t digest[MAX_MD5_DIGEST];
+    int rc;
+
+    progress->cur.block_name = ctx->block_name;
+    sjtag_progress_begin(progress, "verify", size);
+    if (!has_md5) {
+        return iofpga_flash_compare(ctx, addr, meta, size, progress);
+    }
+    rc = iofpga_flash_digest(ctx, addr, size, digest, progress);
+    if (rc == 0 && memcmp(digest, meta->md5, MAX_MD5_DIGEST)) {
+        snprintf(ctx->err_msg, sizeof(ctx->err_msg),
+                 "md5 of the flash at 0x%x does not match the image", addr);
+        rc = EFAULT;
+    }
+    return rc;
+}
+
+/*
+ * How iofpga_image_write() goes about an image. A stage writes and
+ * verifies the image but leaves the metadata erased, so the region does
+ * not boot yet; the commit that follows reads the whole staged image
+ * back and only then writes the metadata.
+ */
+typedef enum iofpga_write_mode_ {
+  IOFPGA_WRITE_PROGRAM,
+  IOFPGA_WRITE_STAGE,
+  IOFPGA_WRITE_COMMIT,
+} iofpga_write_mode_t;
+
+typedef struct iofpga_write_opts_ {
+  iofpga_write_mode_t mode;
+  uint32_t rate_kbs;            /* image KB/s to stay under, 0 for no limit */
+  fpd_progress_cb_t progress_cb;
+  void *progress_ctx;
+} iofpga_write_opts_t;
+
+int iofpga_image_write(sjtag_ctx_t *ctx, const char *image_path,
+                       uint32_t fpga_image_offset, uint32_t fpga_image_size,
                        uint32_t metadata_offset, uint32_t metadata_size,
-                       char *err_msg, uint32_t msg_size) {
+                       const iofpga_write_opts_t *opts) {
+  spi_cfi_t *cfi = &ctx->cfi;
+  char *err_msg = ctx->err_msg;
+  uint32_t msg_size = sizeof(ctx->err_msg);
+  fpd_img_map_t map;
+  fpd_meta_info_t meta = {0};
+  sjtag_progress_t progress = {.cb = opts->progress_cb,
+                               .cb_ctx = opts->progress_ctx};
+  fpd_journal_t journal;
+  fpd_journal_rec_t jrec = {0};
+  sjtag_program_stats_t stats = {.progress = &progress,
+                                 .journal = &journal,
+                                 .rate_kbs = opts->rate_kbs};
   uint8_t *image, *mdata;
-  uint32_t image_size, mdata_size;
+  uint32_t image_size, mdata_size, payload_size;
+  uint32_t sectors_done, sectors_full, skip = 0;
+  bool digest_ok = false;
+  uint64_t t0 = sjtag_now_usec(), t1;
   // print fpd Version
   fpd_version_t fpd_version = {0};
 
   printf("Iofpga image write started...\n");
 
-  /* Extract and validate FPGA image and meta data */
-  uint8_t rc =
-      get_img_metadata(image_path, &image_size, (void **)&image, &mdata_size,
-                       (void **)&mdata, err_msg, msg_size);
-  if (rc) {
-    printf("get_img_metadata failed : [%s]\n", err_msg);
-    return -1;
+  /*
+   * Map FPGA image and meta data; both are programmed straight out of
+   * the page cache without an intermediate copy.
+   */
+  uint8_t rc = fpd_img_map(image_path, &map, err_msg, msg_size);
+  if (rc || !map.mdata) {
+    printf("fpd_img_map failed : [%s]\n", err_msg);
+    fpd_img_unmap(&map);
+    return rc ? rc : EINVAL;
   }
+  image = map.img;
+  image_size = map.img_size;
+  mdata = map.mdata;
+  mdata_size = map.mdata_size;
 
   // print the fpd version
   rc = fpd_mdata_get_fpd_version((void *)mdata, &fpd_version);
@@ -4396,81 +5408,251 @@ int iofpga_image_write(char *image_path, uint32_t fpga_image_offset, uint32_t fp
           metadata_offset, fpga_image_offset, mdata_size,
           image_size);
 
+  /*
+   * Check the payload against fw_md5 before touching the flash, so that a
+   * corrupt image never costs the running one. v1 images carry no digest.
+   */
+  if (get_data_info(mdata, &meta, err_msg, msg_size) == 0) {
+    meta.img_size = image_size;
+    rc = fpd_img_verify_digest(&meta, err_msg, msg_size);
+    if (rc == ENODATA) {
+      printf("Image carries no md5, skipping digest check\n");
+    } else if (rc) {
+      printf("Image digest check failed. err_msg %s\n", err_msg);
+      free(meta.pid_list);
+      free(meta.name_list);
+      fpd_img_unmap(&map);
+      return EBADMSG;
+    } else {
+      printf("Image md5 verified\n");
+      digest_ok = true;
+    }
+  }
+  stats.load_usec = sjtag_now_usec() - t0;
+
+  /*
+   * A journal left by an interrupted program of this same image tells
+   * how many sectors already hold it. Carry on from the last of them, so
+   * that it is read back and checked before anything new is written. The
+   * flash may have changed behind the journal since, so the sectors before
+   * it are read back too, and the image is programmed from the start when
+   * they no longer hold it.
+   */
+  payload_size = meta.compressed ? meta.img_msize : image_size;
+  /*
+   * The metadata carries the fw_md5 the payload was just checked against,
+   * so it identifies the whole image; only without one is it all hashed.
+   */
+  if (digest_ok) {
+    fpd_journal_digest(mdata, mdata_size, jrec.digest);
+  } else {
+    fpd_journal_digest(map.base, map.size, jrec.digest);
+  }
+  jrec.image_offset = fpga_image_offset;
+  jrec.image_size = payload_size;
+  jrec.mdata_offset = metadata_offset;
+  jrec.sector_size = cfi->sector_size;
+  sectors_done = fpd_journal_open(&journal, ctx->block_name, &jrec);
+  sectors_full = (fpga_image_offset + payload_size) / cfi->sector_size -
+                 fpga_image_offset / cfi->sector_size;
+  if (opts->mode == IOFPGA_WRITE_COMMIT && sectors_done < sectors_full) {
+    printf("Image is not staged, %u of %u sectors done\n", sectors_done,
+           sectors_full);
+    fpd_journal_close(&journal, false);
+    free(meta.pid_list);
+    free(meta.name_list);
+    fpd_img_unmap(&map);
+    return ENOENT;
+  }
+  if (opts->mode == IOFPGA_WRITE_COMMIT) {
+    rc = iofpga_staged_check(ctx, fpga_image_offset, &meta, payload_size,
+                             digest_ok, &progress);
+    if (rc) {
+      printf("Staged image check failed: %s\n", err_msg);
+      /* A stage the flash no longer holds is of no use to a retry */
+      fpd_journal_close(&journal, rc == EFAULT);
+      free(meta.pid_list);
+      free(meta.name_list);
+      fpd_img_unmap(&map);
+      return rc == EFAULT ? ENOENT : EIO;
+    }
+    sjtag_progress_end(&progress);
+    printf("Staged image verified\n");
+  } else if (sectors_done > 1) {
+    skip = (fpga_image_offset / cfi->sector_size + sectors_done - 1) *
+               cfi->sector_size - fpga_image_offset;
+    if (skip > payload_size) {
+      skip = 0;
+    } else {
+      printf("Resuming at sector %u from %s\n", sectors_done - 1,
+             journal.path);
+      progress.cur.block_name = ctx->block_name;
+      sjtag_progress_begin(&progress, "verify", skip);
+      t1 = sjtag_now_usec();
+      rc = iofpga_flash_compare(ctx, fpga_image_offset, &meta, skip,
+                                &progress);
+      stats.read_usec += sjtag_now_usec() - t1;
+      if (rc == EFAULT) {
+        printf("Journal does not match the flash (%s), programming the "
+               "whole image\n", err_msg);
+        fpd_journal_update(&journal, 0);
+        skip = 0;
+      } else if (rc) {
+        printf("Failed to read back the flash. err_msg %s\n", err_msg);
+        fpd_journal_close(&journal, false);
+        free(meta.pid_list);
+        free(meta.name_list);
+        fpd_img_unmap(&map);
+        return EIO;
+      }
+      sjtag_progress_end(&progress);
+    }
+  }
+
+  /*
+   * Right after erase_iofpga() of the range there is nothing to compare
+   * the image with, so skip reading the flash back. Whatever happens next
+   * writes the range, so the erase is used up either way.
+   */
+  stats.erased = skip == 0 && ctx->erased_size &&
+                 fpga_image_offset >= ctx->erased_offset &&
+                 (uint64_t)fpga_image_offset + payload_size <=
+                     (uint64_t)ctx->erased_offset + ctx->erased_size;
+  ctx->erased_size = 0;
+
   /* erase metadata */
   printf("Erase meta-data at offset: 0x%x\n", metadata_offset);
   // erase meta data
-  rc = sjtag_flash_program_erase(&cfi, metadata_offset, metadata_size, NULL, NULL, err_msg, msg_size);
+  rc = sjtag_flash_program_erase(cfi, metadata_offset, metadata_size, NULL, NULL, NULL, err_msg, msg_size);
   if (rc) {
     printf("Failed to erase spi flash at offset: 0x%x. err_msg %s\n", metadata_offset, err_msg);
-    return -1;
+    fpd_journal_close(&journal, false);
+    free(meta.pid_list);
+    free(meta.name_list);
+    fpd_img_unmap(&map);
+    return EIO;
   }
 
-  printf("Program image...\n");
+  /* A commit found the staged image in place above */
+  if (opts->mode != IOFPGA_WRITE_COMMIT) {
+    printf("Program image...\n");
 
-  // program the image
-  rc = fpgalib_sjtag_flash_program_operation(&cfi, fpga_image_offset, image,
-                                             image_size, NULL, NULL, err_msg, msg_size);
-  if (rc) {
-    printf("Failed to program flash at offset: 0x%x. err_msg %s\n", fpga_image_offset, err_msg);
-    return -1;
+    /*
+     * Program the image, inflating it on the way if it is compressed. Only
+     * the sectors that differ from what the flash already holds are
+     * rewritten; the metadata stays erased until the image is complete.
+     */
+    progress.cur.block_name = ctx->block_name;
+    sjtag_progress_begin(&progress, "program", payload_size);
+    sjtag_progress_add(&progress, skip);
+    if (meta.compressed) {
+      rc = sjtag_flash_program_stream(cfi, fpga_image_offset, &meta, skip,
+                                      &stats, err_msg, msg_size);
+    } else {
+      rc = sjtag_flash_program_diff(cfi, fpga_image_offset + skip,
+                                    image + skip, image_size - skip, &stats,
+                                    err_msg, msg_size);
+    }
+    if (rc) {
+      printf("Failed to program flash at offset: 0x%x. err_msg %s\n", fpga_image_offset, err_msg);
+      fpd_journal_close(&journal, false);
+      free(meta.pid_list);
+      free(meta.name_list);
+      fpd_img_unmap(&map);
+      return EIO;
+    }
+    sjtag_progress_end_times(&progress, &stats);
+    printf("Program image done\n");
+    sjtag_diff_stats_print(&stats, cfi->sector_size);
+  }
+  free(meta.pid_list);
+  free(meta.name_list);
+
+  if (opts->mode == IOFPGA_WRITE_STAGE) {
+    /* The journal now records the whole image for the commit */
+    fpd_journal_close(&journal, false);
+    fpd_img_unmap(&map);
+    printf("Iofpga image staged, metadata left erased\n");
+    return 0;
   }
-  printf("Program image done\n");
 
   printf("Program meta data...\n");
+  sjtag_progress_begin(&progress, "metadata", mdata_size);
 
   //program the meta_data
-  fpgalib_sjtag_flash_program_operation(&cfi, metadata_offset, mdata,
-                                        mdata_size, NULL, NULL, err_msg,
-                                        msg_size);
+  rc = fpgalib_sjtag_flash_program_operation(cfi, metadata_offset, mdata,
+                                             mdata_size, NULL, NULL, NULL,
+                                             err_msg, msg_size);
+  fpd_img_unmap(&map);
+  fpd_journal_close(&journal, rc == 0);
   if (rc) {
     printf("Failed to program flash at offset: 0x%x. err_msg %s\n", metadata_offset, err_msg);
-    return -1;
+    return EIO;
   }
+  sjtag_progress_end(&progress);
   printf("Program meta data done\n");
 
   printf("Iofpga image write done\n");
   return 0;
 }
 
-uint16_t
-get_iofpga_version_from_flash(const char *block_name, uint32_t mdata_offset)
+int
+get_iofpga_mdata_from_flash(const char *block_name, uint32_t mdata_offset,
+                            uint16_t *version, uint32_t *checksum)
 {
-    char err_msg[ERRBUF_SIZE] = {0};
-    uint32_t msg_size = sizeof(err_msg);
     uint8_t data[IOFPGA_MDATA_SIZE] = {0};
     int rc;
 
-    map_base = mmap_sjtag_block(block_name);
-    if (!map_base) {
+    sjtag_ctx_t *ctx = sjtag_ctx_open(block_name);
+    if (!ctx) {
         fprintf(stderr, "failed to mmap block %s\n", block_name);
         return -1;
     }
 
+    pthread_mutex_lock(&ctx->lock);
     // read jedec_id and get cfi data
-    rc = iofpga_get_spi_cfg(err_msg, msg_size);
+    rc = sjtag_ctx_spi_cfg(ctx);
     if (rc != 0) {
+        pthread_mutex_unlock(&ctx->lock);
         printf("Failed to get spi flash config\n");
         return -1;
     }
 
-    rc = iofpga_sjtag_flash_read_operation(&cfi, mdata_offset, data, IOFPGA_MDATA_SIZE,
-                                           err_msg, msg_size);
+    rc = iofpga_sjtag_flash_read_operation(&ctx->cfi, mdata_offset, data,
+                                           IOFPGA_MDATA_SIZE, ctx->err_msg,
+                                           sizeof(ctx->err_msg));
+    pthread_mutex_unlock(&ctx->lock);
     if (rc != 0) {
-        printf("Failed to read mdata from flash. err_msg %s\n", err_msg);
+        printf("Failed to read mdata from flash. err_msg %s\n", ctx->err_msg);
         return -1;
     }
 
     uint8_t major = data[IOFPGA_MDATA_FPD_VERSION_OFFSET];
     uint8_t minor = data[IOFPGA_MDATA_FPD_VERSION_OFFSET + 2];
-    return (major << 8) | minor;
+    *version = (major << 8) | minor;
+    if (checksum) {
+        *checksum = crc32(0, data, sizeof(data));
+    }
+    return 0;
 }
 
-int
-program_iofpga(char *image_path, uint32_t image_offset, uint32_t image_size,
-               uint32_t mdata_offset, uint32_t mdata_size, const char *block_name)
+uint16_t
+get_iofpga_version_from_flash(const char *block_name, uint32_t mdata_offset)
+{
+    uint16_t version;
+
+    if (get_iofpga_mdata_from_flash(block_name, mdata_offset, &version, NULL)) {
+        return -1;
+    }
+    return version;
+}
+
+static int
+iofpga_write_block(const char *image_path, uint32_t image_offset,
+                   uint32_t image_size, uint32_t mdata_offset,
+                   uint32_t mdata_size, const char *block_name,
+                   const iofpga_write_opts_t *opts)
 {
-    char err_msg[ERRBUF_SIZE] = {0};
-    uint32_t msg_size = sizeof(err_msg);
     int rc = 0;
 
     printf("fpga_image_offset = 0x%x\n"
@@ -4482,36 +5664,157 @@ program_iofpga(char *image_path, uint32_t image_offset, uint32_t image_size,
             mdata_offset, mdata_size,
             block_name);
 
-    map_base = mmap_sjtag_block(block_name);
-    if (!map_base) {
+    sjtag_ctx_t *ctx = sjtag_ctx_open(block_name);
+    if (!ctx) {
         fprintf(stderr, "failed to mmap block %s\n", block_name);
-        return -1;
+        return ENODEV;
     }
 
+    pthread_mutex_lock(&ctx->lock);
     // read jedec_id
-    rc = iofpga_get_spi_cfg(err_msg, msg_size);
+    rc = sjtag_ctx_spi_cfg(ctx);
     if (rc != 0) {
+        pthread_mutex_unlock(&ctx->lock);
         printf("Failed to get spi flash config\n");
-        return -1;
+        return EIO;
     }
 
     // write image
-    rc = iofpga_image_write(image_path, image_offset, image_size,
-                            mdata_offset, mdata_size, err_msg, msg_size);
+    rc = iofpga_image_write(ctx, image_path, image_offset, image_size,
+                            mdata_offset, mdata_size, opts);
+    pthread_mutex_unlock(&ctx->lock);
     if (rc != 0) {
-        printf("Failed to write to the SPI flash\n");
-        return -1;
+        printf("Failed to write to the SPI flash of %s\n", block_name);
+        return rc;
     }
 
     return 0;
 }
 
 int
-erase_iofpga(uint32_t image_offset, uint32_t image_size,
-             uint32_t mdata_offset, uint32_t mdata_size, const char *block_name)
+program_iofpga_progress(const char *image_path, uint32_t image_offset,
+                        uint32_t image_size, uint32_t mdata_offset,
+                        uint32_t mdata_size, const char *block_name,
+                        fpd_progress_cb_t progress_cb, void *progress_ctx)
+{
+    iofpga_write_opts_t opts = {
+        .mode = IOFPGA_WRITE_PROGRAM,
+        .progress_cb = progress_cb,
+        .progress_ctx = progress_ctx,
+    };
+
+    return iofpga_write_block(image_path, image_offset, image_size,
+                              mdata_offset, mdata_size, block_name, &opts);
+}
+
+int
+stage_iofpga(const char *image_path, uint32_t image_offset,
+             uint32_t image_size, uint32_t mdata_offset, uint32_t mdata_size,
+             const char *block_name, uint32_t rate_kbs,
+             fpd_progress_cb_t progress_cb, void *progress_ctx)
+{
+    iofpga_write_opts_t opts = {
+        .mode = IOFPGA_WRITE_STAGE,
+        .rate_kbs = rate_kbs,
+        .progress_cb = progress_cb,
+        .progress_ctx = progress_ctx,
+    };
+    struct sched_param param = {0}, old_param;
+    int policy, rc;
+
+    /* Only run when nothing else wants the CPU */
+    pthread_getschedparam(pthread_self(), &policy, &old_param);
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+    rc = iofpga_write_block(image_path, image_offset, image_size,
+                            mdata_offset, mdata_size, block_name, &opts);
+    pthread_setschedparam(pthread_self(), policy, &old_param);
+    return rc;
+}
+
+int
+commit_iofpga(const char *image_path, uint32_t image_offset,
+              uint32_t image_size, uint32_t mdata_offset, uint32_t mdata_size,
+              const char *block_name)
+{
+    iofpga_write_opts_t opts = {.mode = IOFPGA_WRITE_COMMIT};
+
+    return iofpga_write_block(image_path, image_offset, image_size,
+                              mdata_offset, mdata_size, block_name, &opts);
+}
+
+int
+program_iofpga(const char *image_path, uint32_t image_offset,
+               uint32_t image_size, uint32_t mdata_offset, uint32_t mdata_size,
+               const char *block_name)
+{
+    return program_iofpga_progress(image_path, image_offset, image_size,
+                                   mdata_offset, mdata_size, block_name,
+                                   NULL, NULL);
+}
+
+static void *
+program_iofpga_thread(void *arg)
 {
-    char err_msg[ERRBUF_SIZE] = {0};
-    uint32_t msg_size = sizeof(err_msg);
+    iofpga_program_req_t *req = arg;
+
+    req->rc = program_iofpga_progress(req->image_path, req->image_offset,
+                                      req->image_size, req->mdata_offset,
+                                      req->mdata_size, req->block_name,
+                                      req->progress_cb, req->progress_ctx);
+    return NULL;
+}
+
+int
+program_iofpga_multi(iofpga_program_req_t *reqs, int count)
+{
+    pthread_t *threads;
+    bool *started;
+    int i, rc = 0;
+
+    threads = calloc(count, sizeof(*threads));
+    started = calloc(count, sizeof(*started));
+    if (!threads || !started) {
+        free(threads);
+        free(started);
+        return ENOMEM;
+    }
+
+    /*
+     * Every block has its own registers and flash, so the requests run
+     * side by side; two requests for the same block queue on its lock.
+     * A request whose thread cannot be created runs inline instead.
+     */
+    for (i = 0; i < count; i++) {
+        reqs[i].rc = -1;
+        started[i] = !pthread_create(&threads[i], NULL,
+                                     program_iofpga_thread, &reqs[i]);
+        if (!started[i]) {
+            program_iofpga_thread(&reqs[i]);
+        }
+    }
+    for (i = 0; i < count; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+        printf("%s: program %s\n", reqs[i].block_name,
+               reqs[i].rc ? "failed" : "done");
+        if (reqs[i].rc && !rc) {
+            rc = reqs[i].rc;
+        }
+    }
+    free(threads);
+    free(started);
+    return rc;
+}
+
+int
+erase_iofpga_progress(uint32_t image_offset, uint32_t image_size,
+                      uint32_t mdata_offset, uint32_t mdata_size,
+                      const char *block_name, fpd_progress_cb_t progress_cb,
+                      void *progress_ctx)
+{
+    sjtag_progress_t progress = {.cb = progress_cb, .cb_ctx = progress_ctx};
+    sjtag_program_stats_t stats = {.progress = &progress};
     int rc = 0;
 
     printf("fpga_image_offset = 0x%x\n"
@@ -4523,33 +5826,248 @@ erase_iofpga(uint32_t image_offset, uint32_t image_size,
             mdata_offset, mdata_size,
             block_name);
 
-    map_base = mmap_sjtag_block(block_name);
-    if (!map_base) {
+    sjtag_ctx_t *ctx = sjtag_ctx_open(block_name);
+    if (!ctx) {
         fprintf(stderr, "failed to mmap block %s\n", block_name);
         return -1;
     }
 
+    pthread_mutex_lock(&ctx->lock);
     // read jedec_id
-    rc = iofpga_get_spi_cfg(err_msg, msg_size);
+    rc = sjtag_ctx_spi_cfg(ctx);
     if (rc != 0) {
+        pthread_mutex_unlock(&ctx->lock);
         printf("Failed to get spi flash config\n");
         return -1;
     }
 
+    /* Whatever a journal says is on the flash is about to go */
+    fpd_journal_remove(block_name);
+
     /* erase metadata */
     printf("Erase meta-data at offset: 0x%x\n", mdata_offset);
-    rc = sjtag_flash_program_erase(&cfi, mdata_offset, mdata_size, NULL, NULL, err_msg, msg_size);
+    rc = sjtag_flash_program_erase(&ctx->cfi, mdata_offset, mdata_size, NULL,
+                                   NULL, NULL, ctx->err_msg,
+                                   sizeof(ctx->err_msg));
     if (rc) {
-        printf("Failed to erase spi flash at offset: 0x%x. err_msg %s\n", mdata_offset, err_msg);
+        pthread_mutex_unlock(&ctx->lock);
+        printf("Failed to erase spi flash at offset: 0x%x. err_msg %s\n", mdata_offset, ctx->err_msg);
         return -1;
     }
 
     /* erase image */
     printf("Erase image at offset: 0x%x\n", image_offset);
-    rc = sjtag_flash_program_erase(&cfi, image_offset, image_size, NULL, NULL, err_msg, msg_size);
+    progress.cur.block_name = block_name;
+    sjtag_progress_begin(&progress, "erase", image_size);
+    ctx->erased_size = 0;
+    rc = sjtag_flash_program_erase(&ctx->cfi, image_offset, image_size, NULL,
+                                   NULL, &stats, ctx->err_msg,
+                                   sizeof(ctx->err_msg));
+    if (rc == 0) {
+        ctx->erased_offset = image_offset;
+        ctx->erased_size = image_size;
+    }
+    pthread_mutex_unlock(&ctx->lock);
     if (rc) {
-        printf("Failed to erase spi flash at offset: 0x%x. err_msg %s\n", image_offset, err_msg);
+        printf("Failed to erase spi flash at offset: 0x%x. err_msg %s\n", image_offset, ctx->err_msg);
         return -1;
     }
+    sjtag_progress_end_times(&progress, &stats);
+    sjtag_program_stats_print("Image erase", &stats);
     return 0;
 }
+
+int
+erase_iofpga(uint32_t image_offset, uint32_t image_size,
+             uint32_t mdata_offset, uint32_t mdata_size, const char *block_name)
+{
+    return erase_iofpga_progress(image_offset, image_size, mdata_offset,
+                                 mdata_size, block_name, NULL, NULL);
+}
+
+static sjtag_ctx_t *
+iofpga_readback_open(const char *block_name, char *msg, uint32_t msg_size)
+{
+    sjtag_ctx_t *ctx = sjtag_ctx_open(block_name);
+
+    if (!ctx) {
+        snprintf(msg, msg_size, "failed to mmap block %s", block_name);
+        return NULL;
+    }
+    pthread_mutex_lock(&ctx->lock);
+    if (sjtag_ctx_spi_cfg(ctx) != 0) {
+        pthread_mutex_unlock(&ctx->lock);
+        snprintf(msg, msg_size, "failed to get spi flash config of %s",
+                 block_name);
+        return NULL;
+    }
+    return ctx;
+}
+
+int
+verify_iofpga(const char *image_path, uint32_t image_offset,
+              uint32_t image_size, uint32_t mdata_offset, uint32_t mdata_size,
+              const char *block_name, fpd_progress_cb_t progress_cb,
+              void *progress_ctx, char *msg, uint32_t msg_size)
+{
+    sjtag_progress_t progress = {.cb = progress_cb, .cb_ctx = progress_ctx};
+    uint8_t digest[MAX_MD5_DIGEST];
+    fpd_meta_info_t meta = {0};
+    fpd_img_map_t map;
+    sjtag_ctx_t *ctx;
+    const char *how = "byte compare";
+    uint32_t payload_size;
+    uint64_t t0, bytes;
+    bool has_md5;
+    int rc, i;
+
+    rc = fpd_img_map(image_path, &map, msg, msg_size);
+    if (rc || !map.mdata) {
+        fpd_img_unmap(&map);
+        return rc ? rc : EINVAL;
+    }
+    rc = get_data_info(map.mdata, &meta, msg, msg_size);
+    if (rc) {
+        fpd_img_unmap(&map);
+        return rc;
+    }
+    meta.img_size = map.img_size;
+    payload_size = meta.compressed ? meta.img_msize : map.img_size;
+    if (payload_size > image_size || map.mdata_size > mdata_size) {
+        snprintf(msg, msg_size, "image %u / metadata %u bytes overflow the "
+                 "flash region of %u / %u", payload_size, map.mdata_size,
+                 image_size, mdata_size);
+        rc = EFBIG;
+        goto out;
+    }
+    for (i = 0, has_md5 = false; meta.md5 && i < MAX_MD5_DIGEST; i++) {
+        has_md5 |= meta.md5[i] != 0;
+    }
+
+    ctx = iofpga_readback_open(block_name, msg, msg_size);
+    if (!ctx) {
+        rc = ENODEV;
+        goto out;
+    }
+
+    /*
+     * The metadata goes first: it is small, and differs whenever another
+     * version is on the flash. The image is then hashed as it is read and
+     * the hash checked against fw_md5, which needs no inflate of the
+     * package. Only without a digest, or when it does not match, is the
+     * image compared byte by byte to find where it differs.
+     */
+    t0 = sjtag_now_usec();
+    bytes = map.mdata_size;
+    progress.cur.block_name = block_name;
+    sjtag_progress_begin(&progress, "verify", map.mdata_size + payload_size);
+    rc = sjtag_verify_range(&ctx->cfi, mdata_offset, map.mdata,
+                            map.mdata_size, NULL, ctx->err_msg,
+                            sizeof(ctx->err_msg));
+    sjtag_progress_add(&progress, map.mdata_size);
+    if (!rc && has_md5) {
+        rc = iofpga_flash_digest(ctx, image_offset, payload_size, digest,
+                                 &progress);
+        bytes += payload_size;
+        if (!rc && !memcmp(digest, meta.md5, MAX_MD5_DIGEST)) {
+            how = "md5";
+        } else if (!rc) {
+            has_md5 = false;
+        }
+    }
+    if (!rc && !has_md5) {
+        sjtag_progress_begin(&progress, "compare", payload_size);
+        rc = iofpga_flash_compare(ctx, image_offset, &meta, payload_size,
+                                  &progress);
+        bytes += payload_size;
+    }
+    if (rc) {
+        snprintf(msg, msg_size, "%s", ctx->err_msg);
+    } else {
+        sjtag_progress_end(&progress);
+        snprintf(msg, msg_size, "flash matches image (%s, %llu bytes read "
+                 "at %.2f MB/s)", how, (unsigned long long)bytes,
+                 sjtag_mbps(bytes, sjtag_now_usec() - t0));
+    }
+    pthread_mutex_unlock(&ctx->lock);
+
+out:
+    free(meta.pid_list);
+    free(meta.name_list);
+    fpd_img_unmap(&map);
+    return rc;
+}
+
+int
+read_iofpga(const char *block_name, uint32_t offset, uint32_t size,
+            const char *out_path, fpd_progress_cb_t progress_cb,
+            void *progress_ctx, char *msg, uint32_t msg_size)
+{
+    sjtag_progress_t progress = {.cb = progress_cb, .cb_ctx = progress_ctx};
+    uint64_t capacity, t0;
+    uint32_t done, chunk;
+    uint8_t *buf;
+    ssize_t len;
+    int fd, rc = 0;
+
+    sjtag_ctx_t *ctx = iofpga_readback_open(block_name, msg, msg_size);
+    if (!ctx) {
+        return ENODEV;
+    }
+    capacity = (uint64_t)ctx->cfi.sector_end * ctx->cfi.sector_size;
+    if (!size && offset < capacity) {
+        size = capacity - offset;
+    }
+    if ((uint64_t)offset + size > capacity) {
+        pthread_mutex_unlock(&ctx->lock);
+        snprintf(msg, msg_size, "0x%x bytes at 0x%x are past the end of the "
+                 "0x%llx byte flash", size, offset,
+                 (unsigned long long)capacity);
+        return EINVAL;
+    }
+
+    fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    buf = malloc(IOFPGA_READBACK_CHUNK);
+    if (fd < 0 || !buf) {
+        rc = fd < 0 ? errno : ENOMEM;
+        snprintf(msg, msg_size, "%s: %s", out_path, strerror(rc));
+        pthread_mutex_unlock(&ctx->lock);
+        if (fd >= 0) {
+            close(fd);
+        }
+        free(buf);
+        return rc;
+    }
+
+    t0 = sjtag_now_usec();
+    progress.cur.block_name = block_name;
+    sjtag_progress_begin(&progress, "read", size);
+    for (done = 0; !rc && done < size; done += chunk) {
+        chunk = size - done < IOFPGA_READBACK_CHUNK ? size - done
+                                                    : IOFPGA_READBACK_CHUNK;
+        rc = sjtag_read(&ctx->cfi, offset + done, buf, chunk, ctx->err_msg,
+                        sizeof(ctx->err_msg));
+        if (rc) {
+            snprintf(msg, msg_size, "%s", ctx->err_msg);
+        } else if ((len = write(fd, buf, chunk)) != (ssize_t)chunk) {
+            rc = len < 0 ? errno : EIO;
+            snprintf(msg, msg_size, "%s: %s", out_path, strerror(rc));
+        } else {
+            sjtag_progress_add(&progress, chunk);
+        }
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    free(buf);
+    if (!rc && fsync(fd)) {
+        rc = errno;
+        snprintf(msg, msg_size, "%s: %s", out_path, strerror(rc));
+    }
+    close(fd);
+    if (!rc) {
+        sjtag_progress_end(&progress);
+        snprintf(msg, msg_size, "0x%x bytes at 0x%x read into %s at %.2f MB/s",
+                 size, offset, out_path,
+                 sjtag_mbps(size, sjtag_now_usec() - t0));
+    }
+    return rc;
+}
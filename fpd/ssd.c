@@ -7,6 +7,8 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <sys/syscall.h>
 #include <sys/statvfs.h>
 #include <regex.h>
@@ -173,43 +175,50 @@ int ssd_get_img_metadata(const char *path, uint32_t *img_size, void **img,
                      uint32_t *mdata_size, void **mdata, char *err_msg,
                      uint32_t msg_size) {
   struct stat st;
-  uint8_t *image;
-  uint8_t *metadata;
+  uint8_t *base;
+  int fd;
   int rc;
-  FILE *fp;
   uint32_t size;
-  fpd_meta_data_t fpd_mdata;
+  fpd_meta_data_t *fpd_mdata;
 
-  fp = fopen(path, "rb");
-  if (fp == NULL) {
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
     snprintf(err_msg, msg_size, "Failed to open file path %s", path);
     return EINVAL;
   }
 
-  rc = stat(path, &st);
-  if (rc) {
+  rc = fstat(fd, &st);
+  if (rc || st.st_size < (off_t)sizeof(fpd_mdata_hdr_v1_t)) {
     snprintf(err_msg, msg_size, "stat failed");
+    close(fd);
     return EINVAL;
   }
 
   size = st.st_size;
 
-  rc = fread(&fpd_mdata, sizeof(fpd_meta_data_t), 1, fp);
-  if (rc == 0) {
-    snprintf(err_msg, msg_size, "failed to read mdata");
-    fclose(fp);
-    return errno;
+  /*
+   * Metadata and image are handed out as views into a read-only mapping
+   * of the file; release them with ssd_put_img_metadata().
+   */
+  base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  rc = errno;
+  close(fd);
+  if (base == MAP_FAILED) {
+    snprintf(err_msg, msg_size, "failed to map %s", path);
+    return rc;
   }
+  (void)madvise(base, size, MADV_SEQUENTIAL);
+  fpd_mdata = (fpd_meta_data_t *)base;
 
-  switch (fpd_mdata.hdr.u.v1.metadata_version) {
+  switch (fpd_mdata->hdr.u.v1.metadata_version) {
   case FPD_META_DATA_VER_1:
-    *mdata_size = fpd_mdata.hdr.u.v1.metadata_size;
+    *mdata_size = fpd_mdata->hdr.u.v1.metadata_size;
     break;
   case FPD_META_DATA_VER_2:
-    *mdata_size = fpd_mdata.hdr.u.v2.metadata_size;
+    *mdata_size = fpd_mdata->hdr.u.v2.metadata_size;
     break;
   default:
-    *mdata_size = fpd_mdata.hdr.u.v1.metadata_size;
+    *mdata_size = fpd_mdata->hdr.u.v1.metadata_size;
     break;
   }
 
@@ -217,50 +226,21 @@ int ssd_get_img_metadata(const char *path, uint32_t *img_size, void **img,
 
   if (size < *mdata_size) {
     snprintf(err_msg, msg_size, "Size of file < mdata size");
-    fclose(fp);
+    munmap(base, size);
     return EINVAL;
   }
 
-  /* allocate memory for metadata */
-  metadata = (uint8_t *)calloc(1, *mdata_size);
-  if (metadata == NULL) {
-    snprintf(err_msg, msg_size, "failed to allocate memory for metadata");
-    return ENOMEM;
-  }
-
-  fseek(fp, 0, SEEK_SET);
-  /* read meta data */
-  rc = fread(metadata, *mdata_size, 1, fp);
-  if (rc == 0) {
-    fclose(fp);
-    snprintf(err_msg, msg_size, "failed to read mdata");
-    return errno;
-  }
-  *mdata = metadata;
+  *mdata = base;
+  *img = base + *mdata_size;
+  *img_size = size - *mdata_size;
 
-  size -= *mdata_size;
-  *img_size = size;
+  return 0;
+}
 
-  /* allocate memory for image */
-  image = (uint8_t *)calloc(size, 1);
-  if (image == NULL) {
-    snprintf(err_msg, msg_size, "failed to allocate memory for image buffer");
-    fclose(fp);
-    return -1;
+void ssd_put_img_metadata(void *mdata, uint32_t mdata_size, uint32_t img_size) {
+  if (mdata) {
+    munmap(mdata, mdata_size + img_size);
   }
-  /* read image */
-  rc = fread(image, sizeof(char), size, fp);
-  if (rc == 0) {
-    snprintf(err_msg, msg_size, "failed to read image");
-    fclose(fp);
-    return errno;
-  }
-
-  *img = image;
-
-  fclose(fp);
-
-  return 0;
 }
 
 #if IMAGE_METADATA
@@ -676,8 +656,7 @@ fpd_ssd_upgrade (
     upg_img_fp = fopen(upg_file, "w");
     if (upg_img_fp == NULL) {
         printf("%s", err_msg);
-        if(image) free(image);
-        if(meta_data) free(meta_data);
+        ssd_put_img_metadata(meta_data, mdata_sz, img_size);
         return (CPA_STATUS_E_INVALID);
     }
 
@@ -687,8 +666,7 @@ fpd_ssd_upgrade (
         printf("Unable to write the image into"
                            " the upg file due to error: %s", strerror(errno));
         (void) fclose(upg_img_fp);
-        if(image) free(image);
-        if(meta_data) free(meta_data);
+        ssd_put_img_metadata(meta_data, mdata_sz, img_size);
         return (CPA_STATUS_E_INVALID);
     }
 
@@ -711,8 +689,7 @@ fpd_ssd_upgrade (
         snprintf(err_msg, msg_size,
                 "fail to upgrade ssd (%s)", err_buf);
         printf("%s", err_msg);
-        if(image) free(image);
-        if(meta_data) free(meta_data);
+        ssd_put_img_metadata(meta_data, mdata_sz, img_size);
         return (CPA_STATUS_E_FAULT);
     }
 
@@ -722,8 +699,7 @@ fpd_ssd_upgrade (
     mdata_fp = fopen(SSD_METADATA_FILE, "w");
     if (mdata_fp == NULL) {
         printf("Unable to open meta data file\n");
-        if(image) free(image);
-        if(meta_data) free(meta_data);
+        ssd_put_img_metadata(meta_data, mdata_sz, img_size);
         return (CPA_STATUS_E_FAULT);
     }
 
@@ -733,12 +709,10 @@ fpd_ssd_upgrade (
         printf("Unable to write meta data "
                            "file due to error: %s\n", strerror(errno));
         (void) fclose(mdata_fp);
-        if(image) free(image);
-        if(meta_data) free(meta_data);
+        ssd_put_img_metadata(meta_data, mdata_sz, img_size);
         return (CPA_STATUS_E_FAULT);
     }
-    if(image) free(image);
-    if(meta_data) free(meta_data);
+    ssd_put_img_metadata(meta_data, mdata_sz, img_size);
 
     (void) fclose(mdata_fp);
 
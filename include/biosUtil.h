@@ -12,12 +12,11 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 
 #define BIOS_VER_SIGNATURE      "$BVDT$"
-#define BIOS_VER_INFO_FILE      "/tmp/bios_ver_info.txt"
-#define BIOS_MTD_INFO_FILE      "/tmp/mtd_bios.txt"
 #define BIOS_VER_LEN            18
 #define BIOS_VER_BVDT_LEN       6
 #define BIOS_SIGNATURE_OFFSET   256
@@ -54,6 +53,16 @@ int fpd_bios_switch_flash(const char *block_name);
  */
 int fpd_bios_get_active_flash(const char *block_name);
 
+/*
+ * @brief  Api to read the BIOS version string from the flash of the first
+ *         MTD partition whose name contains mtd_name. The "$BVDT$" block
+ *         is at BIOS_SIGNATURE_OFFSET of the version sector at offset.
+ * @return Return 0 with the NUL terminated version, errno otherwise
+ */
+int bios_mtd_get_version(const char *mtd_name, uint64_t offset,
+                         char version[BIOS_VER_LEN],
+                         char *err_msg, uint32_t msg_size);
+
 #ifdef __cplusplus
 }
 #endif
@@ -9,7 +9,11 @@
 #ifndef BSP_FPD_H_
 #define BSP_FPD_H_
 
+#include <chrono>
 #include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
 #include <string>
 #include <vector>
 #include <memory>
@@ -202,16 +206,147 @@ public:
     //!
     virtual void erase() const;
 
+    //!
+    //! @brief Write and verify the firmware at low priority while the
+    //!        device runs, short of making it bootable
+    //!
+    //! @param[in] rate_kbs Image KB/s to stay under, 0 for no limit
+    //!
+    virtual void stage(uint32_t rate_kbs = 0) const;
+
+    //!
+    //! @brief Make the firmware written by stage() bootable
+    //!
+    virtual void commit() const;
+
     //!
     //! @brief verify the firmware location
     //!
     virtual std::string verify() const;
 
+    //!
+    //! @brief Read the firmware location back into a file
+    //!
+    //! @param[in] out_path File to write the firmware location to
+    //!
+    //! @returns Summary of what was read
+    //!
+    virtual std::string read(const std::string &out_path) const;
+
     //!
     //! @brief activates the fpd after firmware upgrade
     //!
     virtual void activate() const;
 
+    //!
+    //! @brief Progress of a program or erase, reported at the start and end
+    //!        of each phase and periodically in between
+    //!
+    struct progress_t {
+        std::string phase;          //!< "erase", "program" or "metadata"
+        uint64_t bytes_done;
+        uint64_t bytes_total;
+        double mbps;                //!< rate since the previous report
+        double eta_sec;             //!< time left in the phase, -1 if unknown
+    };
+    using progress_fn_t = std::function<void(const fpd_t &, const progress_t &)>;
+
+    //!
+    //! @brief Set the handler called with the progress of program / erase
+    //!
+    //! @param[in] fn The handler, empty to stop reporting
+    //!
+    virtual void set_progress_handler(progress_fn_t fn) { m_progress = std::move(fn); }
+
+    //!
+    //! @brief Hand progress to the handler, if any
+    //!
+    //! @param[in] progress The progress to report
+    //!
+    void report_progress(const progress_t &progress) const {
+        if (m_progress) {
+            m_progress(*this, progress);
+        }
+    }
+
+    //!
+    //! @brief Times an operation on the FPD (program, erase, ...) together
+    //!        with the phases timed on the same thread while it runs. Unless
+    //!        it ends by an exception, the operation is appended to the
+    //!        timing history when the timer goes out of scope.
+    //!
+    class op_timer_t {
+    public:
+        //!
+        //! @param[in] fpd   The FPD operated on
+        //! @param[in] op    Name of the operation
+        //! @param[in] image True if the size of the configured image is
+        //!                  the size of the operation
+        //!
+        op_timer_t(const fpd_t &fpd, std::string op, bool image = true);
+        ~op_timer_t();
+
+        op_timer_t(const op_timer_t &) = delete;
+        op_timer_t &operator=(const op_timer_t &) = delete;
+
+        //!
+        //! @brief Add time to a phase of the operation running on this
+        //!        thread, if any, for phases timed by other means
+        //!
+        static void add_phase(const std::string &phase, double secs);
+
+    private:
+        const fpd_t &m_fpd;
+        std::string m_op;
+        uint64_t m_bytes;
+        std::chrono::steady_clock::time_point m_start;
+        std::map<std::string, double> m_phases;
+        int m_exceptions;
+        op_timer_t *m_outer;
+    };
+
+    //!
+    //! @brief Times a phase ("load", "inflate", "erase", "program", "verify",
+    //!        "activate" or "helper") of the operation running on this
+    //!        thread, if any, from construction to destruction
+    //!
+    class phase_timer_t {
+    public:
+        explicit phase_timer_t(std::string phase)
+            : m_phase(std::move(phase)), m_start(std::chrono::steady_clock::now()) {}
+        ~phase_timer_t() {
+            std::chrono::duration<double> secs = std::chrono::steady_clock::now() - m_start;
+            op_timer_t::add_phase(m_phase, secs.count());
+        }
+
+        phase_timer_t(const phase_timer_t &) = delete;
+        phase_timer_t &operator=(const phase_timer_t &) = delete;
+
+    private:
+        std::string m_phase;
+        std::chrono::steady_clock::time_point m_start;
+    };
+
+    //!
+    //! @brief Duration of a program predicted from the timing history
+    //!
+    struct estimate_t {
+        double secs;                                   //!< whole program, activate included
+        std::map<std::string, double> phases;          //!< secs of each timed phase
+        unsigned runs;                                 //!< programs the rates are taken from
+    };
+
+    //!
+    //! @brief Predict how long programming an image takes, from the per
+    //!        byte rate of the latest programs of this FPD in the history
+    //!
+    //! @param[in] bytes Size of the image
+    //!
+    //! @returns The estimate
+    //! @throws system_error ENODATA if no program of the FPD is recorded
+    //!
+    estimate_t estimate(uint64_t bytes) const;
+
     //!
     //! @brief Convert object to string representation
     //!
@@ -274,6 +409,7 @@ private:
     std::map<std::string, std::string> m_offsets;      //!< FPGA address offsets 
     bool m_golden;                                     //!< Golden upgrade flag
     std::string m_expected_version;                    //!< path access to retrieve expected version
+    progress_fn_t m_progress;                          //!< Program / erase progress handler
 
 }; // class fpd_t
 
@@ -291,6 +427,7 @@ public:
     ~fpd_proxy_t();
 
     void program(bool force = false) const override {
+        op_timer_t timer(*m_object, "program");
         m_object->program(force);
     }
 
@@ -303,13 +440,35 @@ public:
     }
 
     void activate() const override {
+        op_timer_t timer(*m_object, "activate", false);
         return m_object->activate();
     }
 
+    std::string verify() const override {
+        op_timer_t timer(*m_object, "verify");
+        return m_object->verify();
+    }
+
+    std::string read(const std::string &out_path) const override {
+        op_timer_t timer(*m_object, "read", false);
+        return m_object->read(out_path);
+    }
+
+    void stage(uint32_t rate_kbs = 0) const override {
+        op_timer_t timer(*m_object, "stage");
+        m_object->stage(rate_kbs);
+    }
+
+    void commit() const override {
+        op_timer_t timer(*m_object, "commit", false);
+        m_object->commit();
+    }
+
     void erase() const override {
         if (is_golden_fpd()) {
             std::cout << name() << ": Erase for golden not supported" << std::endl;
         }
+        op_timer_t timer(*m_object, "erase", false);
         return m_object->erase();
     }
 
@@ -317,6 +476,10 @@ public:
         return m_object->set_file_path(ipath);
     }
 
+    void set_progress_handler(progress_fn_t fn) override {
+        m_object->set_progress_handler(std::move(fn));
+    }
+
     void setup(pointer<fpd_t> parent);
 private:
     fpd_t *m_object;                                   //!< Object of the library implemenation
@@ -267,8 +267,19 @@ typedef struct fpd_mdata_card_info_ {
 typedef enum fpd_fw_type_ {
     FPD_FW_TYPE_PLAIN = 0,
     FPD_FW_TYPE_GZIP = 1,
+    FPD_FW_TYPE_ZSTD = 2,
 } fpd_fw_type_en;
 
+/*
+ * A zstd payload is a run of independent frames that each record their
+ * decompressed size, so the frames can be decoded on several cores at
+ * once straight to their place in the output. One decoder runs per core,
+ * or as many as FPD_ZSTD_THREADS_ENV asks for.
+ */
+#define FPD_ZSTD_FRAME_SIZE     (128 * 1024)
+#define FPD_ZSTD_THREADS_MAX    8
+#define FPD_ZSTD_THREADS_ENV    "FPD_ZSTD_THREADS"
+
 /*
  * FPD image firmware type
  */
@@ -449,7 +460,7 @@ typedef struct fpd_meta_info_t_ {
     uint32_t flags;
     fpd_version_t version;
     char *version_string;
-    uint32_t compressed;
+    uint32_t compressed;        /* fpd_fw_type_en of the payload */
     uint32_t pid_size;
     char **pid_list;
     uint32_t name_size;
@@ -457,6 +468,21 @@ typedef struct fpd_meta_info_t_ {
     uint8_t *md5;
 } fpd_meta_info_t;
 
+/*
+ * Read-only mapping of an image file. mdata and img are views into the
+ * mapping, so nothing is copied when they are handed down to a writer.
+ * For an image bundle (FPD_FILE_LIST_MAGIC) there is no single metadata
+ * block and the whole file is exposed as img.
+ */
+typedef struct fpd_img_map_ {
+    void *base;
+    size_t size;
+    void *mdata;
+    uint32_t mdata_size;
+    void *img;
+    uint32_t img_size;
+} fpd_img_map_t;
+
 typedef struct fpd_imgs_ {
     uint32_t num_imgs;
     uint32_t size;
@@ -464,9 +490,23 @@ typedef struct fpd_imgs_ {
     const char *name;
     fpd_meta_info_t **match_list;
     uint32_t match_count;
+    fpd_img_map_t map;
     fpd_meta_info_t meta[0];
 } fpd_imgs_t;
 
+#define FPD_MDATA_CACHE_SIZE    16
+
+/*
+ * Image attributes available from the metadata alone. Filled in by
+ * fpd_mdata_probe() without reading any of the image payload.
+ */
+typedef struct fpd_mdata_probe_ {
+    uint32_t mdata_size;
+    uint32_t img_size;
+    fpd_version_t version;
+    uint8_t version_valid;
+} fpd_mdata_probe_t;
+
 /*
  * If meta version is 2 or 3 validate version, else return error EBADR.
  * Check magic number, if good fill in size, pid_list, return 0
@@ -494,11 +534,109 @@ int get_img_metadata(const char *path, uint32_t *img_size, void **img,
                      uint32_t *mdata_size, void **mdata, char *err_msg,
                      uint32_t msg_size);
 
+/*
+ * Read only the metadata block of the image at path. Results are cached
+ * by (path, inode, mtime), so repeated probes of an unchanged file do no
+ * I/O at all. If mdata is not NULL it receives a malloc'd copy of the
+ * metadata block that the caller must free.
+ */
+int fpd_mdata_probe(const char *path, fpd_mdata_probe_t *probe, void **mdata,
+                    char *err_msg, uint32_t msg_size);
+
+/*
+ * Map the image at path read-only for sequential access and locate its
+ * metadata and payload. Release with fpd_img_unmap().
+ */
+int fpd_img_map(const char *path, fpd_img_map_t *map,
+                char *err_msg, uint32_t msg_size);
+void fpd_img_unmap(fpd_img_map_t *map);
+
+/*
+ * Release everything returned by get_imgs_info() and fpd_find_img()
+ */
+void fpd_free_imgs_info(fpd_imgs_t *fpd_imgs);
+
+/*
+ * Chunked access to the payload of an image. A compressed payload is
+ * inflated by a worker thread into one of two fixed windows while the
+ * caller writes out the other, so memory use is bounded by the window
+ * size and decompression overlaps the device writes. An uncompressed
+ * payload is handed out as slices of the image without any copy.
+ */
+#define FPD_STREAM_CHUNK_MIN    (64 * 1024)
+#define FPD_STREAM_CHUNK_MAX    (256 * 1024)
+#define FPD_STREAM_CHUNK_SIZE   (128 * 1024)
+
+typedef struct fpd_img_stream_ fpd_img_stream_t;
+
+int fpd_img_stream_open(fpd_meta_info_t *fpd_meta, uint32_t chunk_size,
+                        fpd_img_stream_t **stream,
+                        char *err_msg, uint32_t msg_size);
+
+/*
+ * Get the next chunk of the payload. The chunk stays valid until the
+ * following call. *len is 0 once the payload is exhausted.
+ */
+int fpd_img_stream_next(fpd_img_stream_t *stream, const void **chunk,
+                        uint32_t *len, char *err_msg, uint32_t msg_size);
+
+void fpd_img_stream_close(fpd_img_stream_t *stream);
+
+/*
+ * Compare the MD5 of the payload produced by a fully drained stream with
+ * the fw_md5 of the metadata. Returns 0 on match, EBADMSG on mismatch and
+ * ENODATA if the metadata carries no digest (v1 images).
+ */
+int fpd_img_stream_check_digest(fpd_img_stream_t *stream,
+                                char *err_msg, uint32_t msg_size);
+
+/*
+ * Hash the whole (inflated) payload and compare it with fw_md5, without
+ * writing anything anywhere. Same return codes as above.
+ */
+int fpd_img_verify_digest(fpd_meta_info_t *fpd_meta, char *err_msg,
+                          uint32_t msg_size);
+
 int img_inflate(fpd_meta_info_t *fpd_meta, void **data,
                 char *err_msg, uint32_t msg_size);
 
+/*
+ * Encode data as a zstd payload of FPD_ZSTD_FRAME_SIZE frames. *out is
+ * malloc()ed and owned by the caller.
+ */
+int fpd_zstd_encode(const void *data, uint32_t size, int level,
+                    void **out, uint32_t *out_size,
+                    char *err_msg, uint32_t msg_size);
+
 int fpd_find_img(fpd_imgs_t *fpd_imgs, const char *pid, char *name, char *name2);
 
+/*
+ * Catalog of an image bundle with a hash index over the PIDs and FPD names
+ * of every image. Building it reads the bundle header and the metadata of
+ * each image from the file mapping; payload pages are only touched once
+ * an image is picked and streamed with fpd_img_stream_open().
+ */
+typedef struct fpd_catalog_ fpd_catalog_t;
+
+int fpd_catalog_open(const char *path, fpd_catalog_t **catalog,
+                     char *err_msg, uint32_t msg_size);
+
+/*
+ * Images matching all of pid, name and name2 (NULL matches anything), in
+ * bundle order. Up to max_matches are stored in matches; the return value
+ * is the number stored.
+ */
+int fpd_catalog_lookup(fpd_catalog_t *catalog, const char *pid,
+                       const char *name, const char *name2,
+                       fpd_meta_info_t **matches, uint32_t max_matches);
+
+/*
+ * Image list behind the catalog, valid until fpd_catalog_close()
+ */
+fpd_imgs_t *fpd_catalog_imgs(fpd_catalog_t *catalog);
+
+void fpd_catalog_close(fpd_catalog_t *catalog);
+
 void fpd_print_meta_info(fpd_meta_info_t *fpd);
 void fpd_print_imgs_info(fpd_imgs_t *fpd_imgs);
 
@@ -506,7 +644,8 @@ void fpd_print_imgs_info(fpd_imgs_t *fpd_imgs);
 }
 #endif
 
-void * get_pinpointer_block_virtual_addr(int pim, uint64_t block_offset);
+void * get_pinpointer_block_virtual_addr(int pim, uint64_t block_offset,
+                                         size_t block_size);
 
 void * get_cyclonus_block_virtual_addr(uint64_t block_offset);
 
@@ -16,6 +16,10 @@ public:
 
     void program(bool force = false) const override;
     void erase() const override;
+    void stage(uint32_t rate_kbs = 0) const override;
+    void commit() const override;
+    std::string verify() const override;
+    std::string read(const std::string &out_path) const override;
 
     std::string running_version() const override;
 
@@ -0,0 +1,112 @@
+/*------------------------------------------------------------------
+ * fpdJournal.h
+ *
+ * Persistent record of how far a flash image program got, so that an
+ * interrupted program can be picked up where it stopped.
+ *
+ * Copyright (c) 2022 by Cisco Systems, Inc.
+ * All rights reserved.
+ *-----------------------------------------------------------------
+ */
+
+#ifndef __FPDJOURNAL_H__
+#define __FPDJOURNAL_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Journals live in the first of these directories that exists; the
+ * environment variable overrides them. /mnt/data1 survives a reboot.
+ */
+#define FPD_JOURNAL_ENV             "FPD_JOURNAL_DIR"
+#define FPD_JOURNAL_DIRS            { "/mnt/data1", "/var/lib", "/var/tmp" }
+
+#define FPD_JOURNAL_MAGIC           0x46504A4E  /* "FPJN" */
+#define FPD_JOURNAL_VERSION         1
+#define FPD_JOURNAL_DIGEST_LEN      16
+
+/*
+ * On disk record, rewritten in place after every completed sector. It
+ * is smaller than a disk block, so an update is never torn.
+ */
+typedef struct fpd_journal_rec_ {
+    uint32_t magic;
+    uint32_t version;
+
+    /*
+     * MD5 of the image metadata when the payload was checked against its
+     * fw_md5, which then covers the payload too; of the whole image file
+     * being programmed otherwise
+     */
+    uint8_t digest[FPD_JOURNAL_DIGEST_LEN];
+
+    /* where the image goes and the sector size it was written with */
+    uint32_t image_offset;
+    uint32_t image_size;
+    uint32_t mdata_offset;
+    uint32_t sector_size;
+
+    /*
+     * Number of sectors, counted from the one holding image_offset, that
+     * hold their final contents. Sectors are done strictly in order.
+     */
+    uint32_t sectors_done;
+} fpd_journal_rec_t;
+
+typedef struct fpd_journal_ {
+    int fd;                     /* -1 when journaling is off */
+    char path[256];
+    fpd_journal_rec_t rec;
+} fpd_journal_t;
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/*
+ * @brief  Api to compute the digest identifying an image in the journal,
+ *         over the metadata alone when it carries a verified fw_md5
+ */
+void fpd_journal_digest(const void *data, size_t len,
+                        uint8_t digest[FPD_JOURNAL_DIGEST_LEN]);
+
+/*
+ * @brief  Api to open the journal of block_name for the image described
+ *         by the rec fields other than sectors_done. A journal left by an
+ *         earlier run of the same image and layout is kept, anything else
+ *         is started over.
+ * @return Return the sectors already done, 0 for a fresh journal. On
+ *         any error the journal is turned off and 0 returned.
+ */
+uint32_t fpd_journal_open(fpd_journal_t *journal, const char *block_name,
+                          const fpd_journal_rec_t *rec);
+
+/*
+ * @brief  Api to record that sectors_done sectors are complete and make
+ *         it durable
+ * @return Return 0, errno if the journal could not be written; the
+ *         journal is turned off then
+ */
+int fpd_journal_update(fpd_journal_t *journal, uint32_t sectors_done);
+
+/*
+ * @brief  Api to close the journal, removing it if the program finished
+ */
+void fpd_journal_close(fpd_journal_t *journal, bool finished);
+
+/*
+ * @brief  Api to remove the journal of block_name, if any, so that nothing
+ *         written before is trusted; for anything that changes the flash
+ *         behind the journal's back, like an erase
+ * @return Return 0, errno if an existing journal could not be removed
+ */
+int fpd_journal_remove(const char *block_name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __FPDJOURNAL_H__
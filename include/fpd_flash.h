@@ -9,6 +9,8 @@
 #ifndef FPD_FLASH_H_
 #define FPD_FLASH_H_
 
+#include "iofpga_sjtag_fpd.h"
+
 //!
 //! @brief Program FLASH FPD
 //!
@@ -17,6 +19,81 @@
 extern "C" int program_iofpga(const char *image_path, uint32_t image_offset, uint32_t image_size,
                               uint32_t mdata_offset, uint32_t mdata_size, const char *uio_block_name);
 
+//!
+//! @brief Program FLASH FPD, reporting progress while it runs
+//!
+//! @param[in] progress_cb  called with the progress of each phase, may be NULL
+//!
+extern "C" int program_iofpga_progress(const char *image_path, uint32_t image_offset,
+                                       uint32_t image_size, uint32_t mdata_offset,
+                                       uint32_t mdata_size, const char *uio_block_name,
+                                       fpd_progress_cb_t progress_cb, void *progress_ctx);
+
+//!
+//! @brief Stage FLASH FPD: write and verify the image at low priority,
+//!        leaving the metadata erased until commit_iofpga()
+//!
+//! The region must not be the one the FPGA booted from: its metadata is
+//! erased until the commit.
+//!
+//! @param[in] rate_kbs  image KB/s to stay under, 0 for no limit
+//!
+//! @returns 0 on success, errno otherwise
+//!
+extern "C" int stage_iofpga(const char *image_path, uint32_t image_offset,
+                            uint32_t image_size, uint32_t mdata_offset,
+                            uint32_t mdata_size, const char *uio_block_name,
+                            uint32_t rate_kbs, fpd_progress_cb_t progress_cb,
+                            void *progress_ctx);
+
+//!
+//! @brief Commit an image staged by stage_iofpga() by writing its metadata
+//!
+//! @returns 0 on success, ENOENT if the image is not fully staged, errno
+//!          otherwise
+//!
+extern "C" int commit_iofpga(const char *image_path, uint32_t image_offset,
+                             uint32_t image_size, uint32_t mdata_offset,
+                             uint32_t mdata_size, const char *uio_block_name);
+
+//!
+//! @brief Program several FLASH FPDs at once, one thread per request
+//!
+//! @param[in,out] reqs  flashes to program; rc of each is filled in
+//!
+//! @returns 0 if all succeeded, else the rc of the first failed request
+//!
+extern "C" int program_iofpga_multi(iofpga_program_req_t *reqs, int count);
+
+//!
+//! @brief Compare the image and metadata regions of FLASH FPD with an image
+//!        file: the metadata byte for byte, the image by its md5, falling
+//!        back to a byte compare without one or on a mismatch
+//!
+//! @param[out] msg  summary with the throughput, or the reason of failure
+//!
+//! @returns 0 if the flash holds the image, EFAULT at the first difference,
+//!          another errno on failure
+//!
+extern "C" int verify_iofpga(const char *image_path, uint32_t image_offset,
+                             uint32_t image_size, uint32_t mdata_offset,
+                             uint32_t mdata_size, const char *uio_block_name,
+                             fpd_progress_cb_t progress_cb, void *progress_ctx,
+                             char *msg, uint32_t msg_size);
+
+//!
+//! @brief Read a region of FLASH FPD into a file
+//!
+//! @param[in]  size  bytes to read, 0 for up to the end of the flash
+//! @param[out] msg   summary with the throughput, or the reason of failure
+//!
+//! @returns 0 on success, errno on failure
+//!
+extern "C" int read_iofpga(const char *uio_block_name, uint32_t offset,
+                           uint32_t size, const char *out_path,
+                           fpd_progress_cb_t progress_cb, void *progress_ctx,
+                           char *msg, uint32_t msg_size);
+
 //!
 //! @brief Erase FLASH FPD
 //!
@@ -25,6 +102,16 @@ extern "C" int program_iofpga(const char *image_path, uint32_t image_offset, uin
 extern "C" int erase_iofpga(uint32_t image_offset, uint32_t image_size,
                             uint32_t mdata_offset, uint32_t mdata_size, const char *uio_block_name);
 
+//!
+//! @brief Erase FLASH FPD, reporting progress while it runs
+//!
+//! @param[in] progress_cb  called with the progress of the erase, may be NULL
+//!
+extern "C" int erase_iofpga_progress(uint32_t image_offset, uint32_t image_size,
+                                     uint32_t mdata_offset, uint32_t mdata_size,
+                                     const char *uio_block_name,
+                                     fpd_progress_cb_t progress_cb, void *progress_ctx);
+
 //!
 //! @brief Get the running version of Flash FPD
 //!
@@ -46,4 +133,16 @@ extern "C" int is_golden_booted(const char *uio_block_name);
 //!
 extern "C" uint16_t get_iofpga_version_from_flash(const char *block_name, uint32_t mdata_offset);
 
+//!
+//! @brief reads iofpga version from flash along with a checksum of the
+//!        flash metadata it is taken from
+//!
+//! @param[out] version   major and minor version
+//! @param[out] checksum  crc32 of the metadata, may be NULL
+//!
+//! @returns 0 on success, -1 if the flash could not be read
+//!
+extern "C" int get_iofpga_mdata_from_flash(const char *block_name, uint32_t mdata_offset,
+                                           uint16_t *version, uint32_t *checksum);
+
 #endif // FPD_FLASH_H_
@@ -5,4 +5,42 @@
  * All rights reserved.
  */
 
+#ifndef FPD_UTILS_H_
+#define FPD_UTILS_H_
+
+#include <cstdint>
+#include <string>
+
 std::string exec_shell_command(const char*);
+
+//
+// Golden images only change when we program them, so their versions are
+// kept in a file across runs and reading one needs neither the SPI flash
+// nor a switch of the BIOS flash region. An entry holds for one flash
+// location (source). An FPGA entry is checked against the crc32 of the
+// metadata sector on every query, so a golden image written by other
+// means shows up at once. The BIOS has no such cheap read: its entry
+// trusts that golden flash is only written through this tool, and an
+// image written by other means stays stale until the file is removed.
+//
+struct golden_version_t {
+    std::string source;
+    std::string version;
+    uint32_t checksum = 0;      // crc32 of the FPGA metadata, 0 for the BIOS
+};
+
+//
+// Look the golden version of fpd up; false if it has to be read from flash
+//
+bool golden_cache_get(const std::string &fpd, const std::string &source,
+                      golden_version_t &entry);
+
+void golden_cache_put(const std::string &fpd, const golden_version_t &entry);
+
+//
+// Forget the version before the flash is written. With pending the flash
+// changes at the next reboot, and nothing is cached for fpd until then.
+//
+void golden_cache_drop(const std::string &fpd, bool pending = false);
+
+#endif // FPD_UTILS_H_
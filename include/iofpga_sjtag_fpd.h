@@ -12,6 +12,7 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <endian.h>
+#include <pthread.h>
 #include "spiflash_util.h"
 #include "commonUtil.h"
 
@@ -174,4 +175,116 @@ typedef struct sjtag_rf_v4 fpgalib_sjtag_regs_t;
 
 typedef struct sj_spi_csrs fpgalib_sjtag_cfgspi_reg_t;
 
+#define SJTAG_MAX_CTXS              16
+#define SJTAG_BLOCK_NAME_LEN        32
+
+typedef enum sjtag_wait_kind_ {
+    SJTAG_WAIT_TRANS,   /* controller busy / done */
+    SJTAG_WAIT_WIP,     /* flash status register WIP */
+    SJTAG_WAIT_FSR,     /* flash flag status register ready */
+    SJTAG_WAIT_MAX,
+} sjtag_wait_kind_t;
+
+/*
+ * Per device state. A context is created the first time a block is
+ * accessed and is kept for the life of the process, so the block is mapped
+ * and the SPI flash identified (JEDEC ID / CFI) only once no matter how many
+ * version, program or erase requests are made against it.
+ *
+ * Every register access goes through the context it is made for, so
+ * different blocks can be driven from different threads at the same time.
+ * Operations on one block are serialized by its lock.
+ */
+typedef struct sjtag_ctx_ {
+    char block_name[SJTAG_BLOCK_NAME_LEN];
+    pthread_mutex_t lock;
+
+    /* register window of the block */
+    void *map_base;
+
+    /* software model standing in for the block, see sjtagSim.h */
+    struct sjtag_sim_ *sim;
+
+    /* UIO interrupt, -1 if none, and waits it has failed to signal */
+    int uio_fd;
+    uint32_t uio_misses;
+
+    /* SPI flash configuration, decoded on first use */
+    spi_cfi_t cfi;
+    bool cfi_valid;
+
+    /* extended address register of the flash, -1 if not known */
+    int bank_addr;
+
+    /* image range erased by erase_iofpga() and not written since */
+    uint32_t erased_offset;
+    uint32_t erased_size;
+
+    /* running average of each kind of completion wait */
+    uint64_t wait_avg_ns[SJTAG_WAIT_MAX];
+
+    /* reason of the last failed operation */
+    char err_msg[ERRBUF_SIZE];
+} sjtag_ctx_t;
+
+/*
+ * Find or create the context of block_name. Returns NULL if the block
+ * cannot be mapped.
+ */
+sjtag_ctx_t *sjtag_ctx_open(const char *block_name);
+
+/*
+ * Decode the SPI flash configuration of the context on first use.
+ * Returns 0 on success, -1 on failure with the reason in ctx->err_msg.
+ */
+int sjtag_ctx_spi_cfg(sjtag_ctx_t *ctx);
+
+/*
+ * Progress of a program or erase of a block, handed to an
+ * fpd_progress_cb_t at the start and end of each phase and at most every
+ * FPD_PROGRESS_INTERVAL_MS in between. mbps is the rate since the
+ * previous report and eta_sec the time left in the phase at that rate,
+ * -1 while not known yet.
+ */
+#define FPD_PROGRESS_INTERVAL_MS    500
+
+/*
+ * Where the time of a phase went, handed with its last report
+ */
+typedef struct fpd_phase_times_ {
+    double load_sec;            /* mapping the image, checking its md5 */
+    double inflate_sec;
+    double erase_sec;
+    double program_sec;
+    double verify_sec;          /* reading back, comparing, blank checks */
+} fpd_phase_times_t;
+
+typedef struct fpd_progress_ {
+    const char *block_name;
+    const char *phase;          /* "erase", "program" or "metadata" */
+    uint64_t bytes_done;
+    uint64_t bytes_total;
+    double mbps;
+    double eta_sec;
+    const fpd_phase_times_t *times;     /* last report of a phase, or NULL */
+} fpd_progress_t;
+
+typedef void (*fpd_progress_cb_t)(void *cb_ctx, const fpd_progress_t *progress);
+
+/*
+ * One flash to program with program_iofpga_multi(). rc is filled in with
+ * the result of program_iofpga_progress() for the block.
+ */
+typedef struct iofpga_program_req_ {
+    const char *image_path;
+    uint32_t image_offset;
+    uint32_t image_size;
+    uint32_t mdata_offset;
+    uint32_t mdata_size;
+    const char *block_name;
+    fpd_progress_cb_t progress_cb;      /* may be NULL */
+    void *progress_ctx;
+    int rc;
+} iofpga_program_req_t;
+
 #endif // __IOFPGA_SJTAG_FPD_H__
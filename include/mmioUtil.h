@@ -0,0 +1,110 @@
+/*------------------------------------------------------------------
+ * mmioUtil.h
+ *
+ * Copyright (c) 2022 by Cisco Systems, Inc.
+ * All rights reserved.
+ *-----------------------------------------------------------------
+ */
+
+#ifndef __MMIOUTIL_H__
+#define __MMIOUTIL_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define PCI_SYSFS_DEVICES_PATH      "/sys/bus/pci/devices"
+#define PCI_VENDOR_ANY              0xFFFF
+#define PCI_MAX_BARS                6
+
+#define SILVERBOLT_PCI_DEVICE_ID    0x017a
+#define SILVERBOLT_BAR_SIZE         (64ULL << 20)
+#define CYCLONUS_PCI_DEVICE_ID      0x0177
+#define CYCLONUS_BAR_SIZE           (4ULL << 20)
+
+/*
+ * PCI memory regions known to the FPD utilities. Each region is looked up
+ * once by device id and BAR size and stays mapped for the life of the
+ * process.
+ */
+typedef enum mmio_region_ {
+    MMIO_REGION_SILVERBOLT,
+    MMIO_REGION_CYCLONUS,
+    MMIO_REGION_MAX,
+} mmio_region_en;
+
+typedef struct mmio_bar_ {
+    /* PCI address of the owning function, e.g. 0000:07:00.0 */
+    char bdf[16];
+
+    /* BAR index, i.e. the N of the sysfs resourceN file */
+    int bar;
+
+    /* Bus address and length of the BAR */
+    uint64_t phys;
+    uint64_t size;
+
+    /* Process virtual address of the whole BAR */
+    volatile uint8_t *virt;
+} mmio_bar_t;
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/*
+ * @brief  Api to get the mapping of a PCI memory region. The BAR is
+ *         resolved through sysfs and mmapped on first use only.
+ * @return Return pointer to the cached BAR, NULL if errored
+ */
+const mmio_bar_t *mmio_get_bar(mmio_region_en region);
+
+/*
+ * @brief  Api to get a register view into a PCI memory region
+ * @return Return register pointer at offset, NULL if the region cannot
+ *         be mapped or the access of len bytes falls outside the BAR
+ */
+volatile void *mmio_region_regs(mmio_region_en region, uint64_t offset,
+                                size_t len);
+
+/*
+ * @brief  Api to get a register view into the SILVERBOLT BAR
+ */
+volatile uint32_t *mmio_silverbolt_regs(uint64_t offset);
+
+/*
+ * @brief  Api to get a register view into the CYCLONUS BAR
+ */
+volatile uint32_t *mmio_cyclonus_regs(uint64_t offset);
+
+/*
+ * @brief  Api to get a register view of len bytes into the SLPC window
+ *         of a PIM (1 based) behind SILVERBOLT
+ * @return Return register pointer at offset, NULL if the BAR cannot be
+ *         mapped or the len bytes fall outside it
+ */
+volatile uint32_t *mmio_pim_regs(int pim, uint64_t offset, size_t len);
+
+/*
+ * @brief  Api to unmap all cached regions. Only needed by callers that
+ *         want to release the mappings before exit.
+ */
+void mmio_release_all(void);
+
+static inline uint32_t
+mmio_read32(volatile uint32_t *regs, uint32_t offset)
+{
+    return regs[offset / sizeof(uint32_t)];
+}
+
+static inline void
+mmio_write32(volatile uint32_t *regs, uint32_t offset, uint32_t value)
+{
+    regs[offset / sizeof(uint32_t)] = value;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __MMIOUTIL_H__
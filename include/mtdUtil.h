@@ -0,0 +1,69 @@
+/*------------------------------------------------------------------
+ * mtdUtil.h
+ *
+ * Access to MTD flash partitions through their char devices.
+ *
+ * Copyright (c) 2022 by Cisco Systems, Inc.
+ * All rights reserved.
+ *-----------------------------------------------------------------
+ */
+
+#ifndef __MTDUTIL_H__
+#define __MTDUTIL_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define MTD_PROC_FILE           "/proc/mtd"
+#define MTD_DEV_NAME_LEN        32
+
+/*
+ * What mtd_write_file() did with each erase block the image covers
+ */
+typedef struct mtd_write_stats_ {
+    uint32_t erasesize;
+    uint32_t blocks;            /* erase blocks the image covers */
+    uint32_t unchanged;         /* already held the image, left alone */
+    uint32_t erased;            /* had to be erased before the write */
+    uint32_t written;           /* written and read back */
+} mtd_write_stats_t;
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/*
+ * @brief  Api to find the char device of the first partition in /proc/mtd
+ *         whose name contains name, ignoring case
+ * @return Return 0 with dev set to "/dev/mtdN", ENODEV if no partition
+ *         matches, errno otherwise
+ */
+int mtd_find_device(const char *name, char *dev, size_t dev_size,
+                    char *err_msg, uint32_t msg_size);
+
+/*
+ * @brief  Api to read len bytes at offset of an MTD char device
+ * @return Return 0, errno on failure or short read
+ */
+int mtd_read(const char *dev, uint64_t offset, void *buf, size_t len,
+             char *err_msg, uint32_t msg_size);
+
+/*
+ * @brief  Api to program the MTD partition named name (the whole name)
+ *         with the file at path from src_offset to its end, one erase
+ *         block at a time. A block is skipped when the flash already
+ *         holds it, erased only when it is not blank, and read back after
+ *         the write. The tail of the last block is padded with 0xff.
+ * @return Return 0, EFBIG if the image is larger than the partition,
+ *         EIO if a block does not read back as written, errno otherwise
+ */
+int mtd_write_file(const char *name, const char *path, uint64_t src_offset,
+                   mtd_write_stats_t *stats, char *err_msg, uint32_t msg_size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __MTDUTIL_H__
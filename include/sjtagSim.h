@@ -0,0 +1,108 @@
+/*------------------------------------------------------------------
+ * sjtagSim.h
+ *
+ * Software model of an SJTAG SPI controller block and the SPI flash
+ * behind it, so the flash engine can be run without an FPGA.
+ *
+ * Copyright (c) 2022 by Cisco Systems, Inc.
+ * All rights reserved.
+ *-----------------------------------------------------------------
+ */
+
+#ifndef __SJTAGSIM_H__
+#define __SJTAGSIM_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Setting this environment variable makes every SJTAG block open on the
+ * simulator instead of the hardware. The value is a comma separated list
+ * of key=value settings, see sjtag_sim_cfg_parse(); "1" takes defaults.
+ */
+#define SJTAG_SIM_ENV               "FPD_SJTAG_SIM"
+
+#define SJTAG_SIM_JEDEC_ID_LEN      5
+
+typedef struct sjtag_sim_ sjtag_sim_t;
+
+typedef struct sjtag_sim_cfg_ {
+    /* index into the SPI flash model table, 0 for the default model */
+    int model;
+
+    /* bytes returned for the JEDEC READ ID opcodes */
+    uint8_t jedec_id[SJTAG_SIM_JEDEC_ID_LEN];
+
+    /* flash geometry in bytes; programs wrap within a page */
+    uint32_t capacity;
+    uint32_t page_size;
+    uint32_t sector_size;
+    uint32_t subsector_size;
+
+    /* SPI clock of the controller, 0 for no transfer time */
+    uint32_t spi_khz;
+
+    /* busy time of the flash after each operation */
+    uint32_t page_program_us;
+    uint32_t sector_erase_us;
+    uint32_t subsector_erase_us;
+    uint32_t bulk_erase_us;
+
+    /*
+     * Directory keeping one <block>.bin file of flash contents per block,
+     * so they survive the process. Empty keeps the flash in memory only.
+     */
+    char dir[128];
+} sjtag_sim_cfg_t;
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/*
+ * @brief  Api to fill cfg with the default latencies and apply the
+ *         settings of spec on top. Geometry left 0 is up to the caller.
+ *         Keys: model, dir, spi_khz, page, sector, subsector,
+ *         program_us, erase_us, subsector_erase_us, bulk_erase_us
+ * @return Return 0, EINVAL on an unknown key or bad value
+ */
+int sjtag_sim_cfg_parse(sjtag_sim_cfg_t *cfg, const char *spec);
+
+/*
+ * @brief  Api to create the simulated controller of block_name
+ * @return Return the simulator, NULL with errno set if errored
+ */
+sjtag_sim_t *sjtag_sim_create(const sjtag_sim_cfg_t *cfg,
+                              const char *block_name);
+
+/*
+ * @brief  Api to release a simulator and its flash contents
+ */
+void sjtag_sim_destroy(sjtag_sim_t *sim);
+
+/*
+ * @brief  Api to get the anonymous mapping that stands in for the
+ *         register window of the block
+ */
+void *sjtag_sim_regs(sjtag_sim_t *sim);
+
+/*
+ * @brief  Api to emulate a 32 bit register store / load at offset into
+ *         the register window
+ */
+void sjtag_sim_reg_write(sjtag_sim_t *sim, uint32_t offset, uint32_t value);
+uint32_t sjtag_sim_reg_read(sjtag_sim_t *sim, uint32_t offset);
+
+/*
+ * @brief  Api to move count dwords through the data fifo register
+ */
+void sjtag_sim_fifo_write(sjtag_sim_t *sim, const uint32_t *data,
+                          uint32_t count);
+void sjtag_sim_fifo_read(sjtag_sim_t *sim, uint32_t *data, uint32_t count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __SJTAGSIM_H__
@@ -23,6 +23,16 @@ typedef enum fpgalib_spi_mode_ {
 
 } fpgalib_spi_mode_en;
 
+/*
+ * Values of spi_cfi_t verify_flag
+ */
+/* No read back */
+#define SPIFLASH_VERIFY_NONE    0
+/* Read the whole range back once it has been programmed */
+#define SPIFLASH_VERIFY_PASS    1
+/* Read every page back as soon as it has been written */
+#define SPIFLASH_VERIFY_INLINE  2
+
 /*
  * Common Flash Interface information that may be read from a flash memory
  * device. Software can query the installed device to determine
@@ -56,7 +66,7 @@ typedef struct spi_cfi_ {
   /* Delay factor for operation to be completed in 100 micro seconds */
   uint8_t delay_factor;
 
-  /* Whether required to verify the programmed data */
+  /* Whether required to verify the programmed data, SPIFLASH_VERIFY_* */
   uint8_t verify_flag;
 
   /* Whether flash supports Block erase */
@@ -311,6 +311,8 @@ int ssd_get_img_metadata(const char *path, uint32_t *img_size, void **img,
                      uint32_t *mdata_size, void **mdata, char *err_msg,
                      uint32_t msg_size);
 
+void ssd_put_img_metadata(void *mdata, uint32_t mdata_size, uint32_t img_size);
+
 typedef uint32_t cpa_status_t;
 cpa_status_t
 ssd_cpa_get_shell_cmd_output (char      *buff,
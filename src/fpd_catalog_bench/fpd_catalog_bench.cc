@@ -0,0 +1,152 @@
+/**
+ * @file fpd_catalog_bench.cc
+ *
+ * @brief Time image selection in an FPD bundle, catalog against linear scan
+ *
+ * @copyright Copyright (c) 2022 by Cisco Systems, Inc.
+ *            All rights reserved.
+ *
+ * Builds the catalog of a bundle, then times fpd_catalog_lookup() and
+ * fpd_find_img() for the same keys and counts the page faults of building
+ * the catalog and of streaming the selected payload. Keys default to the
+ * first PID and FPD name of the last image in the bundle.
+ *
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <sys/resource.h>
+
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <string>
+
+#include "commonUtil.h"
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s <bundle> [pid [name [name2]]]\n"
+                    "  \"-\" leaves a key out\n",
+            prog);
+}
+
+static long
+minor_faults()
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_minflt;
+}
+
+//
+// Microseconds per call of fn, repeated for at least half a second
+//
+static double
+usec_per_call(const std::function<void()> &fn)
+{
+    std::chrono::duration<double> secs{0};
+    uint64_t calls = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    while (secs.count() < 0.5) {
+        for (int i = 0; i < 1000; i++) {
+            fn();
+        }
+        calls += 1000;
+        secs = std::chrono::steady_clock::now() - start;
+    }
+    return secs.count() * 1e6 / calls;
+}
+
+static const char *
+key_arg(int argc, char **argv, int i, const char *dflt)
+{
+    if (i >= argc) {
+        return dflt;
+    }
+    return strcmp(argv[i], "-") ? argv[i] : NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+    char err_msg[ERRBUF_SIZE] = {0};
+    fpd_catalog_t *catalog;
+    fpd_meta_info_t *match[2];
+
+    if (argc < 2) {
+        usage(argv[0]);
+        return EX_USAGE;
+    }
+
+    long faults = minor_faults();
+    auto start = std::chrono::steady_clock::now();
+    if (fpd_catalog_open(argv[1], &catalog, err_msg, sizeof(err_msg))) {
+        fprintf(stderr, "%s: %s\n", argv[1], err_msg);
+        return EX_DATAERR;
+    }
+    std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+    fpd_imgs_t *imgs = fpd_catalog_imgs(catalog);
+    printf("catalog   %u images in %.0f us, %ld page faults\n", imgs->num_imgs,
+           secs.count() * 1e6, minor_faults() - faults);
+    if (!imgs->num_imgs) {
+        fpd_catalog_close(catalog);
+        return EX_DATAERR;
+    }
+
+    fpd_meta_info_t *last = &imgs->meta[imgs->num_imgs - 1];
+    const char *pid = key_arg(argc, argv, 2, last->pid_size ? last->pid_list[0] : NULL);
+    const char *name = key_arg(argc, argv, 3, last->name_size ? last->name_list[0] : NULL);
+    const char *name2 = key_arg(argc, argv, 4, NULL);
+    printf("keys      pid %s, name %s, name2 %s\n", pid ? pid : "-",
+           name ? name : "-", name2 ? name2 : "-");
+
+    int found = fpd_catalog_lookup(catalog, pid, name, name2, match, 2);
+    double lookup_us = usec_per_call([&] {
+        fpd_catalog_lookup(catalog, pid, name, name2, match, 2);
+    });
+    printf("lookup    %d matches, %.3f us\n", found, lookup_us);
+
+    // fpd_find_img() leaves its flags and match list behind, reset them
+    // so every call does the full scan
+    double scan_us = usec_per_call([&] {
+        for (uint32_t i = 0; i < imgs->num_imgs; i++) {
+            imgs->meta[i].match_flags = 0;
+        }
+        free(imgs->match_list);
+        fpd_find_img(imgs, pid, (char *)name, (char *)name2);
+    });
+    printf("find_img  %u matches, %.3f us\n", imgs->match_count, scan_us);
+
+    int rc = 0;
+    if (found > 0) {
+        fpd_img_stream_t *stream = NULL;
+        const void *chunk;
+        uint32_t len;
+        uint64_t bytes = 0;
+
+        faults = minor_faults();
+        rc = fpd_img_stream_open(match[0], FPD_STREAM_CHUNK_SIZE, &stream,
+                                 err_msg, sizeof(err_msg));
+        while (!rc && !(rc = fpd_img_stream_next(stream, &chunk, &len, err_msg,
+                                                 sizeof(err_msg))) && len) {
+            bytes += len;
+        }
+        if (stream) {
+            fpd_img_stream_close(stream);
+        }
+        if (rc) {
+            fprintf(stderr, "stream: %s\n", err_msg);
+        } else {
+            printf("stream    %llu bytes of the first match, %ld page faults\n",
+                   (unsigned long long)bytes, minor_faults() - faults);
+        }
+    }
+    fpd_catalog_close(catalog);
+    return rc ? EX_SOFTWARE : EX_OK;
+}
@@ -0,0 +1,127 @@
+/**
+ * @file fpd_flash_bench.cc
+ *
+ * @brief Time the SJTAG flash engine against the software flash model
+ *
+ * @copyright Copyright (c) 2022 by Cisco Systems, Inc.
+ *            All rights reserved.
+ *
+ * Runs erase, program (with its verify pass), an unchanged reprogram and
+ * a version read of an FPD image on simulated SJTAG blocks, so throughput
+ * of the flash code can be measured on any Linux box. Flash model and
+ * latencies are taken from FPD_SJTAG_SIM, see sjtagSim.h.
+ *
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <sysexits.h>
+
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "fpd_flash.h"
+#include "sjtagSim.h"
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s <image> <image_offset> <image_size> <mdata_offset> "
+            "<mdata_size> [block ...]\n"
+            "  blocks default to IOFP-JTAG; several are programmed at once\n"
+            "  %s=key=value,... selects the flash model and latencies\n",
+            prog, SJTAG_SIM_ENV);
+}
+
+static void
+print_progress(void *cb_ctx, const fpd_progress_t *p)
+{
+    printf("  %s %-8s %10llu / %llu  %7.2f MB/s  eta %.1f s\n", p->block_name,
+           p->phase, (unsigned long long)p->bytes_done,
+           (unsigned long long)p->bytes_total, p->mbps, p->eta_sec);
+}
+
+static int
+run_phase(const char *name, uint64_t bytes, const std::function<int()> &fn)
+{
+    auto start = std::chrono::steady_clock::now();
+    int rc = fn();
+    std::chrono::duration<double> secs =
+        std::chrono::steady_clock::now() - start;
+
+    printf("=== %-10s %s %8.3f s", name, rc ? "FAILED" : "ok    ",
+           secs.count());
+    if (bytes && secs.count() > 0) {
+        printf("  %7.2f MB/s", bytes / secs.count() / (1024 * 1024));
+    }
+    printf("\n");
+    return rc;
+}
+
+int
+main(int argc, char **argv)
+{
+    if (argc < 6) {
+        usage(argv[0]);
+        return EX_USAGE;
+    }
+
+    /* Never touch real hardware from here */
+    setenv(SJTAG_SIM_ENV, "1", 0);
+
+    std::string image = argv[1];
+    uint32_t image_offset = std::stoul(argv[2], nullptr, 0);
+    uint32_t image_size = std::stoul(argv[3], nullptr, 0);
+    uint32_t mdata_offset = std::stoul(argv[4], nullptr, 0);
+    uint32_t mdata_size = std::stoul(argv[5], nullptr, 0);
+    std::vector<std::string> blocks(argv + 6, argv + argc);
+    if (blocks.empty()) {
+        blocks.push_back("IOFP-JTAG");
+    }
+    uint64_t bytes = (uint64_t)(image_size + mdata_size) * blocks.size();
+
+    std::vector<iofpga_program_req_t> reqs;
+    for (auto &block : blocks) {
+        iofpga_program_req_t req = {};
+        req.image_path = image.c_str();
+        req.image_offset = image_offset;
+        req.image_size = image_size;
+        req.mdata_offset = mdata_offset;
+        req.mdata_size = mdata_size;
+        req.block_name = block.c_str();
+        req.progress_cb = print_progress;
+        reqs.push_back(req);
+    }
+    auto program = [&]() {
+        return program_iofpga_multi(reqs.data(), reqs.size());
+    };
+
+    int rc = run_phase("erase", bytes, [&]() {
+        for (auto &block : blocks) {
+            int ret = erase_iofpga_progress(image_offset, image_size,
+                                            mdata_offset, mdata_size,
+                                            block.c_str(), print_progress,
+                                            NULL);
+            if (ret) {
+                return ret;
+            }
+        }
+        return 0;
+    });
+    rc = rc ? rc : run_phase("program", bytes, program);
+    rc = rc ? rc : run_phase("reprogram", bytes, program);
+    rc = rc ? rc : run_phase("version", 0, [&]() {
+        for (auto &block : blocks) {
+            uint16_t ver = get_iofpga_version_from_flash(block.c_str(),
+                                                         mdata_offset);
+            printf("%s: version %u.%u on flash\n", block.c_str(), ver >> 8,
+                   ver & 0xFF);
+        }
+        return 0;
+    });
+    return rc ? EX_SOFTWARE : EX_OK;
+}
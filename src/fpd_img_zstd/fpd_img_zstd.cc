@@ -0,0 +1,271 @@
+/**
+ * @file fpd_img_zstd.cc
+ *
+ * @brief Repack FPD images with a multi-frame zstd payload
+ *
+ * @copyright Copyright (c) 2022 by Cisco Systems, Inc.
+ *            All rights reserved.
+ *
+ * For each v2/v3 image given, compresses the payload with gzip and with
+ * zstd (FPD_ZSTD_FRAME_SIZE frames) and reports the size and decode
+ * throughput of both through img_inflate(), zstd both on one thread and
+ * on several. With -o the image is also written back out with the zstd
+ * payload and updated metadata.
+ *
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <openssl/evp.h>
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "commonUtil.h"
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-l level] [-j threads] [-o out_dir] <image> ...\n"
+            "  -l  zstd level, default 19\n"
+            "  -j  zstd decode threads to compare with one, default one per core\n"
+            "  -o  write each image repacked with zstd into out_dir\n",
+            prog);
+}
+
+//
+// MB/s of img_inflate() on meta with threads zstd decoders, repeated for
+// at least half a second
+//
+static double
+decode_mbps(fpd_meta_info_t &meta, int threads)
+{
+    char err_msg[ERRBUF_SIZE] = {0};
+    std::chrono::duration<double> secs{0};
+    uint64_t bytes = 0;
+
+    setenv(FPD_ZSTD_THREADS_ENV, std::to_string(threads).c_str(), 1);
+    while (secs.count() < 0.5) {
+        void *data = NULL;
+        auto start = std::chrono::steady_clock::now();
+        if (img_inflate(&meta, &data, err_msg, sizeof(err_msg))) {
+            fprintf(stderr, "decode failed: %s\n", err_msg);
+            return 0;
+        }
+        secs += std::chrono::steady_clock::now() - start;
+        free(data);
+        bytes += meta.img_msize;
+    }
+    return bytes / secs.count() / (1024 * 1024);
+}
+
+//
+// Where the v2/v3 metadata keeps its crc32
+//
+static uint8_t *
+mdata_crc32_field(std::vector<uint8_t> &mdata)
+{
+    fpd_meta_data_t *md = (fpd_meta_data_t *)mdata.data();
+
+    if (md->hdr.u.v2.metadata_version == FPD_META_DATA_VER_2) {
+        return mdata.data() + offsetof(fpd_mdata_hdr_v2_t, metadata_crc32);
+    }
+    return mdata.data() + offsetof(fpd_mdata_hdr_v3_t, metadata_crc32);
+}
+
+//
+// crc32 of the metadata as the image build takes it: over all of its
+// metadata_size bytes, with the crc32 field itself zeroed. Every v2/v3
+// image shipped under fpd/ checks out this way.
+//
+static uint32_t
+mdata_crc32(std::vector<uint8_t> mdata)
+{
+    uint32_t zero = 0;
+
+    memcpy(mdata_crc32_field(mdata), &zero, sizeof(zero));
+    return crc32(0, mdata.data(), mdata.size());
+}
+
+//
+// Point the metadata at a zstd payload of the plain image and reseal it.
+// The crc32 of the original is checked first, so an image whose metadata
+// follows some other convention is never resealed with a wrong one.
+//
+static int
+write_zstd_image(const std::string &path, fpd_img_map_t &map,
+                 const void *plain, uint32_t plain_size,
+                 const void *zstd, uint32_t zstd_size)
+{
+    std::vector<uint8_t> mdata((uint8_t *)map.mdata,
+                               (uint8_t *)map.mdata + map.mdata_size);
+    fpd_meta_data_t *md = (fpd_meta_data_t *)mdata.data();
+    unsigned int md5_len = 0;
+    uint32_t crc;
+    fpd_mdata_data_v2_t *v2;
+    fpd_mdata_data_v3_t *v3;
+
+    memcpy(&crc, mdata_crc32_field(mdata), sizeof(crc));
+    if (mdata_crc32(mdata) != crc) {
+        fprintf(stderr, "%s: metadata crc32 0x%08x does not check out, "
+                "not resealing it\n", path.c_str(), crc);
+        return EBADMSG;
+    }
+
+    if (md->hdr.u.v2.metadata_version == FPD_META_DATA_VER_2) {
+        v2 = (fpd_mdata_data_v2_t *)(mdata.data() + sizeof(fpd_mdata_hdr_v2_t));
+        v2->fw_type = FPD_FW_TYPE_ZSTD;
+        v2->fw_size = plain_size;
+        EVP_Digest(plain, plain_size, v2->fw_md5, &md5_len, EVP_md5(), NULL);
+    } else {
+        v3 = (fpd_mdata_data_v3_t *)(mdata.data() + sizeof(fpd_mdata_hdr_v3_t));
+        v3->fw_type = FPD_FW_TYPE_ZSTD;
+        v3->fw_size = plain_size;
+        EVP_Digest(plain, plain_size, v3->fw_md5, &md5_len, EVP_md5(), NULL);
+    }
+    crc = mdata_crc32(mdata);
+    memcpy(mdata_crc32_field(mdata), &crc, sizeof(crc));
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write((const char *)mdata.data(), mdata.size());
+    out.write((const char *)zstd, zstd_size);
+    return out.good() ? 0 : EIO;
+}
+
+static int
+repack(const std::string &path, int level, int threads,
+       const std::string &out_dir)
+{
+    char err_msg[ERRBUF_SIZE] = {0};
+    fpd_img_map_t map;
+    fpd_meta_info_t meta = {};
+    void *plain = NULL, *zstd = NULL;
+    uint32_t plain_size, zstd_size;
+    int rc;
+
+    rc = fpd_img_map(path.c_str(), &map, err_msg, sizeof(err_msg));
+    if (rc || !map.mdata) {
+        fprintf(stderr, "%s: not a single FPD image %s\n", path.c_str(), err_msg);
+        fpd_img_unmap(&map);
+        return rc ? rc : EINVAL;
+    }
+    rc = get_data_info(map.mdata, &meta, err_msg, sizeof(err_msg));
+    if (rc || meta.mver < FPD_META_DATA_VER_2) {
+        fprintf(stderr, "%s: needs v2/v3 metadata to carry a fw_type\n",
+                path.c_str());
+        free(meta.pid_list);
+        free(meta.name_list);
+        fpd_img_unmap(&map);
+        return rc ? rc : EINVAL;
+    }
+    meta.img = map.img;
+    meta.img_size = map.img_size;
+    if (!meta.compressed) {
+        meta.img_msize = meta.img_size;
+    }
+    rc = img_inflate(&meta, &plain, err_msg, sizeof(err_msg));
+    free(meta.pid_list);
+    free(meta.name_list);
+    if (rc) {
+        fprintf(stderr, "%s: %s\n", path.c_str(), err_msg);
+        fpd_img_unmap(&map);
+        return rc;
+    }
+    plain_size = meta.img_msize;
+
+    std::vector<uint8_t> gzip(compressBound(plain_size));
+    uLongf gzip_size = gzip.size();
+    rc = compress2(gzip.data(), &gzip_size, (const Bytef *)plain, plain_size,
+                   Z_BEST_COMPRESSION);
+    if (rc == Z_OK) {
+        rc = fpd_zstd_encode(plain, plain_size, level, &zstd, &zstd_size,
+                             err_msg, sizeof(err_msg));
+    } else {
+        snprintf(err_msg, sizeof(err_msg), "gzip failed %d", rc);
+        rc = EIO;
+    }
+    if (rc) {
+        fprintf(stderr, "%s: %s\n", path.c_str(), err_msg);
+    } else {
+        fpd_meta_info_t gz = {};
+        gz.img = gzip.data();
+        gz.img_size = gzip_size;
+        gz.img_msize = plain_size;
+        gz.compressed = FPD_FW_TYPE_GZIP;
+        fpd_meta_info_t zs = gz;
+        zs.img = zstd;
+        zs.img_size = zstd_size;
+        zs.compressed = FPD_FW_TYPE_ZSTD;
+
+        std::string name = path.substr(path.find_last_of('/') + 1);
+        printf("%-50s %9u  gzip %9lu %5.1f%% %7.1f MB/s  "
+               "zstd %9u %5.1f%% %7.1f MB/s %7.1f MB/s\n",
+               name.c_str(), plain_size,
+               gzip_size, 100.0 * gzip_size / plain_size, decode_mbps(gz, 1),
+               zstd_size, 100.0 * zstd_size / plain_size, decode_mbps(zs, 1),
+               decode_mbps(zs, threads));
+        if (!out_dir.empty()) {
+            rc = write_zstd_image(out_dir + "/" + name, map, plain, plain_size,
+                                  zstd, zstd_size);
+        }
+    }
+    free(zstd);
+    if (plain != meta.img) {
+        free(plain);
+    }
+    fpd_img_unmap(&map);
+    return rc;
+}
+
+int
+main(int argc, char **argv)
+{
+    std::string out_dir;
+    int level = 19;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt, rc = 0;
+
+    while ((opt = getopt(argc, argv, "l:j:o:")) != -1) {
+        switch (opt) {
+        case 'l':
+            level = atoi(optarg);
+            break;
+        case 'j':
+            threads = atol(optarg);
+            break;
+        case 'o':
+            out_dir = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return EX_USAGE;
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+        return EX_USAGE;
+    }
+
+    if (threads < 1) {
+        threads = 1;
+    } else if (threads > FPD_ZSTD_THREADS_MAX) {
+        threads = FPD_ZSTD_THREADS_MAX;
+    }
+
+    printf("%-50s %9s  %-32s %-32s\n", "image", "bytes", "gzip -9 size / decode",
+           ("zstd size / decode on 1, " + std::to_string(threads) + " threads").c_str());
+    for (int i = optind; i < argc; i++) {
+        if (repack(argv[i], level, threads, out_dir)) {
+            rc = EX_DATAERR;
+        }
+    }
+    return rc ? rc : EX_OK;
+}
@@ -15,6 +15,8 @@
 #include <wait.h>
 #include <fstream>
 #include <cmath>
+#include <map>
+#include <mutex>
 
 #include <bsp/fwd.h>
 #include <bsp/fpd.h>
@@ -41,6 +43,12 @@ fpd_proxy_t::~fpd_proxy_t() {
     }
 }
 
+//!
+//! @brief Driver instances already handed out by the factory, by oid
+//!
+static std::mutex proxies_m;
+static std::map<oid_t, pointer<fpd_proxy_t>> proxies;
+
 std::vector<std::shared_ptr<fpd_t>>
 fpd_t::factory(const std::string &ident)
 {
@@ -48,9 +56,13 @@ fpd_t::factory(const std::string &ident)
     std::vector<std::shared_ptr<fpd_t>> objs;
 
     if (!c.empty()) {
+        std::lock_guard<std::mutex> l(proxies_m);
         for (auto x : c) {
-            pointer<fpd_proxy_t> y = std::make_shared<fpd_proxy_t>(*x);
-            y->setup(x);
+            pointer<fpd_proxy_t> &y = proxies[x->oid()];
+            if (!y) {
+                y = std::make_shared<fpd_proxy_t>(*x);
+                y->setup(x);
+            }
             objs.push_back(y);
         }
         return objs;
@@ -212,6 +224,22 @@ fpd_t::erase() const
     throw std::system_error(ENOTSUP, std::generic_category(), info);
 }
 
+void
+fpd_t::stage(uint32_t rate_kbs) const
+{
+    std::string info(__func__);
+    info.append(": ");
+    throw std::system_error(ENOTSUP, std::generic_category(), info);
+}
+
+void
+fpd_t::commit() const
+{
+    std::string info(__func__);
+    info.append(": ");
+    throw std::system_error(ENOTSUP, std::generic_category(), info);
+}
+
 std::string
 fpd_t::verify() const
 {
@@ -220,6 +248,14 @@ fpd_t::verify() const
     throw std::system_error(ENOTSUP, std::generic_category(), info);
 }
 
+std::string
+fpd_t::read(const std::string &out_path) const
+{
+    std::string info(__func__);
+    info.append(": ");
+    throw std::system_error(ENOTSUP, std::generic_category(), info);
+}
+
 void
 fpd_t::activate() const
 {
@@ -313,6 +349,7 @@ fpd_t::invoke(const std::vector<std::string> &cmd,
     }
 
     /* Parent */
+    phase_timer_t helper("helper");
     for(;;) {
         int status;
         e = waitpid(pid, &status, 0);
@@ -5,7 +5,10 @@
  * All rights reserved.
  */
 
+#include <algorithm>
 #include <iostream>
+#include <iterator>
+#include <string_view>
 #include <bsp/fpd.h>
 #include <private/sysfs.h>
 
@@ -27,6 +30,53 @@ namespace bsp2 {
 std::string getSandiafpds();
 std::string getLassenfpds();
 
+namespace {
+
+//!
+//! @brief Entry of the FPD driver registry
+//!
+struct fpd_driver_t {
+    std::string_view symbol;                           //!< dllsymbol in the fpds metadata
+    fpd_t *(*create)(const fpd_t &);                   //!< Driver constructor
+};
+
+template<class D>
+fpd_t *
+make_driver(const fpd_t &fpd)
+{
+    return new D(fpd);
+}
+
+//!
+//! @brief FPD drivers built into the library, keyed by dllsymbol
+//!
+constexpr fpd_driver_t fpd_drivers[] = {
+    { "get_fpd_obj_sjtag",    make_driver<Fpd_flash> },
+    { "get_fpd_obj_pwrcpld",  make_driver<Fpd_powercpld> },
+    { "get_fpd_obj_cpucpld",  make_driver<Fpd_cpucpld> },
+    { "get_fpd_obj_nvme",     make_driver<Fpd_nvme> },
+    { "get_fpd_obj_ssd",      make_driver<Fpd_ssd> },
+    { "get_fpd_obj_bmc_bios", make_driver<Fpd_bmc_bios> },
+    { "get_fpd_obj_bios",     make_driver<Fpd_bios> },
+};
+
+constexpr bool
+fpd_drivers_unique()
+{
+    for (auto i = std::begin(fpd_drivers); i != std::end(fpd_drivers); ++i) {
+        for (auto j = std::next(i); j != std::end(fpd_drivers); ++j) {
+            if (i->symbol == j->symbol) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static_assert(fpd_drivers_unique(), "duplicate dllsymbol in FPD driver registry");
+
+} // namespace
+
 void
 fpd_proxy_t::setup(pointer<fpd_t> parent)
 {
@@ -34,29 +84,17 @@ fpd_proxy_t::setup(pointer<fpd_t> parent)
         return;
 
     const fpd_t& cobj = *parent;
-    fpd_t *lib_obj = NULL;
-    const std::string& lib_symbol = libsymbol();
-
-    if (!lib_symbol.compare("get_fpd_obj_sjtag")) {
-        lib_obj = new Fpd_flash(cobj);
-    } else if (!lib_symbol.compare("get_fpd_obj_pwrcpld")) {
-        lib_obj = new Fpd_powercpld(cobj);
-    } else if (!lib_symbol.compare("get_fpd_obj_cpucpld")) {
-        lib_obj = new Fpd_cpucpld(cobj);
-    } else if (!lib_symbol.compare("get_fpd_obj_nvme")) {
-        lib_obj = new Fpd_nvme(cobj);
-    } else if (!lib_symbol.compare("get_fpd_obj_ssd")) {
-        lib_obj = new Fpd_ssd(cobj);
-    } else if (!lib_symbol.compare("get_fpd_obj_bmc_bios")) {
-        lib_obj = new Fpd_bmc_bios(cobj);
-    } else if (!lib_symbol.compare("get_fpd_obj_bios")) {
-        lib_obj = new Fpd_bios(cobj);
-    }
+    const std::string_view lib_symbol = libsymbol();
 
-    if (!lib_obj) {
+    auto it = std::find_if(std::begin(fpd_drivers), std::end(fpd_drivers),
+                           [&lib_symbol](const fpd_driver_t &d) {
+                               return d.symbol == lib_symbol;
+                           });
+    if (it != std::end(fpd_drivers)) {
+        m_object = it->create(cobj);
+    } else {
         // These are implementations not available yet...
-        lib_obj = new fpd_t(cobj);
+        m_object = new fpd_t(cobj);
     }
-    m_object = lib_obj;
 }
 } // namespace bsp2
@@ -0,0 +1,205 @@
+/*!
+ * fpd_timing.cc
+ *
+ * Timing history of FPD operations and the duration model built on it
+ *
+ * Copyright (c) 2022 by Cisco Systems, Inc.
+ * All rights reserved.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <ctime>
+#include <exception>
+#include <fstream>
+#include <system_error>
+
+#include <bsp/fwd.h>
+#include <bsp/fpd.h>
+
+//
+// The history holds one JSON object per line for every operation, like
+//
+//   {"fpd":"PIM1_IOFPGA","op":"program","bytes":4194304,"secs":61.2,
+//    "time":1666000000,"phases":{"erase":20.1,"program":30.5,"verify":9.8}}
+//
+// in the first of the directories that exists, /mnt/data1 surviving a
+// reboot, or at the path in the environment variable. Past FPD_TIMING_MAX
+// bytes the file is moved to <file>.1, so two generations are kept.
+//
+#define FPD_TIMING_ENV      "FPD_TIMING_HISTORY"
+#define FPD_TIMING_DIRS     { "/mnt/data1", "/var/lib", "/var/tmp" }
+#define FPD_TIMING_FILE     "fpd_timing.json"
+#define FPD_TIMING_MAX      (256 * 1024)
+#define FPD_TIMING_RUNS     8               // latest operations a rate is taken from
+
+namespace bsp2 {
+
+//!
+//! @brief Innermost operation being timed on this thread
+//!
+static thread_local fpd_t::op_timer_t *current_op;
+
+static std::string
+timing_history_path()
+{
+    const char *env = getenv(FPD_TIMING_ENV);
+    struct stat st;
+
+    if (env && *env) {
+        return env;
+    }
+    for (const char *dir : FPD_TIMING_DIRS) {
+        if (!stat(dir, &st) && S_ISDIR(st.st_mode)) {
+            return std::string(dir) + "/" + FPD_TIMING_FILE;
+        }
+    }
+    return "";
+}
+
+static void
+timing_history_append(const json &record)
+{
+    std::string path = timing_history_path();
+    std::string line = record.dump() + "\n";
+    struct stat st;
+
+    if (path.empty()) {
+        return;
+    }
+    if (!stat(path.c_str(), &st) && st.st_size > FPD_TIMING_MAX) {
+        rename(path.c_str(), (path + ".1").c_str());
+    }
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return;
+    }
+    // A single append per record, so operations on other threads never split it
+    if (write(fd, line.data(), line.size()) < 0) {
+        std::cerr << path << ": " << strerror(errno) << std::endl;
+    }
+    close(fd);
+}
+
+fpd_t::op_timer_t::op_timer_t(const fpd_t &fpd, std::string op, bool image)
+    : m_fpd(fpd), m_op(std::move(op)), m_bytes(0),
+      m_start(std::chrono::steady_clock::now()),
+      m_exceptions(std::uncaught_exceptions()), m_outer(current_op)
+{
+    std::error_code ec;
+
+    if (image && !fpd.path().empty()) {
+        auto size = std::filesystem::file_size(fpd.path(), ec);
+        if (!ec) {
+            m_bytes = size;
+        }
+    }
+    current_op = this;
+}
+
+fpd_t::op_timer_t::~op_timer_t()
+{
+    current_op = m_outer;
+    if (std::uncaught_exceptions() > m_exceptions) {
+        return;
+    }
+
+    std::chrono::duration<double> secs = std::chrono::steady_clock::now() - m_start;
+    try {
+        timing_history_append({
+            {"fpd", m_fpd.name()},
+            {"op", m_op},
+            {"bytes", m_bytes},
+            {"secs", secs.count()},
+            {"time", (int64_t)time(NULL)},
+            {"phases", m_phases},
+        });
+    } catch (const std::exception &ex) {
+        std::cerr << m_fpd.name() << ": timing not recorded: " << ex.what() << std::endl;
+    }
+}
+
+void
+fpd_t::op_timer_t::add_phase(const std::string &phase, double secs)
+{
+    if (current_op) {
+        current_op->m_phases[phase] += secs;
+    }
+}
+
+fpd_t::estimate_t
+fpd_t::estimate(uint64_t bytes) const
+{
+    std::string path = timing_history_path();
+    std::vector<json> programs;
+    std::vector<double> activates;
+
+    for (const auto &file : {path + ".1", path}) {
+        std::ifstream in(file);
+        std::string line;
+        while (std::getline(in, line)) {
+            json j = json::parse(line, nullptr, false);
+            if (j.is_discarded() || !j.is_object() || j.value("fpd", "") != name()) {
+                continue;
+            }
+            std::string op = j.value("op", "");
+            if (op == "program" && j.value("bytes", 0.0) > 0) {
+                programs.push_back(j);
+            } else if (op == "activate") {
+                activates.push_back(j.value("secs", 0.0));
+            }
+        }
+    }
+    if (programs.empty()) {
+        std::string info(name());
+        info.append(": no program in the timing history ").append(path);
+        throw std::system_error(ENODATA, std::generic_category(), info);
+    }
+    if (programs.size() > FPD_TIMING_RUNS) {
+        programs.erase(programs.begin(), programs.end() - FPD_TIMING_RUNS);
+    }
+    if (activates.size() > FPD_TIMING_RUNS) {
+        activates.erase(activates.begin(), activates.end() - FPD_TIMING_RUNS);
+    }
+
+    //
+    // Every phase is taken to scale with the image: its time per byte over
+    // the runs, times the size. Activation is a fixed cost on top.
+    //
+    double run_bytes = 0, run_secs = 0;
+    std::map<std::string, double> phase_secs;
+    for (const auto &j : programs) {
+        run_bytes += j.value("bytes", 0.0);
+        run_secs += j.value("secs", 0.0);
+        json phases = j.value("phases", json::object());
+        for (const auto &it : phases.items()) {
+            if (it.value().is_number()) {
+                phase_secs[it.key()] += it.value().get<double>();
+            }
+        }
+    }
+
+    estimate_t e = {};
+    e.runs = programs.size();
+    e.secs = run_secs / run_bytes * bytes;
+    for (const auto &it : phase_secs) {
+        e.phases[it.first] = it.second / run_bytes * bytes;
+    }
+    if (!activates.empty()) {
+        double secs = 0;
+        for (double s : activates) {
+            secs += s;
+        }
+        secs /= activates.size();
+        e.phases["activate"] += secs;
+        e.secs += secs;
+    }
+    return e;
+}
+
+} // namespace bsp2